@@ -0,0 +1,398 @@
+// NeoShell benchmark suite: microbenchmarks of the REPL hot paths plus an
+// end-to-end replay of recorded history files through run().
+//
+//   g++ -O2 -o neoshell_bench bench/neoshell_bench.cpp -std=c++11 -pthread
+//   ./neoshell_bench --replay bench/sample_history.txt --json results.json
+//   ./neoshell_bench --baseline results.json --tolerance 10
+
+#define NEOSHELL_NO_MAIN
+#include "../neoshell.cpp"
+
+#include <cstdlib>
+#include <new>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
+
+static atomic<uint64_t> allocation_count(0);
+
+// GCC 11+ reports the free() in operator delete as mismatched even though
+// the replacement operator new below is what allocated the memory
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void *operator new(size_t size) {
+  allocation_count.fetch_add(1, memory_order_relaxed);
+  void *ptr = malloc(size ? size : 1);
+  if (!ptr)
+    throw bad_alloc();
+  return ptr;
+}
+
+void *operator new[](size_t size) {
+  allocation_count.fetch_add(1, memory_order_relaxed);
+  void *ptr = malloc(size ? size : 1);
+  if (!ptr)
+    throw bad_alloc();
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+
+struct BenchResult {
+  string name;
+  uint64_t iterations;
+  double ns_per_op;
+  double allocs_per_op;
+};
+
+// Keeps results alive so the optimizer cannot drop the measured work
+static volatile size_t bench_sink;
+
+class NeoShellBench {
+public:
+  NeoShellBench() : min_time_ms(200) {}
+
+  void runMicro() {
+    NeoShell shell;
+    shell.env_vars["HOME"] = "/home/neo";
+    shell.env_vars["USER"] = "neo";
+
+    measure("levenshteinDistance", [&]() {
+      bench_sink += shell.levenshteinDistance("procesess", "processes");
+    });
+    measure("findSimilarCommands", [&]() {
+      bench_sink += shell.findSimilarCommands("lst").size();
+    });
+    measure("split", [&]() {
+      bench_sink += shell.split("copy  report.txt   backup/report.txt", ' ')
+                        .size();
+    });
+    measure("expandVariables", [&]() {
+      bench_sink += shell.expandVariables("goto $HOME/projects/$USER").size();
+    });
+    measure("translateCommand", [&]() {
+      bench_sink += shell.translateCommand("WhereAmI").size();
+    });
+
+    FrecencyDb dirs;
+    for (int i = 0; i < 100000; i++) {
+      dirs.visit("/home/neo/src/project" + to_string(i % 700) + "/module" +
+                 to_string(i));
+    }
+    vector<string> words;
+    words.push_back("project42");
+    words.push_back("module9");
+    measure("frecencyQuery(100k)", [&]() {
+      bench_sink += dirs.query(words, 10).size();
+    });
+
+    string block(65536, 'x');
+    measure("xxh64(64K)", [&]() {
+      bench_sink += Xxh64::hash(block.data(), block.size());
+    });
+
+    string text;
+    for (int i = 0; text.size() < 65536; i++)
+      text += to_string(i * 7) + " line of ordinary command output\n";
+    text.resize(65536);
+    string packed;
+    measure("lz4Compress(64K)", [&]() {
+      lz4Compress(text.data(), text.size(), packed);
+      bench_sink += packed.size();
+    });
+
+#ifndef _WIN32
+    string old_file(1 << 20, 0), new_file;
+    for (size_t i = 0; i < old_file.size(); i++)
+      old_file[i] = (char)(i * 2654435761u >> 13);
+    new_file = old_file.substr(0, 300000) + "edit" + old_file.substr(300000);
+    measure("blockDelta(1M)", [&]() {
+      bench_sink += BlockDelta::compute((const uint8_t *)old_file.data(),
+                                        old_file.size(),
+                                        (const uint8_t *)new_file.data(),
+                                        new_file.size())
+                        .size();
+    });
+
+    string csv;
+    for (int i = 0; csv.size() < (1 << 20); i++)
+      csv += to_string(i) + ",\"name " + to_string(i % 50) + "\",eng," +
+             to_string(i * 7 % 10000) + ",some note text\n";
+    vector<CsvField> fields;
+    measure("csvScan(1M)", [&]() {
+      size_t records = 0;
+      CsvReader::read(csv.data(), csv.data() + csv.size(), ',', 4, fields,
+                      [&](size_t) { return ++records != 0; });
+      bench_sink += records;
+    });
+#endif
+
+    // The dispatch chain is inline in run(), so drive it with a stream of
+    // cheap builtins and charge the whole loop to each command
+    string script;
+    for (int i = 0; i < 1000; i++)
+      script += "print dispatch benchmark\n";
+    measureReplay("dispatch", script, 1000);
+  }
+
+  bool runReplay(const string &path) {
+    ifstream file(path.c_str());
+    if (!file.is_open()) {
+      cerr << "Error: Cannot open history file '" << path << "'" << endl;
+      return false;
+    }
+    string line, script;
+    uint64_t commands = 0;
+    while (getline(file, line)) {
+      if (line.empty() || line == "exit" || line == "quit" || line == "bye")
+        continue;
+      script += line + "\n";
+      commands++;
+    }
+    if (commands == 0) {
+      cerr << "Error: No commands in '" << path << "'" << endl;
+      return false;
+    }
+    string name = path;
+    size_t slash = name.find_last_of("/\\");
+    if (slash != string::npos)
+      name = name.substr(slash + 1);
+    measureReplay("replay:" + name, script, commands);
+    return true;
+  }
+
+  void print() const {
+    cout << left << setw(28) << "benchmark" << right << setw(12) << "iters"
+         << setw(14) << "time/op" << setw(14) << "ops/sec" << setw(12)
+         << "allocs/op" << endl;
+    for (const BenchResult &r : results) {
+      char allocs[32];
+      snprintf(allocs, sizeof(allocs), "%.1f", r.allocs_per_op);
+      cout << left << setw(28) << r.name << right << setw(12) << r.iterations
+           << setw(14) << formatDuration((uint64_t)r.ns_per_op) << setw(14)
+           << (uint64_t)(1e9 / max(r.ns_per_op, 1.0)) << setw(12) << allocs
+           << endl;
+    }
+  }
+
+  bool writeJson(const string &path) const {
+    ofstream out(path.c_str());
+    if (!out.is_open())
+      return false;
+    out << "{\"benchmarks\":[";
+    for (size_t i = 0; i < results.size(); i++) {
+      const BenchResult &r = results[i];
+      char buffer[256];
+      snprintf(buffer, sizeof(buffer),
+               "%s\n{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.2f,"
+               "\"ops_per_sec\":%.1f,\"allocs_per_op\":%.2f}",
+               i ? "," : "", jsonEscape(r.name).c_str(),
+               (unsigned long long)r.iterations, r.ns_per_op,
+               1e9 / max(r.ns_per_op, 1.0), r.allocs_per_op);
+      out << buffer;
+    }
+    out << "\n]}\n";
+    return true;
+  }
+
+  // Compares against a previous --json file. Returns the number of
+  // benchmarks that got slower (or allocate more) beyond the tolerance.
+  int compare(const string &path, double tolerance_pct) const {
+    ifstream file(path.c_str());
+    if (!file.is_open()) {
+      cerr << "Error: Cannot open baseline '" << path << "'" << endl;
+      return -1;
+    }
+    stringstream ss;
+    ss << file.rdbuf();
+    string json = ss.str();
+
+    int regressions = 0;
+    cout << "\nComparison with " << path << " (tolerance " << tolerance_pct
+         << "%):" << endl;
+    for (const BenchResult &r : results) {
+      double base_ns, base_allocs;
+      if (!findBaseline(json, r.name, base_ns, base_allocs)) {
+        cout << "  " << left << setw(28) << r.name << "new" << endl;
+        continue;
+      }
+      double change = (r.ns_per_op - base_ns) / base_ns * 100.0;
+      bool slower = change > tolerance_pct;
+      bool allocates = r.allocs_per_op > base_allocs + 0.5;
+      char buffer[64];
+      snprintf(buffer, sizeof(buffer), "%+.1f%%", change);
+      cout << "  " << left << setw(28) << r.name << right << setw(9) << buffer;
+      if (slower || allocates) {
+        cout << "  REGRESSION";
+        if (allocates)
+          cout << " (allocs " << base_allocs << " -> " << r.allocs_per_op
+               << ")";
+        regressions++;
+      }
+      cout << endl;
+    }
+    return regressions;
+  }
+
+  int min_time_ms;
+
+private:
+  vector<BenchResult> results;
+
+  template <typename Fn> void measure(const string &name, Fn fn) {
+    for (int i = 0; i < 100; i++)
+      fn();
+
+    uint64_t iterations = 0;
+    uint64_t batch = 64;
+    uint64_t allocs_before = allocation_count.load();
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    uint64_t elapsed = 0;
+    while (elapsed < (uint64_t)min_time_ms * 1000000) {
+      for (uint64_t i = 0; i < batch; i++)
+        fn();
+      iterations += batch;
+      batch *= 2;
+      elapsed = elapsedNanos(start, chrono::steady_clock::now());
+    }
+    uint64_t allocs = allocation_count.load() - allocs_before;
+
+    BenchResult r;
+    r.name = name;
+    r.iterations = iterations;
+    r.ns_per_op = (double)elapsed / iterations;
+    r.allocs_per_op = (double)allocs / iterations;
+    results.push_back(r);
+  }
+
+  // Feeds a script through fresh shells' REPLs at full speed with all
+  // output discarded, repeating until min_time_ms, and reports the cost per
+  // command
+  void measureReplay(const string &name, const string &script,
+                     uint64_t commands) {
+    stringstream null_out;
+    streambuf *saved_in = cin.rdbuf();
+    streambuf *saved_out = cout.rdbuf(null_out.rdbuf());
+#ifndef _WIN32
+    // Child processes write straight to the terminal; silence them too
+    fflush(stdout);
+    int saved_fd1 = dup(1), saved_fd2 = dup(2);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, 1);
+    dup2(devnull, 2);
+    close(devnull);
+#endif
+
+    uint64_t elapsed = 0, allocs = 0, rounds = 0;
+    while (rounds == 0 || elapsed < (uint64_t)min_time_ms * 1000000) {
+      NeoShell shell;
+      istringstream in(script);
+      cin.clear();
+      cin.rdbuf(in.rdbuf());
+      null_out.str("");
+      uint64_t allocs_before = allocation_count.load();
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      shell.run();
+      elapsed += elapsedNanos(start, chrono::steady_clock::now());
+      allocs += allocation_count.load() - allocs_before;
+      rounds++;
+    }
+
+#ifndef _WIN32
+    dup2(saved_fd1, 1);
+    dup2(saved_fd2, 2);
+    close(saved_fd1);
+    close(saved_fd2);
+#endif
+    cin.rdbuf(saved_in);
+    cin.clear();
+    cout.rdbuf(saved_out);
+
+    BenchResult r;
+    r.name = name;
+    r.iterations = commands * rounds;
+    r.ns_per_op = (double)elapsed / r.iterations;
+    r.allocs_per_op = (double)allocs / r.iterations;
+    results.push_back(r);
+  }
+
+  static bool findBaseline(const string &json, const string &name,
+                           double &ns_per_op, double &allocs_per_op) {
+    size_t pos = json.find("\"name\":\"" + jsonEscape(name) + "\"");
+    if (pos == string::npos)
+      return false;
+    size_t end = json.find('}', pos);
+    size_t ns = json.find("\"ns_per_op\":", pos);
+    size_t al = json.find("\"allocs_per_op\":", pos);
+    if (ns == string::npos || al == string::npos || ns > end || al > end)
+      return false;
+    ns_per_op = atof(json.c_str() + ns + 12);
+    allocs_per_op = atof(json.c_str() + al + 16);
+    return ns_per_op > 0;
+  }
+};
+
+int main(int argc, char **argv) {
+  NeoShellBench bench;
+  vector<string> replays;
+  string json_path, baseline_path;
+  double tolerance = 10.0;
+  bool micro = true;
+
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--replay" && i + 1 < argc) {
+      replays.push_back(argv[++i]);
+    } else if (arg == "--json" && i + 1 < argc) {
+      json_path = argv[++i];
+    } else if (arg == "--baseline" && i + 1 < argc) {
+      baseline_path = argv[++i];
+    } else if (arg == "--tolerance" && i + 1 < argc) {
+      tolerance = atof(argv[++i]);
+    } else if (arg == "--min-time" && i + 1 < argc) {
+      bench.min_time_ms = atoi(argv[++i]);
+    } else if (arg == "--no-micro") {
+      micro = false;
+    } else {
+      cout << "Usage: neoshell_bench [--replay <history file>]... "
+              "[--json <file>]"
+           << endl;
+      cout << "                      [--baseline <file>] [--tolerance <pct>] "
+              "[--min-time <ms>] [--no-micro]"
+           << endl;
+      return 2;
+    }
+  }
+
+  if (micro)
+    bench.runMicro();
+  for (const string &path : replays) {
+    if (!bench.runReplay(path))
+      return 2;
+  }
+
+  bench.print();
+
+  if (!json_path.empty()) {
+    if (!bench.writeJson(json_path)) {
+      cerr << "Error: Cannot write '" << json_path << "'" << endl;
+      return 2;
+    }
+    cout << "\nResults written to " << json_path << endl;
+  }
+
+  if (!baseline_path.empty()) {
+    int regressions = bench.compare(baseline_path, tolerance);
+    if (regressions < 0)
+      return 2;
+    if (regressions > 0) {
+      cout << "\n" << regressions << " regression(s) found" << endl;
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -1,23 +1,67 @@
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
 #include <ctime>
+#include <deque>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef _WIN32
+#include <io.h>
 #include <lmcons.h>
 #include <windows.h>
 #else
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
 #include <pwd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/utsname.h>
 #include <sys/wait.h>
+#include <termios.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+extern char **environ;
 #endif
 
 using namespace std;
@@ -28,235 +72,6834 @@ struct Command {
   bool background;
 };
 
-class NeoShell {
-private:
-  string username;
-  string current_theme;
-  vector<string> history;
-  map<string, string> aliases;
-  map<string, string> env_vars;
-  map<string, string> bookmarks;
-  map<string, string> command_map;
-  vector<string> todo_list;
-  bool show_timestamps;
-  bool smart_suggest;
-  int command_count;
-  time_t session_start;
+// Stages of one trip around the REPL loop, in the order they happen
+enum Stage {
+  STAGE_READ,
+  STAGE_EXPAND,
+  STAGE_ALIAS,
+  STAGE_PARSE,
+  STAGE_DISPATCH,
+  STAGE_EXEC,
+  STAGE_WAIT,
+  STAGE_COUNT
+};
 
-  void initializeCommandMap() {
-    // File and Directory Operations
-    command_map["list"] = "ls";
-    command_map["show"] = "ls";
-    command_map["files"] = "ls";
+static const char *const STAGE_NAMES[STAGE_COUNT] = {
+    "read", "expand", "alias", "parse", "dispatch", "exec", "wait"};
 
-    command_map["where"] = "pwd";
-    command_map["whereami"] = "pwd";
-    command_map["location"] = "pwd";
-    command_map["current"] = "pwd";
+static uint64_t elapsedNanos(chrono::steady_clock::time_point from,
+                             chrono::steady_clock::time_point to) {
+  return chrono::duration_cast<chrono::nanoseconds>(to - from).count();
+}
 
-    command_map["goto"] = "cd";
-    command_map["go"] = "cd";
-    command_map["navigate"] = "cd";
-    command_map["moveto"] = "cd";
+// Background threads leave signals to the main thread, which may be
+// collecting them through a signalfd
+static void blockThreadSignals() {
+#ifndef _WIN32
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+#endif
+}
 
-    command_map["makedir"] = "mkdir";
-    command_map["createdir"] = "mkdir";
-    command_map["newfolder"] = "mkdir";
+static bool directoryExists(const string &path) {
+#ifdef _WIN32
+  DWORD attributes = GetFileAttributesA(path.c_str());
+  return attributes != INVALID_FILE_ATTRIBUTES &&
+         (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
 
-    command_map["remove"] = "rm";
-    command_map["delete"] = "rm";
-    command_map["erase"] = "rm";
+static string formatDuration(uint64_t ns) {
+  char buffer[32];
+  if (ns < 1000) {
+    snprintf(buffer, sizeof(buffer), "%uns", (unsigned)ns);
+  } else if (ns < 1000000) {
+    snprintf(buffer, sizeof(buffer), "%.1fus", ns / 1e3);
+  } else if (ns < 1000000000) {
+    snprintf(buffer, sizeof(buffer), "%.2fms", ns / 1e6);
+  } else {
+    snprintf(buffer, sizeof(buffer), "%.2fs", ns / 1e9);
+  }
+  return buffer;
+}
 
-    command_map["duplicate"] = "cp";
+static string jsonEscape(const string &str) {
+  string out;
+  out.reserve(str.size() + 2);
+  for (unsigned char c : str) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20) {
+      char buffer[8];
+      snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+      out += buffer;
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
 
-    command_map["move"] = "mv";
-    command_map["rename"] = "mv";
+// Log-linear histogram in the style of HdrHistogram. Each power of two is
+// split into 16 linear sub-buckets (~3% relative error), so recording is a
+// count-leading-zeros and an increment. Values are nanoseconds, capped at
+// 2^40 (about 18 minutes).
+class LatencyHistogram {
+public:
+  static const int SUB_BITS = 5;
+  static const int SUB_COUNT = 1 << SUB_BITS;
+  static const int HALF_COUNT = SUB_COUNT / 2;
+  static const int MAX_BITS = 40;
+  static const int BUCKET_COUNT = (MAX_BITS - SUB_BITS + 2) * HALF_COUNT;
+
+  LatencyHistogram() { reset(); }
+
+  void reset() {
+    memset(counts, 0, sizeof(counts));
+    count = 0;
+    total = 0;
+    max_value = 0;
+  }
 
-    command_map["read"] = "cat";
-    command_map["view"] = "cat";
-    command_map["display"] = "cat";
+  void record(uint64_t value) {
+    if (value >= (uint64_t(1) << MAX_BITS))
+      value = (uint64_t(1) << MAX_BITS) - 1;
+    counts[bucketIndex(value)]++;
+    count++;
+    total += value;
+    if (value > max_value)
+      max_value = value;
+  }
 
-    command_map["find"] = "find";
-    command_map["search"] = "find";
-    command_map["locate"] = "find";
+  // Highest value equivalent to the bucket holding the p-th percentile
+  uint64_t percentile(double p) const {
+    if (count == 0)
+      return 0;
+    uint64_t target = (uint64_t)ceil(p / 100.0 * count);
+    if (target == 0)
+      target = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKET_COUNT; i++) {
+      seen += counts[i];
+      if (seen >= target)
+        return min(bucketHighest(i), max_value);
+    }
+    return max_value;
+  }
 
-    command_map["edit"] = "nano";
-    command_map["modify"] = "nano";
+  uint64_t samples() const { return count; }
+  uint64_t maximum() const { return max_value; }
+  uint64_t mean() const { return count ? total / count : 0; }
 
-    // Text Operations
-    command_map["print"] = "echo";
-    command_map["say"] = "echo";
-    command_map["write"] = "echo";
+  string toJson() const {
+    stringstream ss;
+    ss << "{\"count\":" << count << ",\"p50_ns\":" << percentile(50)
+       << ",\"p99_ns\":" << percentile(99) << ",\"max_ns\":" << max_value
+       << ",\"mean_ns\":" << mean() << "}";
+    return ss.str();
+  }
 
-    command_map["count"] = "wc";
-    command_map["lines"] = "wc";
-    command_map["words"] = "wc";
+private:
+  uint32_t counts[BUCKET_COUNT];
+  uint64_t count;
+  uint64_t total;
+  uint64_t max_value;
+
+  static int bucketIndex(uint64_t value) {
+    if (value < (uint64_t)SUB_COUNT)
+      return (int)value;
+    int msb = 63 - __builtin_clzll(value);
+    int exp = msb - (SUB_BITS - 1);
+    return exp * HALF_COUNT + (int)(value >> exp);
+  }
 
-    command_map["filter"] = "grep";
-    command_map["match"] = "grep";
+  static uint64_t bucketHighest(int index) {
+    if (index < SUB_COUNT)
+      return index;
+    int exp = index / HALF_COUNT - 1;
+    uint64_t mantissa = index % HALF_COUNT + HALF_COUNT;
+    return ((mantissa + 1) << exp) - 1;
+  }
+};
 
-    command_map["order"] = "sort";
-    command_map["arrange"] = "sort";
+struct CommandTimings {
+  LatencyHistogram total;
+  LatencyHistogram stages[STAGE_COUNT];
+};
 
-    command_map["distinct"] = "uniq";
+struct TraceEvent {
+  const char *category;
+  char name[48];
+  uint64_t start_ns;
+  uint64_t duration_ns;
+  int child_pid;
+  int exit_code;
+};
 
-    command_map["first"] = "head";
-    command_map["top"] = "head";
+// Records spans into a single-producer/single-consumer ring buffer. The REPL
+// thread only ever pushes; a background thread drains the ring and writes
+// Chrome Trace Event JSON, which chrome://tracing and Perfetto both load.
+// When tracing is off every span costs the one branch in span().
+class TraceRecorder {
+public:
+  static const size_t CAPACITY = 8192;
+
+  TraceRecorder() : enabled(false), head(0), tail(0), dropped(0), written(0) {}
+  ~TraceRecorder() { stop(); }
+
+  bool active() const { return enabled; }
+
+  bool start(const string &path) {
+    stop();
+    out.open(path.c_str(), ios::out | ios::trunc);
+    if (!out.is_open())
+      return false;
+    ring.assign(CAPACITY, TraceEvent());
+    head.store(0);
+    tail.store(0);
+    dropped = 0;
+    written = 0;
+    epoch = chrono::steady_clock::now();
+    file_path = path;
+#ifdef _WIN32
+    trace_pid = (int)GetCurrentProcessId();
+#else
+    trace_pid = (int)getpid();
+#endif
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+        << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << trace_pid
+        << ",\"args\":{\"name\":\"neoshell\"}}";
+    flushing.store(true);
+    enabled = true;
+    flusher = thread(&TraceRecorder::flushLoop, this);
+    return true;
+  }
 
-    command_map["last"] = "tail";
-    command_map["bottom"] = "tail";
+  void stop() {
+    if (!enabled)
+      return;
+    enabled = false;
+    {
+      lock_guard<mutex> lock(wake_mutex);
+      flushing.store(false);
+    }
+    wake.notify_one();
+    flusher.join();
+    drain();
+    out << "\n]}\n";
+    out.close();
+  }
 
-    // System Operations
-    command_map["who"] = "whoami";
-    command_map["user"] = "whoami";
-    command_map["me"] = "whoami";
+  void span(const char *category, const char *name,
+            chrono::steady_clock::time_point start,
+            chrono::steady_clock::time_point end, int child_pid = 0,
+            int exit_code = 0) {
+    if (!enabled)
+      return;
+    push(category, name, start, end, child_pid, exit_code);
+  }
 
-    command_map["when"] = "date";
-    command_map["time"] = "date";
-    command_map["now"] = "date";
+  const string &path() const { return file_path; }
+  uint64_t eventsWritten() const { return written; }
+  uint64_t eventsDropped() const { return dropped; }
 
-    command_map["running"] = "ps";
-    command_map["processes"] = "ps";
-    command_map["tasks"] = "ps";
+private:
+  bool enabled;
+  vector<TraceEvent> ring;
+  atomic<size_t> head;
+  atomic<size_t> tail;
+  uint64_t dropped;
+  atomic<uint64_t> written;
+  chrono::steady_clock::time_point epoch;
+  int trace_pid;
+  string file_path;
+  ofstream out;
+  thread flusher;
+  atomic<bool> flushing;
+  mutex wake_mutex;
+  condition_variable wake;
+
+  void push(const char *category, const char *name,
+            chrono::steady_clock::time_point start,
+            chrono::steady_clock::time_point end, int child_pid,
+            int exit_code) {
+    size_t h = head.load(memory_order_relaxed);
+    if (h - tail.load(memory_order_acquire) >= CAPACITY) {
+      dropped++;
+      return;
+    }
+    TraceEvent &event = ring[h & (CAPACITY - 1)];
+    event.category = category;
+    strncpy(event.name, name, sizeof(event.name) - 1);
+    event.name[sizeof(event.name) - 1] = '\0';
+    event.start_ns = start > epoch ? elapsedNanos(epoch, start) : 0;
+    event.duration_ns = end > start ? elapsedNanos(start, end) : 0;
+    event.child_pid = child_pid;
+    event.exit_code = exit_code;
+    head.store(h + 1, memory_order_release);
+  }
 
-    command_map["stop"] = "kill";
-    command_map["terminate"] = "kill";
+  void flushLoop() {
+    blockThreadSignals();
+    unique_lock<mutex> lock(wake_mutex);
+    while (flushing.load()) {
+      wake.wait_for(lock, chrono::milliseconds(100));
+      lock.unlock();
+      drain();
+      lock.lock();
+    }
+  }
 
-    command_map["diskspace"] = "df";
-    command_map["space"] = "df";
-    command_map["storage"] = "df";
+  void drain() {
+    size_t t = tail.load(memory_order_relaxed);
+    size_t h = head.load(memory_order_acquire);
+    for (; t != h; t++) {
+      const TraceEvent &event = ring[t & (CAPACITY - 1)];
+      char buffer[160];
+      // Child processes get their own track, keyed by their pid
+      snprintf(buffer, sizeof(buffer),
+               ",\n{\"ph\":\"X\",\"cat\":\"%s\",\"pid\":%d,\"tid\":%d,"
+               "\"ts\":%.3f,\"dur\":%.3f,\"name\":\"",
+               event.category, trace_pid,
+               event.child_pid ? event.child_pid : trace_pid,
+               event.start_ns / 1e3, event.duration_ns / 1e3);
+      out << buffer << jsonEscape(event.name) << "\"";
+      if (event.child_pid) {
+        out << ",\"args\":{\"child_pid\":" << event.child_pid
+            << ",\"exit_code\":" << event.exit_code << "}";
+      }
+      out << "}";
+      written++;
+    }
+    tail.store(t, memory_order_release);
+    out.flush();
+  }
+};
 
-    command_map["memory"] = "free";
-    command_map["ram"] = "free";
+// Receives a copy of everything the shell prints, from builtins and from
+// child processes alike
+class OutputSink {
+public:
+  virtual ~OutputSink() {}
+  virtual void onOutput(const char *data, size_t size) = 0;
+};
 
-    command_map["system"] = "uname";
+// Installed as cout's buffer: forwards to the real buffer and hands each
+// write to the registered sinks
+class TeeStreambuf : public streambuf {
+public:
+  explicit TeeStreambuf(streambuf *target) : target(target) {}
 
-    // Utilities
-    command_map["clean"] = "clear";
-    command_map["cls"] = "clear";
+  void addSink(OutputSink *sink) { sinks.push_back(sink); }
+  void removeSink(OutputSink *sink) {
+    sinks.erase(std::remove(sinks.begin(), sinks.end(), sink), sinks.end());
+  }
+  bool hasSinks() const { return !sinks.empty(); }
+  streambuf *original() const { return target; }
 
-    command_map["commands"] = "help";
+  // Output that bypassed cout, e.g. a child process writing to a pipe
+  void feed(const char *data, size_t size) {
+    for (size_t i = 0; i < sinks.size(); i++)
+      sinks[i]->onOutput(data, size);
   }
 
-  void getUsername() {
-#ifdef _WIN32
-    char buffer[UNLEN + 1];
-    DWORD size = UNLEN + 1;
-    username = GetUserNameA(buffer, &size) ? string(buffer) : "user";
-#else
-    struct passwd *pw = getpwuid(getuid());
-    username = pw ? string(pw->pw_name) : "user";
-#endif
-    transform(username.begin(), username.end(), username.begin(), ::tolower);
+protected:
+  int overflow(int c) {
+    if (c == EOF)
+      return 0;
+    char ch = (char)c;
+    feed(&ch, 1);
+    return target->sputc(ch);
   }
 
-  string getCurrentTime() {
-    time_t now = time(0);
-    tm *ltm = localtime(&now);
-    stringstream ss;
-    ss << setfill('0') << setw(2) << ltm->tm_hour << ":" << setw(2)
-       << ltm->tm_min << ":" << setw(2) << ltm->tm_sec;
-    return ss.str();
+  streamsize xsputn(const char *data, streamsize size) {
+    feed(data, (size_t)size);
+    return target->sputn(data, size);
   }
 
-  string getCurrentPath() {
-#ifdef _WIN32
-    char buffer[MAX_PATH];
-    GetCurrentDirectoryA(MAX_PATH, buffer);
-    return string(buffer);
-#else
-    char buffer[1024];
-    return getcwd(buffer, sizeof(buffer)) ? string(buffer) : "";
+  int sync() { return target->pubsync(); }
+
+private:
+  streambuf *target;
+  vector<OutputSink *> sinks;
+};
+
+class ByteCounter : public OutputSink {
+public:
+  ByteCounter() : bytes(0) {}
+  void onOutput(const char *, size_t size) { bytes += size; }
+  uint64_t bytes;
+};
+
+static void putVarint(string &out, uint64_t value) {
+  while (value >= 0x80) {
+    out += (char)(value | 0x80);
+    value >>= 7;
+  }
+  out += (char)value;
+}
+
+static bool getVarint(const char *&pos, const char *end, uint64_t &value) {
+  value = 0;
+  for (int shift = 0; pos < end && shift < 64; shift += 7) {
+    uint8_t byte = (uint8_t)*pos++;
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+static uint64_t rotl64(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t readLe64(const uint8_t *p) {
+  uint64_t value;
+  memcpy(&value, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  value = __builtin_bswap64(value);
+#endif
+  return value;
+}
+
+static uint32_t readLe32(const uint8_t *p) {
+  uint32_t value;
+  memcpy(&value, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  value = __builtin_bswap32(value);
 #endif
+  return value;
+}
+
+static void putLe64(string &out, uint64_t value) {
+  for (int i = 0; i < 8; i++)
+    out += (char)(value >> (8 * i));
+}
+
+static const uint64_t XXH_PRIME1 = 11400714785074694791ULL;
+static const uint64_t XXH_PRIME2 = 14029467366897019727ULL;
+static const uint64_t XXH_PRIME3 = 1609587929392839161ULL;
+static const uint64_t XXH_PRIME4 = 9650029242287828579ULL;
+static const uint64_t XXH_PRIME5 = 2870177450012600261ULL;
+
+// Streaming XXH64; digests match xxhsum -H1. Four independent lanes keep
+// the multipliers busy, so it runs at memory speed without intrinsics.
+class Xxh64 {
+public:
+  explicit Xxh64(uint64_t seed = 0) : seed(seed), total(0), buffered(0) {
+    lanes[0] = seed + XXH_PRIME1 + XXH_PRIME2;
+    lanes[1] = seed + XXH_PRIME2;
+    lanes[2] = seed;
+    lanes[3] = seed - XXH_PRIME1;
   }
 
-  vector<string> split(const string &str, char delimiter) {
-    vector<string> tokens;
-    stringstream ss(str);
-    string token;
-    while (getline(ss, token, delimiter)) {
-      token.erase(0, token.find_first_not_of(" \t\r\n"));
-      token.erase(token.find_last_not_of(" \t\r\n") + 1);
-      if (!token.empty())
-        tokens.push_back(token);
+  void update(const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *)data, *end = p + size;
+    total += size;
+    if (buffered + size < 32) {
+      memcpy(buffer + buffered, p, size);
+      buffered += size;
+      return;
     }
-    return tokens;
+    if (buffered > 0) {
+      size_t fill = 32 - buffered;
+      memcpy(buffer + buffered, p, fill);
+      stripe(buffer);
+      p += fill;
+      buffered = 0;
+    }
+    for (; end - p >= 32; p += 32)
+      stripe(p);
+    buffered = end - p;
+    memcpy(buffer, p, buffered);
   }
 
-  int levenshteinDistance(const string &s1, const string &s2) {
-    int m = s1.length(), n = s2.length();
-    vector<vector<int>> dp(m + 1, vector<int>(n + 1));
+  uint64_t digest() const {
+    uint64_t h;
+    if (total >= 32) {
+      h = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) +
+          rotl64(lanes[3], 18);
+      for (int i = 0; i < 4; i++)
+        h = (h ^ round(0, lanes[i])) * XXH_PRIME1 + XXH_PRIME4;
+    } else {
+      h = seed + XXH_PRIME5;
+    }
+    h += total;
+
+    const uint8_t *p = buffer, *end = buffer + buffered;
+    for (; end - p >= 8; p += 8)
+      h = rotl64(h ^ round(0, readLe64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    if (end - p >= 4) {
+      h = rotl64(h ^ (readLe32(p) * XXH_PRIME1), 23) * XXH_PRIME2 + XXH_PRIME3;
+      p += 4;
+    }
+    for (; p < end; p++)
+      h = rotl64(h ^ (*p * XXH_PRIME5), 11) * XXH_PRIME1;
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+  }
 
-    for (int i = 0; i <= m; i++)
-      dp[i][0] = i;
-    for (int j = 0; j <= n; j++)
-      dp[0][j] = j;
+  static uint64_t hash(const void *data, size_t size, uint64_t seed = 0) {
+    Xxh64 state(seed);
+    state.update(data, size);
+    return state.digest();
+  }
 
-    for (int i = 1; i <= m; i++) {
-      for (int j = 1; j <= n; j++) {
-        if (s1[i - 1] == s2[j - 1]) {
-          dp[i][j] = dp[i - 1][j - 1];
-        } else {
-          dp[i][j] = 1 + min({dp[i - 1][j], dp[i][j - 1], dp[i - 1][j - 1]});
-        }
+private:
+  uint64_t seed;
+  uint64_t lanes[4];
+  uint64_t total;
+  uint8_t buffer[32];
+  size_t buffered;
+
+  static uint64_t round(uint64_t acc, uint64_t input) {
+    return rotl64(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+  }
+
+  void stripe(const uint8_t *p) {
+    for (int i = 0; i < 4; i++)
+      lanes[i] = round(lanes[i], readLe64(p + 8 * i));
+  }
+};
+
+// Streaming SHA-256 (FIPS 180-4), for when a collision-resistant digest
+// is wanted
+class Sha256 {
+public:
+  Sha256() : total(0), buffered(0) {
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                        0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                        0x1f83d9ab, 0x5be0cd19};
+    memcpy(state, initial, sizeof(state));
+  }
+
+  void update(const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *)data;
+    total += size;
+    if (buffered > 0) {
+      size_t fill = min(size, 64 - buffered);
+      memcpy(buffer + buffered, p, fill);
+      buffered += fill;
+      p += fill;
+      size -= fill;
+      if (buffered < 64)
+        return;
+      block(buffer);
+      buffered = 0;
+    }
+    for (; size >= 64; p += 64, size -= 64)
+      block(p);
+    memcpy(buffer, p, size);
+    buffered = size;
+  }
+
+  void digest(uint8_t out[32]) {
+    uint64_t bits = total * 8;
+    uint8_t pad = 0x80;
+    update(&pad, 1);
+    pad = 0;
+    while (buffered != 56)
+      update(&pad, 1);
+    uint8_t length[8];
+    for (int i = 0; i < 8; i++)
+      length[i] = (uint8_t)(bits >> (56 - 8 * i));
+    update(length, 8);
+    for (int i = 0; i < 8; i++) {
+      for (int j = 0; j < 4; j++)
+        out[4 * i + j] = (uint8_t)(state[i] >> (24 - 8 * j));
+    }
+  }
+
+private:
+  uint32_t state[8];
+  uint64_t total;
+  uint8_t buffer[64];
+  size_t buffered;
+
+  static uint32_t rotr(uint32_t value, int bits) {
+    return (value >> bits) | (value << (32 - bits));
+  }
+
+  void block(const uint8_t *p) {
+    static const uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+        0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+        0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+        0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+        0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+        0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+        0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+      w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+             (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+      uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) +
+                    ((e & f) ^ (~e & g)) + K[i] + w[i];
+      uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) +
+                    ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+};
+
+static string hexString(const uint8_t *data, size_t size) {
+  static const char digits[] = "0123456789abcdef";
+  string out(size * 2, '0');
+  for (size_t i = 0; i < size; i++) {
+    out[2 * i] = digits[data[i] >> 4];
+    out[2 * i + 1] = digits[data[i] & 15];
+  }
+  return out;
+}
+
+// Compresses one block (at most 64K) in the LZ4 block format: runs of
+// literals alternating with matches of 4+ bytes at most 64K back. Tuned
+// for speed, as in LZ4's fast mode: one hash probe per position, and the
+// step grows while nothing matches so incompressible data passes quickly.
+static void lz4Compress(const char *data, size_t size, string &out) {
+  const uint8_t *src = (const uint8_t *)data;
+  out.resize(size + size / 255 + 16);
+  uint8_t *op = (uint8_t *)&out[0];
+  uint16_t table[4096];
+  memset(table, 0, sizeof(table));
+
+  auto emit = [&](size_t literal_start, size_t literals, size_t offset,
+                  size_t match) {
+    uint8_t *token = op++;
+    size_t lit = literals, ml = match >= 4 ? match - 4 : 0;
+    *token = (uint8_t)((min<size_t>(lit, 15) << 4) |
+                       (match ? min<size_t>(ml, 15) : 0));
+    if (lit >= 15) {
+      for (lit -= 15; lit >= 255; lit -= 255)
+        *op++ = 255;
+      *op++ = (uint8_t)lit;
+    }
+    memcpy(op, src + literal_start, literals);
+    op += literals;
+    if (!match)
+      return;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    if (ml >= 15) {
+      for (ml -= 15; ml >= 255; ml -= 255)
+        *op++ = 255;
+      *op++ = (uint8_t)ml;
+    }
+  };
+
+  // The format wants the last 5 bytes as literals and no match starting
+  // in the last 12
+  size_t anchor = 0, pos = 1, misses = 0;
+  if (size > 12) {
+    size_t match_limit = size - 12, extend_limit = size - 5;
+    while (pos < match_limit) {
+      uint32_t sequence = readLe32(src + pos);
+      uint32_t hash = (sequence * 2654435761u) >> 20;
+      size_t candidate = table[hash];
+      table[hash] = (uint16_t)pos;
+      if (candidate >= pos || readLe32(src + candidate) != sequence) {
+        pos += 1 + (misses++ >> 6);
+        continue;
+      }
+      while (pos > anchor && candidate > 0 &&
+             src[pos - 1] == src[candidate - 1]) {
+        pos--;
+        candidate--;
+      }
+      // Eight bytes at a time while they agree, then byte by byte
+      size_t length = 4;
+      while (pos + length + 8 <= extend_limit &&
+             memcmp(src + pos + length, src + candidate + length, 8) == 0)
+        length += 8;
+      while (pos + length < extend_limit &&
+             src[pos + length] == src[candidate + length])
+        length++;
+      emit(anchor, pos - anchor, pos - candidate, length);
+      pos += length;
+      anchor = pos;
+      misses = 0;
+    }
+  }
+  emit(anchor, size - anchor, 0, 0);
+  out.resize(op - (uint8_t *)&out[0]);
+}
+
+static bool lz4Decompress(const char *data, size_t size, char *output,
+                          size_t output_size) {
+  const uint8_t *ip = (const uint8_t *)data, *iend = ip + size;
+  uint8_t *op = (uint8_t *)output, *oend = op + output_size;
+  while (ip < iend) {
+    unsigned token = *ip++;
+    size_t literals = token >> 4;
+    if (literals == 15) {
+      while (ip < iend) {
+        uint8_t more = *ip++;
+        literals += more;
+        if (more != 255)
+          break;
+      }
+    }
+    if (literals > (size_t)(iend - ip) || literals > (size_t)(oend - op))
+      return false;
+    memcpy(op, ip, literals);
+    ip += literals;
+    op += literals;
+    if (ip == iend)
+      break;
+    if (iend - ip < 2)
+      return false;
+    size_t offset = ip[0] | (size_t)ip[1] << 8;
+    ip += 2;
+    size_t match = token & 15;
+    if (match == 15) {
+      while (ip < iend) {
+        uint8_t more = *ip++;
+        match += more;
+        if (more != 255)
+          break;
+      }
+    }
+    match += 4;
+    if (offset == 0 || offset > (size_t)(op - (uint8_t *)output) ||
+        match > (size_t)(oend - op))
+      return false;
+    const uint8_t *from = op - offset;
+    if (offset >= match) {
+      memcpy(op, from, match);
+      op += match;
+    } else {
+      while (match--)
+        *op++ = *from++;
+    }
+  }
+  return op == oend;
+}
+
+struct CapturedBlock {
+  string data;
+  uint64_t serial;
+  uint32_t raw_size;
+  bool compressed;
+};
+
+struct CapturedCommand {
+  size_t number; // history number
+  string command;
+  deque<CapturedBlock> blocks;
+  uint64_t bytes;
+  bool truncated;
+};
+
+// Keeps what recent commands printed, in 64K blocks, within a memory
+// limit. The oldest blocks go first, so a command that alone outgrows the
+// limit keeps its most recent output. While a command runs its output is
+// only copied into blocks; once it finishes, a background thread
+// compresses whatever of it is still kept. A large output therefore costs
+// no more than the copy, and nothing is compressed only to be dropped.
+//
+// Only the REPL thread adds or drops commands and blocks. The compressor
+// just swaps a block's contents, and both sides hold state_mutex for it.
+class OutputCapture : public OutputSink {
+public:
+  static const size_t CHUNK_SIZE = 1 << 16;
+  static const size_t MAX_COMMANDS = 1000;
+  static const size_t COMPRESS_MIN = 4096;
+  static const uint64_t DEFAULT_LIMIT = 16 << 20;
+
+  // Off until given a limit
+  OutputCapture()
+      : limit(0), stored(0), active(false), next_serial(0),
+        compressing(false) {}
+  ~OutputCapture() { stopCompressor(); }
+
+  void begin(size_t number, const string &command) {
+    end();
+    if (limit == 0)
+      return;
+    staging.reserve(CHUNK_SIZE);
+    active = true;
+    lock_guard<mutex> lock(state_mutex);
+    captured.push_back(CapturedCommand());
+    CapturedCommand &entry = captured.back();
+    entry.number = number;
+    entry.command = command;
+    entry.bytes = 0;
+    entry.truncated = false;
+    stored += command.size();
+    trim();
+  }
+
+  // Seals the running command's output; commands that printed nothing
+  // are not kept
+  void end() {
+    if (!active)
+      return;
+    seal();
+    active = false;
+    CapturedCommand &entry = captured.back();
+    if (entry.bytes == 0) {
+      lock_guard<mutex> lock(state_mutex);
+      dropBack();
+      return;
+    }
+    // Short outputs, which is all most builtins print, stay as they are:
+    // compressing them would save little and cost a thread wakeup
+    if (entry.bytes < COMPRESS_MIN)
+      return;
+    {
+      lock_guard<mutex> lock(state_mutex);
+      for (const CapturedBlock &block : entry.blocks)
+        pending.push_back(make_pair(block.serial, entry.number));
+    }
+    if (!compressing) {
+      compressing = true;
+      compressor = thread(&OutputCapture::compressLoop, this);
+    }
+    wake.notify_one();
+  }
+
+  // Forgets the running command, e.g. one that is replaying old output
+  void discard() {
+    if (!active)
+      return;
+    staging.clear();
+    active = false;
+    lock_guard<mutex> lock(state_mutex);
+    dropBack();
+  }
+
+  void clear() {
+    end();
+    lock_guard<mutex> lock(state_mutex);
+    captured.clear();
+    pending.clear();
+    stored = 0;
+  }
+
+  void setLimit(uint64_t bytes) {
+    if (bytes == 0)
+      clear();
+    lock_guard<mutex> lock(state_mutex);
+    limit = bytes;
+    trim();
+  }
+
+  void onOutput(const char *data, size_t size) {
+    if (!active)
+      return;
+    captured.back().bytes += size;
+    while (size > 0) {
+      size_t take = min(size, CHUNK_SIZE - staging.size());
+      staging.append(data, take);
+      data += take;
+      size -= take;
+      if (staging.size() == CHUNK_SIZE)
+        seal();
+    }
+  }
+
+  // Calls fn(data, size) with each stored block of the command, in order
+  template <typename Fn> bool read(const CapturedCommand &entry, Fn fn) const {
+    string raw;
+    for (size_t i = 0; i < entry.blocks.size(); i++) {
+      {
+        lock_guard<mutex> lock(state_mutex);
+        const CapturedBlock &block = entry.blocks[i];
+        if (!block.compressed) {
+          raw = block.data;
+        } else {
+          raw.resize(block.raw_size);
+          if (!lz4Decompress(block.data.data(), block.data.size(), &raw[0],
+                             raw.size()))
+            return false;
+        }
+      }
+      fn(raw.data(), raw.size());
+    }
+    return true;
+  }
+
+  const CapturedCommand *find(size_t number) const {
+    for (const CapturedCommand &entry : captured) {
+      if (entry.number == number)
+        return &entry;
+    }
+    return NULL;
+  }
+
+  const deque<CapturedCommand> &commands() const { return captured; }
+  uint64_t limitBytes() const { return limit; }
+  uint64_t storedBytes() const {
+    lock_guard<mutex> lock(state_mutex);
+    return stored;
+  }
+
+private:
+  uint64_t limit;
+  uint64_t stored;
+  bool active;
+  uint64_t next_serial;
+  bool compressing;
+  deque<CapturedCommand> captured;
+  deque<pair<uint64_t, size_t> > pending; // block serial, command number
+  string staging;
+  string spare;
+  thread compressor;
+  mutable mutex state_mutex;
+  condition_variable wake;
+
+  void seal() {
+    if (staging.empty())
+      return;
+    CapturedBlock block;
+    block.raw_size = (uint32_t)staging.size();
+    block.compressed = false;
+    // A full block takes the buffer itself; a short tail is copied so the
+    // buffer's 64K isn't kept for a few bytes
+    if (staging.size() == CHUNK_SIZE) {
+      block.data.swap(staging);
+      staging.swap(spare);
+      staging.reserve(CHUNK_SIZE);
+    } else {
+      block.data = staging;
+      staging.clear();
+    }
+    lock_guard<mutex> lock(state_mutex);
+    block.serial = next_serial++;
+    stored += block.raw_size;
+    captured.back().blocks.push_back(move(block));
+    trim();
+  }
+
+  void stopCompressor() {
+    if (!compressing)
+      return;
+    {
+      lock_guard<mutex> lock(state_mutex);
+      compressing = false;
+    }
+    wake.notify_one();
+    compressor.join();
+  }
+
+  void compressLoop() {
+    blockThreadSignals();
+    string raw, packed;
+    size_t incompressible = 0;
+    unique_lock<mutex> lock(state_mutex);
+    while (true) {
+      while (compressing && pending.empty())
+        wake.wait(lock);
+      if (!compressing)
+        return;
+      uint64_t serial = pending.front().first;
+      size_t number = pending.front().second;
+      pending.pop_front();
+      CapturedBlock *block = locate(serial);
+      if (!block || number == incompressible)
+        continue;
+      raw = block->data;
+      lock.unlock();
+      lz4Compress(raw.data(), raw.size(), packed);
+      lock.lock();
+      // Output that doesn't shrink by an eighth, like binary data, is not
+      // worth the rest of the effort
+      if (packed.size() > raw.size() - raw.size() / 8)
+        incompressible = number;
+      // The block may have been dropped while we worked on it
+      block = locate(serial);
+      if (!block || packed.size() >= raw.size())
+        continue;
+      stored -= block->data.size() - packed.size();
+      string(packed).swap(block->data);
+      block->compressed = true;
+    }
+  }
+
+  // Blocks are numbered in the order they were sealed and only ever leave
+  // from the front of a command, so each command holds a consecutive run
+  CapturedBlock *locate(uint64_t serial) {
+    for (size_t i = captured.size(); i-- > 0;) {
+      deque<CapturedBlock> &blocks = captured[i].blocks;
+      if (blocks.empty() || blocks.front().serial > serial)
+        continue;
+      size_t index = (size_t)(serial - blocks.front().serial);
+      return index < blocks.size() ? &blocks[index] : NULL;
+    }
+    return NULL;
+  }
+
+  void dropBack() {
+    CapturedCommand &entry = captured.back();
+    stored -= entry.command.size();
+    for (const CapturedBlock &block : entry.blocks)
+      stored -= block.data.size();
+    captured.pop_back();
+  }
+
+  void popOldest() {
+    stored -= captured.front().command.size();
+    for (const CapturedBlock &block : captured.front().blocks)
+      stored -= block.data.size();
+    captured.pop_front();
+  }
+
+  // Drops the oldest blocks, and commands left with none, until back under
+  // the limit. The running command is never dropped entirely.
+  void trim() {
+    while (captured.size() > MAX_COMMANDS)
+      popOldest();
+    while (stored > limit && !captured.empty()) {
+      CapturedCommand &oldest = captured.front();
+      bool running = active && captured.size() == 1;
+      if (oldest.blocks.empty()) {
+        if (running)
+          break;
+        popOldest();
+        continue;
+      }
+      CapturedBlock &dropped = oldest.blocks.front();
+      stored -= dropped.data.size();
+      // A full raw buffer is reused for the next block, so a long output
+      // settles into recycling memory that is already mapped
+      if (!dropped.compressed && dropped.data.capacity() >= CHUNK_SIZE &&
+          spare.capacity() < CHUNK_SIZE) {
+        spare.swap(dropped.data);
+        spare.clear();
+      }
+      oldest.blocks.pop_front();
+      oldest.truncated = true;
+      if (oldest.blocks.empty() && !running)
+        popOldest();
+    }
+  }
+};
+
+#ifdef _WIN32
+// Without mkstemp the process id keeps concurrent sessions' temp files
+// apart
+static bool replaceFile(const string &path, const string &data) {
+  string temp = path + "." + to_string(GetCurrentProcessId()) + ".tmp";
+  ofstream file(temp.c_str(), ios::binary | ios::trunc);
+  file.write(data.data(), data.size());
+  file.close();
+  if (file &&
+      MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+    return true;
+  DeleteFileA(temp.c_str());
+  return false;
+}
+#else
+static bool writeAll(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Writes data to a uniquely named file beside path, then renames it over
+// path, so readers and other sessions saving at once never see half a file
+static bool replaceFile(const string &path, const string &data) {
+  string temp = path + ".XXXXXX";
+  vector<char> name(temp.begin(), temp.end());
+  name.push_back(0);
+  int fd = mkstemp(name.data());
+  if (fd < 0)
+    return false;
+  bool ok = writeAll(fd, data.data(), data.size());
+  ok = close(fd) == 0 && ok;
+  if (ok && rename(name.data(), path.c_str()) == 0)
+    return true;
+  unlink(name.data());
+  return false;
+}
+
+static bool makePipe(int fds[2]) {
+  if (pipe(fds) != 0)
+    return false;
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  return true;
+}
+
+// Like makePipe, but the write end is a pseudo-terminal the size of ours,
+// so a child whose output is being copied still sees a terminal and keeps
+// its colours and column layout. Output processing is off; our own
+// terminal turns \n into \r\n when the copy is written to it. Only used
+// when stdout is a terminal. The extra hop is what makes capture cost
+// something on huge outputs: the kernel moves pty data 4K at a time.
+static bool makeOutputPty(int fds[2]) {
+  struct winsize size;
+  if (!isatty(STDOUT_FILENO) || ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) != 0)
+    return false;
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  const char *name = NULL;
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0 ||
+      !(name = ptsname(master))) {
+    if (master >= 0)
+      close(master);
+    return false;
+  }
+  int slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+  struct termios modes;
+  if (slave < 0 || tcgetattr(slave, &modes) != 0) {
+    close(master);
+    if (slave >= 0)
+      close(slave);
+    return false;
+  }
+  modes.c_oflag &= ~OPOST;
+  tcsetattr(slave, TCSANOW, &modes);
+  ioctl(slave, TIOCSWINSZ, &size);
+  fcntl(master, F_SETFD, FD_CLOEXEC);
+  fds[0] = master;
+  fds[1] = slave;
+  return true;
+}
+
+// Single-quotes a word for sh unless it is made only of harmless characters
+static string shellQuote(const string &word) {
+  bool safe = !word.empty();
+  for (char c : word) {
+    if (!isalnum((unsigned char)c) && !strchr("@%+=:,./_-", c))
+      safe = false;
+  }
+  if (safe)
+    return word;
+  string quoted = "'";
+  for (char c : word)
+    quoted += c == '\'' ? string("'\\''") : string(1, c);
+  return quoted + "'";
+}
+
+struct ParallelJob {
+  size_t index;
+  string command;
+  int attempts;
+  pid_t pid;
+  int fd;
+  string output;
+  int status;
+  chrono::steady_clock::time_point started;
+};
+
+// Parses a [...] class at p (pointing at '['), advancing p past the ']'.
+// Returns false if the class is unterminated, in which case '[' is literal.
+static bool globClass(const char *&p, char c, bool &matched) {
+  const char *q = p + 1;
+  bool negate = *q == '!' || *q == '^';
+  if (negate)
+    q++;
+  matched = false;
+  bool first = true;
+  while (*q && (*q != ']' || first)) {
+    char low = *q, high = *q;
+    if (q[1] == '-' && q[2] && q[2] != ']') {
+      high = q[2];
+      q += 2;
+    }
+    if (c >= low && c <= high)
+      matched = true;
+    q++;
+    first = false;
+  }
+  if (*q != ']')
+    return false;
+  matched = matched != negate;
+  p = q + 1;
+  return true;
+}
+
+// Matches one path component against a glob segment (*, ?, [...]).
+// Like the shell, wildcards never match a leading dot.
+static bool globMatch(const char *pattern, const char *name) {
+  if (*name == '.' && *pattern != '.')
+    return false;
+  const char *star_pattern = 0, *star_name = 0;
+  while (*name) {
+    if (*pattern == '*') {
+      star_pattern = ++pattern;
+      star_name = name;
+      continue;
+    }
+    bool matched;
+    const char *p = pattern;
+    if (*p == '?') {
+      matched = true;
+      p++;
+    } else if (*p == '[' && globClass(p, *name, matched)) {
+    } else {
+      if (*p == '\\' && p[1])
+        p++;
+      matched = *p == *name;
+      p++;
+    }
+    if (matched) {
+      pattern = p;
+      name++;
+    } else if (star_pattern) {
+      pattern = star_pattern;
+      name = ++star_name;
+    } else {
+      return false;
+    }
+  }
+  while (*pattern == '*')
+    pattern++;
+  return !*pattern;
+}
+
+struct GlobEntry {
+  string name;
+  bool is_dir;
+  bool is_link;
+};
+
+// Expands *, ?, [...] and ** against the filesystem. Directory listings
+// are cached and reused while the directory's mtime is unchanged; a
+// listing taken within a second of the directory changing is not trusted,
+// since further changes in the same timestamp tick would go unnoticed.
+class GlobExpander {
+public:
+  static const size_t MAX_CACHED_DIRS = 4096;
+
+  static bool hasGlob(const string &str) {
+    return str.find_first_of("*?[") != string::npos;
+  }
+
+  // Appends the sorted matches of pattern to out; false if none
+  bool expand(const string &pattern, vector<string> &out) {
+    vector<string> segments;
+    size_t start = 0;
+    string base;
+    if (!pattern.empty() && pattern[0] == '/') {
+      base = "/";
+      start = 1;
+    }
+    while (start <= pattern.size()) {
+      size_t slash = pattern.find('/', start);
+      if (slash == string::npos)
+        slash = pattern.size();
+      if (slash > start)
+        segments.push_back(pattern.substr(start, slash - start));
+      start = slash + 1;
+    }
+    vector<string> found;
+    walk(segments, 0, base, found);
+    sort(found.begin(), found.end());
+    found.erase(unique(found.begin(), found.end()), found.end());
+    out.insert(out.end(), found.begin(), found.end());
+    return !found.empty();
+  }
+
+private:
+  struct Listing {
+    int64_t mtime_ns;
+    ino_t inode;
+    bool trusted;
+    vector<GlobEntry> entries;
+  };
+  map<string, Listing> cache;
+
+  static string join(const string &base, const string &name) {
+    if (base.empty())
+      return name;
+    return base == "/" ? "/" + name : base + "/" + name;
+  }
+
+  const vector<GlobEntry> *list(const string &dir) {
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+      return 0;
+    int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 +
+                    st.st_mtim.tv_nsec;
+    auto it = cache.find(dir);
+    if (it != cache.end() && it->second.trusted &&
+        it->second.mtime_ns == mtime && it->second.inode == st.st_ino)
+      return &it->second.entries;
+
+    DIR *handle = opendir(dir.c_str());
+    if (!handle)
+      return 0;
+    if (cache.size() >= MAX_CACHED_DIRS)
+      cache.clear();
+    Listing &listing = cache[dir];
+    listing.mtime_ns = mtime;
+    listing.inode = st.st_ino;
+    listing.trusted = time(0) > st.st_mtim.tv_sec + 1;
+    listing.entries.clear();
+    struct dirent *entry;
+    while ((entry = readdir(handle))) {
+      if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+        continue;
+      GlobEntry e;
+      e.name = entry->d_name;
+      unsigned char type = entry->d_type;
+      if (type == DT_UNKNOWN) {
+        struct stat child;
+        if (lstat(join(dir, e.name).c_str(), &child) == 0)
+          type = S_ISDIR(child.st_mode)   ? DT_DIR
+                 : S_ISLNK(child.st_mode) ? DT_LNK
+                                          : DT_REG;
+      }
+      e.is_dir = type == DT_DIR;
+      e.is_link = type == DT_LNK;
+      listing.entries.push_back(e);
+    }
+    closedir(handle);
+    return &listing.entries;
+  }
+
+  void walk(const vector<string> &segments, size_t i, const string &base,
+            vector<string> &out) {
+    if (i == segments.size()) {
+      if (!base.empty())
+        out.push_back(base);
+      return;
+    }
+    const string &segment = segments[i];
+    bool last = i + 1 == segments.size();
+    if (segment == "**") {
+      // Zero or more directories, without following symlinks
+      walk(segments, i + 1, base, out);
+      const vector<GlobEntry> *entries = list(base.empty() ? "." : base);
+      if (!entries)
+        return;
+      vector<string> subdirs;
+      for (const GlobEntry &e : *entries) {
+        if (e.is_dir && e.name[0] != '.')
+          subdirs.push_back(join(base, e.name));
+      }
+      for (const string &dir : subdirs)
+        walk(segments, i, dir, out);
+      return;
+    }
+    if (!hasGlob(segment)) {
+      string path = join(base, segment);
+      struct stat st;
+      if (!last)
+        walk(segments, i + 1, path, out);
+      else if (lstat(path.c_str(), &st) == 0)
+        out.push_back(path);
+      return;
+    }
+    const vector<GlobEntry> *entries = list(base.empty() ? "." : base);
+    if (!entries)
+      return;
+    vector<string> next;
+    for (const GlobEntry &e : *entries) {
+      if (!globMatch(segment.c_str(), e.name.c_str()))
+        continue;
+      if (last)
+        out.push_back(join(base, e.name));
+      else if (e.is_dir || (e.is_link && directoryExists(join(base, e.name))))
+        next.push_back(join(base, e.name));
+    }
+    for (const string &dir : next)
+      walk(segments, i + 1, dir, out);
+  }
+};
+
+struct BulkOp {
+  string from;
+  string to;
+  bool is_dir;
+  int error;
+};
+
+#ifdef HAVE_IO_URING
+// Just enough of io_uring, over the raw syscalls, to batch path
+// operations: one submission queue, one completion queue, no polling
+class IoUring {
+public:
+  explicit IoUring(unsigned entries)
+      : fd(-1), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sqes(MAP_FAILED),
+        capacity(0) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+      return;
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+      sq_size = cq_size = max(sq_size, cq_size);
+    // Set before mapping: release() needs it to unmap sqes
+    capacity = params.sq_entries;
+    sq_ring = mmap(0, sq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cq_ring = single ? sq_ring
+                     : mmap(0, cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqes = mmap(0, capacity * sizeof(struct io_uring_sqe),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED ||
+        sqes == MAP_FAILED) {
+      release();
+      return;
+    }
+    char *sq = (char *)sq_ring, *cq = (char *)cq_ring;
+    sq_head = (unsigned *)(sq + params.sq_off.head);
+    sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + params.sq_off.array);
+    cq_head = (unsigned *)(cq + params.cq_off.head);
+    cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  }
+
+  ~IoUring() { release(); }
+
+  bool ok() const { return fd >= 0; }
+  unsigned size() const { return capacity; }
+
+  bool supports(int opcode) {
+    size_t size = sizeof(struct io_uring_probe) +
+                  256 * sizeof(struct io_uring_probe_op);
+    vector<char> buffer(size, 0);
+    struct io_uring_probe *probe = (struct io_uring_probe *)&buffer[0];
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+                256) < 0)
+      return false;
+    return opcode <= probe->last_op &&
+           (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+  }
+
+  // Next free submission slot, or null when the queue is full
+  struct io_uring_sqe *next() {
+    unsigned tail = *sq_tail;
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= capacity)
+      return 0;
+    unsigned index = tail & sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+  }
+
+  // Submits what was queued and waits for at least wait_for completions
+  int enter(unsigned to_submit, unsigned wait_for) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, wait_for,
+                        wait_for ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  }
+
+  template <typename Fn> unsigned reap(Fn fn) {
+    unsigned head = *cq_head, count = 0;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++, count++) {
+      const struct io_uring_cqe &cqe = cqes[head & cq_mask];
+      fn(cqe.user_data, cqe.res);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    return count;
+  }
+
+private:
+  int fd;
+  void *sq_ring, *cq_ring, *sqes;
+  size_t sq_size, cq_size;
+  unsigned *sq_head, *sq_tail, *sq_array, *cq_head, *cq_tail;
+  unsigned sq_mask, cq_mask, capacity;
+  struct io_uring_cqe *cqes;
+
+  void release() {
+    if (sqes != MAP_FAILED)
+      munmap(sqes, capacity * sizeof(struct io_uring_sqe));
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+      munmap(cq_ring, cq_size);
+    if (sq_ring != MAP_FAILED)
+      munmap(sq_ring, sq_size);
+    if (fd >= 0)
+      close(fd);
+    fd = -1;
+    sq_ring = cq_ring = sqes = MAP_FAILED;
+    capacity = 0;
+  }
+};
+#endif
+
+// Runs many unlinks or renames. Large batches go through io_uring when the
+// kernel offers unlinkat/renameat there, otherwise through a pool of
+// threads, so they are bound by the filesystem rather than by one
+// syscall at a time. progress(done) is called from the calling thread
+// about every 100ms. Directories are removed last, deepest first, so a
+// pattern matching both a directory and its contents works.
+class BulkFileOps {
+public:
+  static const size_t PARALLEL_THRESHOLD = 64;
+  static const unsigned RING_ENTRIES = 256;
+
+  template <typename Fn>
+  static size_t run(vector<BulkOp> &ops, Fn progress) {
+    vector<BulkOp *> files, dirs;
+    for (BulkOp &op : ops) {
+      op.error = 0;
+      (op.to.empty() && op.is_dir ? dirs : files).push_back(&op);
+    }
+    atomic<size_t> done(0);
+    chrono::steady_clock::time_point last_report = chrono::steady_clock::now();
+    if (files.size() < PARALLEL_THRESHOLD ||
+        !runRing(files, done, progress, last_report))
+      runThreads(files, done, progress, last_report);
+
+    sort(dirs.begin(), dirs.end(), [](const BulkOp *a, const BulkOp *b) {
+      return count(a->from.begin(), a->from.end(), '/') >
+             count(b->from.begin(), b->from.end(), '/');
+    });
+    for (BulkOp *op : dirs) {
+      apply(*op);
+      done++;
+    }
+    progress(done.load());
+
+    size_t failed = 0;
+    for (const BulkOp &op : ops)
+      failed += op.error != 0;
+    return failed;
+  }
+
+private:
+  static void apply(BulkOp &op) {
+    int result =
+        op.to.empty()
+            ? unlinkat(AT_FDCWD, op.from.c_str(), op.is_dir ? AT_REMOVEDIR : 0)
+            : renameat(AT_FDCWD, op.from.c_str(), AT_FDCWD, op.to.c_str());
+    op.error = result == 0 ? 0 : errno;
+  }
+
+  template <typename Fn>
+  static void report(atomic<size_t> &done, Fn &progress,
+                     chrono::steady_clock::time_point &last) {
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    if (now - last >= chrono::milliseconds(100)) {
+      progress(done.load());
+      last = now;
+    }
+  }
+
+  template <typename Fn>
+  static bool runRing(vector<BulkOp *> &ops, atomic<size_t> &done,
+                      Fn &progress, chrono::steady_clock::time_point &last) {
+#ifdef HAVE_IO_URING
+    IoUring ring(RING_ENTRIES);
+    if (!ring.ok() || !ring.supports(IORING_OP_UNLINKAT) ||
+        !ring.supports(IORING_OP_RENAMEAT))
+      return false;
+
+    size_t next = 0, inflight = 0;
+    unsigned unsubmitted = 0;
+    while (done.load() < ops.size()) {
+      struct io_uring_sqe *sqe;
+      while (next < ops.size() && inflight < ring.size() &&
+             (sqe = ring.next())) {
+        BulkOp &op = *ops[next];
+        op.error = -1;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)op.from.c_str();
+        if (op.to.empty()) {
+          sqe->opcode = IORING_OP_UNLINKAT;
+          sqe->unlink_flags = op.is_dir ? AT_REMOVEDIR : 0;
+        } else {
+          sqe->opcode = IORING_OP_RENAMEAT;
+          sqe->len = (uint32_t)AT_FDCWD;
+          sqe->addr2 = (uint64_t)(uintptr_t)op.to.c_str();
+        }
+        sqe->user_data = next++;
+        unsubmitted++;
+        inflight++;
+      }
+      int submitted = ring.enter(unsubmitted, 1);
+      if (submitted >= 0) {
+        unsubmitted -= submitted;
+      } else if (errno != EINTR) {
+        // The ring is unusable. Anything it still holds has an unknown
+        // outcome; the rest goes to the thread pool.
+        size_t first_unsubmitted = next - unsubmitted;
+        size_t lost = inflight - unsubmitted;
+        for (size_t k = 0; k < first_unsubmitted && lost > 0; k++) {
+          if (ops[k]->error == -1) {
+            ops[k]->error = EIO;
+            lost--;
+          }
+        }
+        done += inflight - unsubmitted;
+        vector<BulkOp *> rest(ops.begin() + first_unsubmitted, ops.end());
+        runThreads(rest, done, progress, last);
+        return true;
+      }
+      inflight -= ring.reap([&](uint64_t index, int res) {
+        ops[index]->error = res < 0 ? -res : 0;
+        done++;
+      });
+      report(done, progress, last);
+    }
+    return true;
+#else
+    (void)ops;
+    (void)done;
+    (void)progress;
+    (void)last;
+    return false;
+#endif
+  }
+
+  template <typename Fn>
+  static void runThreads(vector<BulkOp *> &ops, atomic<size_t> &done,
+                         Fn &progress,
+                         chrono::steady_clock::time_point &last) {
+    if (ops.size() < PARALLEL_THRESHOLD) {
+      for (BulkOp *op : ops) {
+        apply(*op);
+        done++;
+      }
+      return;
+    }
+    // Mostly waiting on the filesystem, so more threads than cores
+    unsigned count = min(32u, max(4u, 2 * thread::hardware_concurrency()));
+    atomic<size_t> next(0);
+    atomic<unsigned> running(count);
+    vector<thread> workers;
+    for (unsigned t = 0; t < count; t++) {
+      workers.push_back(thread([&]() {
+        blockThreadSignals();
+        size_t i;
+        while ((i = next++) < ops.size()) {
+          apply(*ops[i]);
+          done++;
+        }
+        running--;
+      }));
+    }
+    while (running.load() > 0) {
+      this_thread::sleep_for(chrono::milliseconds(5));
+      report(done, progress, last);
+    }
+    for (thread &worker : workers)
+      worker.join();
+  }
+};
+
+enum HashKind { HASH_EDGES = 1, HASH_XXH64 = 2, HASH_SHA256 = 4 };
+
+// What is known about one file's contents. Kept in the hash cache under
+// (dev, inode) and trusted while size and mtime still match.
+struct FileDigest {
+  uint64_t size;
+  int64_t mtime_ns;
+  uint8_t have; // HashKind bits
+  bool used;    // looked at this session; not saved
+  uint64_t edges; // first and last EDGE_BYTES only
+  uint64_t xxh64;
+  uint8_t sha256[32];
+};
+
+struct HashJob {
+  string path;
+  uint64_t dev;
+  uint64_t ino;
+  FileDigest digest;
+  int error;
+};
+
+// Hashes files on a pool of threads, answering from the cache where it
+// can. Runs are staged by the caller: the cheap HASH_EDGES pass only
+// reads two blocks per file, so full hashes are only needed for files
+// that still collide after it.
+class FileHasher {
+public:
+  typedef map<pair<uint64_t, uint64_t>, FileDigest> Cache;
+  static const size_t EDGE_BYTES = 4096;
+
+  explicit FileHasher(Cache &cache)
+      : cache(cache), files_read(0), bytes_read(0), cache_hits(0) {}
+
+  static void initJob(HashJob &job, const string &path,
+                      const struct stat &st) {
+    job.path = path;
+    job.dev = st.st_dev;
+    job.ino = st.st_ino;
+    job.digest.size = st.st_size;
+    job.digest.mtime_ns =
+        (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    job.digest.have = 0;
+    job.digest.used = true;
+    job.error = 0;
+  }
+
+  void run(vector<HashJob *> &jobs, HashKind kind) {
+    vector<HashJob *> todo;
+    for (HashJob *job : jobs) {
+      if (job->error || (job->digest.have & kind))
+        continue;
+      Cache::iterator it = cache.find(make_pair(job->dev, job->ino));
+      if (it != cache.end() && it->second.size == job->digest.size &&
+          it->second.mtime_ns == job->digest.mtime_ns) {
+        it->second.used = true;
+        merge(job->digest, it->second);
+      }
+      if (job->digest.have & kind)
+        cache_hits++;
+      else
+        todo.push_back(job);
+    }
+    if (todo.empty())
+      return;
+
+    // Small batches are not worth the threads; large ones are mostly
+    // waiting on the disk, so use more threads than cores
+    unsigned count = todo.size() < 16
+                         ? 1u
+                         : min(16u, max(4u, 2 * thread::hardware_concurrency()));
+    atomic<size_t> next(0);
+    atomic<uint64_t> read(0);
+    auto work = [&]() {
+      blockThreadSignals();
+      vector<uint8_t> buffer(1 << 18);
+      size_t i;
+      while ((i = next++) < todo.size())
+        read += hashFile(*todo[i], kind, buffer);
+    };
+    if (count == 1) {
+      work();
+    } else {
+      vector<thread> workers;
+      for (unsigned t = 0; t < count; t++)
+        workers.push_back(thread(work));
+      for (thread &worker : workers)
+        worker.join();
+    }
+    files_read += todo.size();
+    bytes_read += read.load();
+
+    // A file changed within the mtime granularity of our read could change
+    // again without its mtime moving, so recent files are not cached
+    int64_t recent = (int64_t)time(0) * 1000000000LL - 2000000000LL;
+    for (HashJob *job : todo) {
+      if (job->error || job->digest.mtime_ns >= recent)
+        continue;
+      FileDigest &entry = cache[make_pair(job->dev, job->ino)];
+      if (entry.size != job->digest.size ||
+          entry.mtime_ns != job->digest.mtime_ns)
+        entry = job->digest;
+      else
+        merge(entry, job->digest);
+      entry.used = true;
+    }
+  }
+
+  uint64_t filesRead() const { return files_read; }
+  uint64_t bytesRead() const { return bytes_read; }
+  uint64_t cacheHits() const { return cache_hits; }
+
+private:
+  Cache &cache;
+  uint64_t files_read;
+  uint64_t bytes_read;
+  uint64_t cache_hits;
+
+  static void merge(FileDigest &into, const FileDigest &from) {
+    if (from.have & HASH_EDGES)
+      into.edges = from.edges;
+    if (from.have & HASH_XXH64)
+      into.xxh64 = from.xxh64;
+    if (from.have & HASH_SHA256)
+      memcpy(into.sha256, from.sha256, sizeof(into.sha256));
+    into.have |= from.have;
+  }
+
+  // Returns the number of bytes read. Sets job.error if the file cannot
+  // be read or is no longer the file that was listed.
+  static uint64_t hashFile(HashJob &job, HashKind kind,
+                           vector<uint8_t> &buffer) {
+    int fd = open(job.path.c_str(), O_RDONLY | O_CLOEXEC | O_NOCTTY);
+    if (fd < 0) {
+      job.error = errno;
+      return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_ino != job.ino ||
+        (uint64_t)st.st_size != job.digest.size) {
+      job.error = ESTALE;
+      close(fd);
+      return 0;
+    }
+
+    FileDigest &digest = job.digest;
+    uint64_t total = 0;
+    if (kind == HASH_EDGES && digest.size > 2 * EDGE_BYTES) {
+      ssize_t head = pread(fd, buffer.data(), EDGE_BYTES, 0);
+      ssize_t tail = pread(fd, buffer.data() + EDGE_BYTES, EDGE_BYTES,
+                           (off_t)(digest.size - EDGE_BYTES));
+      if (head != (ssize_t)EDGE_BYTES || tail != (ssize_t)EDGE_BYTES) {
+        job.error = head < 0 || tail < 0 ? errno : ESTALE;
+      } else {
+        digest.edges = Xxh64::hash(buffer.data(), 2 * EDGE_BYTES);
+        digest.have |= HASH_EDGES;
+        total = 2 * EDGE_BYTES;
+      }
+      close(fd);
+      return total;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    // Small files are read whole even for HASH_EDGES, so the full xxh64
+    // comes for free and they skip the next stage
+    bool sha = kind == HASH_SHA256;
+    Xxh64 xxh;
+    Sha256 sha256;
+    for (;;) {
+      ssize_t n = read(fd, buffer.data(), buffer.size());
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0) {
+        job.error = errno;
+        break;
+      }
+      if (n == 0)
+        break;
+      if (sha)
+        sha256.update(buffer.data(), n);
+      else
+        xxh.update(buffer.data(), n);
+      total += n;
+    }
+    close(fd);
+    if (job.error)
+      return total;
+    if (total != digest.size) {
+      job.error = ESTALE;
+    } else if (sha) {
+      sha256.digest(digest.sha256);
+      digest.have |= HASH_SHA256;
+    } else {
+      digest.xxh64 = digest.edges = xxh.digest();
+      digest.have |= HASH_XXH64 | HASH_EDGES;
+    }
+    return total;
+  }
+};
+
+#ifdef __linux__
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
+
+// Copies size bytes between two files at the given offsets. On Linux the
+// kernel moves the data itself (and may share extents on filesystems
+// that support it); elsewhere, or when the filesystems differ, it goes
+// through a buffer.
+static bool copyRange(int in, off_t in_offset, int out, off_t out_offset,
+                      uint64_t size) {
+#ifdef __linux__
+  while (size > 0) {
+    ssize_t n = copy_file_range(in, &in_offset, out, &out_offset,
+                                (size_t)min<uint64_t>(size, 1 << 30), 0);
+    if (n > 0) {
+      size -= n;
+      continue;
+    }
+    if (n == 0)
+      return false;
+    if (errno == EINTR)
+      continue;
+    if (errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+        errno != EOPNOTSUPP)
+      return false;
+    break;
+  }
+#endif
+  vector<char> buffer((size_t)min<uint64_t>(max<uint64_t>(size, 1), 1 << 18));
+  while (size > 0) {
+    ssize_t n = pread(in, buffer.data(),
+                      (size_t)min<uint64_t>(size, buffer.size()), in_offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    for (ssize_t done = 0; done < n;) {
+      ssize_t w = pwrite(out, buffer.data() + done, n - done, out_offset);
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w <= 0)
+        return false;
+      done += w;
+      out_offset += w;
+    }
+    in_offset += n;
+    size -= n;
+  }
+  return true;
+}
+
+// A read-only view of a whole file
+class MappedFile {
+public:
+  MappedFile() : data(0), size(0) {}
+  ~MappedFile() {
+    if (data && size)
+      munmap((void *)data, size);
+  }
+
+  bool open(int fd, uint64_t length) {
+    size = (size_t)length;
+    if (size == 0)
+      return true;
+    void *map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      size = 0;
+      return false;
+    }
+    data = (const uint8_t *)map;
+    return true;
+  }
+
+  const uint8_t *data;
+  size_t size;
+
+private:
+  MappedFile(const MappedFile &);
+  MappedFile &operator=(const MappedFile &);
+};
+
+// One piece of the new file: either a run of the old file's blocks or
+// literal bytes from the source
+struct DeltaOp {
+  bool literal;
+  uint64_t from; // offset in the old file, or in the source if literal
+  uint64_t length;
+};
+
+// rsync's block matching, with both files local. The old file is split
+// into blocks indexed by a rolling checksum; the source is scanned one
+// byte at a time and every offset where a block starts is found. Since
+// both sides are at hand, a checksum hit is confirmed with memcmp rather
+// than a strong hash.
+class BlockDelta {
+public:
+  static size_t blockSize(uint64_t size) {
+    size_t block = 2048;
+    while (block < 131072 && (uint64_t)block * block < size)
+      block *= 2;
+    return block;
+  }
+
+  static vector<DeltaOp> compute(const uint8_t *old_data, size_t old_size,
+                                 const uint8_t *new_data, size_t new_size) {
+    size_t block = blockSize(new_size);
+    size_t blocks = old_size / block;
+    // (checksum, block) pairs, sorted, behind a bitmap that turns away
+    // most misses before the binary search
+    vector<pair<uint32_t, uint32_t>> table(blocks);
+    vector<uint64_t> filter(FILTER_BITS / 64);
+    for (size_t k = 0; k < blocks; k++) {
+      uint32_t a, b;
+      checksum(old_data + k * block, block, a, b);
+      uint32_t sum = combine(a, b);
+      table[k] = make_pair(sum, (uint32_t)k);
+      filter[slot(sum) / 64] |= 1ULL << (slot(sum) % 64);
+    }
+    sort(table.begin(), table.end());
+
+    vector<DeltaOp> ops;
+    size_t pos = 0, literal_start = 0, expected = 0;
+    uint32_t a = 0, b = 0;
+    if (blocks > 0 && new_size >= block)
+      checksum(new_data, block, a, b);
+    while (blocks > 0 && pos + block <= new_size) {
+      uint32_t sum = combine(a, b);
+      size_t hit = SIZE_MAX;
+      if (filter[slot(sum) / 64] & (1ULL << (slot(sum) % 64))) {
+        vector<pair<uint32_t, uint32_t>>::const_iterator it = lower_bound(
+            table.begin(), table.end(), make_pair(sum, (uint32_t)0));
+        if (it != table.end() && it->first == sum) {
+          // Prefer the block after the last match, so runs stay runs
+          if (expected < blocks &&
+              memcmp(old_data + expected * block, new_data + pos, block) == 0)
+            hit = expected;
+          for (; hit == SIZE_MAX && it != table.end() && it->first == sum;
+               ++it) {
+            if (memcmp(old_data + (size_t)it->second * block, new_data + pos,
+                       block) == 0)
+              hit = it->second;
+          }
+        }
+      }
+      if (hit != SIZE_MAX) {
+        if (literal_start < pos)
+          push(ops, true, literal_start, pos - literal_start);
+        push(ops, false, (uint64_t)hit * block, block);
+        pos += block;
+        literal_start = pos;
+        expected = hit + 1;
+        if (pos + block <= new_size)
+          checksum(new_data + pos, block, a, b);
+        continue;
+      }
+      if (pos + block == new_size)
+        break;
+      // Roll the window one byte forward
+      uint32_t out = new_data[pos], in = new_data[pos + block];
+      a = a - out + in;
+      b = b - (uint32_t)block * out + a;
+      pos++;
+    }
+    if (literal_start < new_size)
+      push(ops, true, literal_start, new_size - literal_start);
+    return ops;
+  }
+
+private:
+  static const size_t FILTER_BITS = 1 << 20;
+
+  static void checksum(const uint8_t *p, size_t size, uint32_t &a,
+                       uint32_t &b) {
+    a = b = 0;
+    for (size_t i = 0; i < size; i++) {
+      a += p[i];
+      b += (uint32_t)(size - i) * p[i];
+    }
+  }
+
+  static uint32_t combine(uint32_t a, uint32_t b) {
+    return (a & 0xffff) | (b << 16);
+  }
+
+  static size_t slot(uint32_t sum) {
+    return (sum * 2654435761u) >> 12;
+  }
+
+  static void push(vector<DeltaOp> &ops, bool literal, uint64_t from,
+                   uint64_t length) {
+    if (!ops.empty() && ops.back().literal == literal &&
+        ops.back().from + ops.back().length == from) {
+      ops.back().length += length;
+      return;
+    }
+    DeltaOp op;
+    op.literal = literal;
+    op.from = from;
+    op.length = length;
+    ops.push_back(op);
+  }
+};
+
+enum MirrorAction { MIRROR_UNCHANGED, MIRROR_COPIED, MIRROR_UPDATED };
+
+struct MirrorEntry {
+  string path; // relative to the tree root
+  mode_t mode;
+  uint64_t size;
+  struct timespec mtime;
+  MirrorAction action;
+  uint64_t literal_bytes; // taken from the source
+  int error;
+};
+
+// Makes a destination tree match a source tree. Files whose size and
+// mtime already match are left alone; big files that changed are updated
+// with a block delta against the old copy, small ones are copied. Every
+// file is written to a temporary name next to its target and renamed
+// over it, so readers never see a partial file.
+class DirectoryMirror {
+public:
+  static const uint64_t DELTA_MIN_SIZE = 1 << 20;
+
+  // Lists a tree without following symlinks; directories come before
+  // their contents
+  static bool walk(const string &root, vector<MirrorEntry> &entries,
+                   size_t &unreadable) {
+    vector<string> stack(1, "");
+    while (!stack.empty()) {
+      string rel = stack.back();
+      stack.pop_back();
+      string dir = rel.empty() ? root : root + "/" + rel;
+      DIR *handle = opendir(dir.c_str());
+      if (!handle) {
+        if (rel.empty())
+          return false;
+        unreadable++;
+        continue;
+      }
+      while (struct dirent *entry = readdir(handle)) {
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+          continue;
+        struct stat st;
+        if (fstatat(dirfd(handle), name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+          unreadable++;
+          continue;
+        }
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode) &&
+            !S_ISLNK(st.st_mode))
+          continue;
+        MirrorEntry item;
+        item.path = rel.empty() ? name : rel + "/" + name;
+        item.mode = st.st_mode;
+        item.size = st.st_size;
+        item.mtime = st.st_mtim;
+        item.action = MIRROR_UNCHANGED;
+        item.literal_bytes = 0;
+        item.error = 0;
+        entries.push_back(item);
+        if (S_ISDIR(st.st_mode))
+          stack.push_back(item.path);
+      }
+      closedir(handle);
+    }
+    return true;
+  }
+
+  static void sync(const string &src, const string &dst, MirrorEntry &entry) {
+    string from = src + "/" + entry.path, to = dst + "/" + entry.path;
+    if (S_ISDIR(entry.mode)) {
+      struct stat st;
+      if (mkdir(to.c_str(), entry.mode & 07777) == 0)
+        entry.action = MIRROR_COPIED;
+      else if (errno != EEXIST || stat(to.c_str(), &st) != 0 ||
+               !S_ISDIR(st.st_mode))
+        entry.error = errno == EEXIST ? ENOTDIR : errno;
+      return;
+    }
+    if (S_ISLNK(entry.mode)) {
+      syncLink(from, to, entry);
+      return;
+    }
+
+    struct stat st;
+    bool exists = lstat(to.c_str(), &st) == 0;
+    if (exists && S_ISREG(st.st_mode) && (uint64_t)st.st_size == entry.size &&
+        st.st_mtim.tv_sec == entry.mtime.tv_sec &&
+        st.st_mtim.tv_nsec == entry.mtime.tv_nsec)
+      return;
+    if (exists && S_ISDIR(st.st_mode)) {
+      entry.error = EISDIR;
+      return;
+    }
+    bool delta = exists && S_ISREG(st.st_mode) &&
+                 entry.size >= DELTA_MIN_SIZE &&
+                 (uint64_t)st.st_size >= DELTA_MIN_SIZE;
+    entry.action = delta ? MIRROR_UPDATED : MIRROR_COPIED;
+    entry.error = writeFile(from, to, entry, delta);
+  }
+
+private:
+  static void syncLink(const string &from, const string &to,
+                       MirrorEntry &entry) {
+    char target[PATH_MAX], current[PATH_MAX];
+    ssize_t n = readlink(from.c_str(), target, sizeof(target) - 1);
+    if (n < 0) {
+      entry.error = errno;
+      return;
+    }
+    target[n] = 0;
+    ssize_t m = readlink(to.c_str(), current, sizeof(current) - 1);
+    if (m == n && memcmp(target, current, n) == 0)
+      return;
+    // There is no mkstemp for links, but symlink() never replaces a file,
+    // so a name that is taken just means trying the next one
+    static atomic<unsigned> serial(0);
+    size_t slash = to.find_last_of('/');
+    string temp;
+    int made;
+    do {
+      temp = to.substr(0, slash + 1) + "." + to.substr(slash + 1) + "." +
+             to_string(getpid()) + "-" + to_string(serial++);
+      made = symlink(target, temp.c_str());
+    } while (made != 0 && errno == EEXIST);
+    if (made != 0) {
+      entry.error = errno;
+      return;
+    }
+    if (rename(temp.c_str(), to.c_str()) != 0) {
+      entry.error = errno;
+      unlink(temp.c_str());
+      return;
+    }
+    entry.action = MIRROR_COPIED;
+  }
+
+  // Returns 0 or an errno value
+  static int writeFile(const string &from, const string &to,
+                       MirrorEntry &entry, bool delta) {
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+      return errno;
+    size_t slash = to.find_last_of('/');
+    string temp = to.substr(0, slash + 1) + "." + to.substr(slash + 1) +
+                  ".XXXXXX";
+    vector<char> name(temp.begin(), temp.end());
+    name.push_back(0);
+    int out = mkstemp(name.data());
+    if (out < 0) {
+      int error = errno;
+      close(in);
+      return error;
+    }
+
+    int error = 0;
+    int old = delta ? open(to.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+    if (old >= 0) {
+      error = applyDelta(in, old, out, entry);
+      close(old);
+    } else {
+      entry.action = MIRROR_COPIED;
+      entry.literal_bytes = entry.size;
+      if (!copyRange(in, 0, out, 0, entry.size))
+        error = errno ? errno : EIO;
+    }
+
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1] = entry.mtime;
+    if (!error && (fchmod(out, entry.mode & 07777) != 0 ||
+                   futimens(out, times) != 0))
+      error = errno;
+    if (close(out) != 0 && !error)
+      error = errno;
+    close(in);
+    if (!error && rename(name.data(), to.c_str()) != 0)
+      error = errno;
+    if (error)
+      unlink(name.data());
+    return error;
+  }
+
+  // A source that changed size since the walk is left for the next run:
+  // mapping it at the walked size would fault past a shrunken end
+  static int applyDelta(int in, int old, int out, MirrorEntry &entry) {
+    struct stat in_st, old_st;
+    if (fstat(in, &in_st) != 0 || fstat(old, &old_st) != 0)
+      return errno;
+    if ((uint64_t)in_st.st_size != entry.size)
+      return ESTALE;
+    MappedFile new_map, old_map;
+    if (!new_map.open(in, in_st.st_size) ||
+        !old_map.open(old, old_st.st_size))
+      return errno;
+    vector<DeltaOp> ops = BlockDelta::compute(old_map.data, old_map.size,
+                                              new_map.data, new_map.size);
+
+    // Starting from a clone of the old file, only the blocks that moved or
+    // changed have to be written
+    bool cloned = false;
+#ifdef __linux__
+    cloned = ioctl(out, FICLONE, old) == 0;
+#endif
+    uint64_t pos = 0;
+    for (const DeltaOp &op : ops) {
+      bool ok = true;
+      if (op.literal) {
+        entry.literal_bytes += op.length;
+        ok = copyRange(in, op.from, out, pos, op.length);
+      } else if (!cloned || op.from != pos) {
+        ok = copyRange(old, op.from, out, pos, op.length);
+      }
+      if (!ok)
+        return errno ? errno : EIO;
+      pos += op.length;
+    }
+    if (ftruncate(out, pos) != 0)
+      return errno;
+    return 0;
+  }
+};
+
+// Finds the first of three bytes, 16 at a time where SSE2 is available
+static const char *findAny(const char *p, const char *end, char a, char b,
+                           char c) {
+#ifdef __SSE2__
+  const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b),
+                vc = _mm_set1_epi8(c);
+  for (; end - p >= 16; p += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)p);
+    __m128i hits = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(block, va), _mm_cmpeq_epi8(block, vb)),
+        _mm_cmpeq_epi8(block, vc));
+    int mask = _mm_movemask_epi8(hits);
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#endif
+  for (; p < end; p++) {
+    if (*p == a || *p == b || *p == c)
+      return p;
+  }
+  return end;
+}
+
+static size_t countByte(const char *p, const char *end, char c) {
+  size_t total = 0;
+#ifdef __SSE2__
+  const __m128i vc = _mm_set1_epi8(c);
+  for (; end - p >= 16; p += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)p);
+    total += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, vc)));
+  }
+#endif
+  for (; p < end; p++)
+    total += *p == c;
+  return total;
+}
+
+// Parses a whole field as a number. Plain decimals of up to 15 digits are
+// converted exactly without strtod; anything else falls back to it.
+static bool parseDecimal(const char *p, size_t size, double &value) {
+  static const double powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                  1e12, 1e13, 1e14, 1e15};
+  while (size > 0 && *p == ' ') {
+    p++;
+    size--;
+  }
+  while (size > 0 && p[size - 1] == ' ')
+    size--;
+  if (size == 0)
+    return false;
+
+  const char *q = p, *end = p + size;
+  bool negative = *q == '-';
+  if (*q == '-' || *q == '+')
+    q++;
+  uint64_t mantissa = 0;
+  int digits = 0, fraction = -1;
+  for (; q < end; q++) {
+    if (*q >= '0' && *q <= '9') {
+      mantissa = mantissa * 10 + (*q - '0');
+      digits++;
+      if (fraction >= 0)
+        fraction++;
+    } else if (*q == '.' && fraction < 0) {
+      fraction = 0;
+    } else {
+      break;
+    }
+  }
+  if (q == end && digits > 0 && digits <= 15) {
+    value = fraction > 0 ? mantissa / powers[fraction] : (double)mantissa;
+    if (negative)
+      value = -value;
+    return true;
+  }
+
+  char buffer[64];
+  if (size >= sizeof(buffer) || !(isdigit((unsigned char)*p) || *p == '-' ||
+                                  *p == '+' || *p == '.'))
+    return false;
+  memcpy(buffer, p, size);
+  buffer[size] = 0;
+  char *stop;
+  value = strtod(buffer, &stop);
+  return stop == buffer + size;
+}
+
+static string formatNumber(double value) {
+  char buffer[32];
+  if (value == floor(value) && fabs(value) < 1e15)
+    snprintf(buffer, sizeof(buffer), "%.0f", value);
+  else
+    snprintf(buffer, sizeof(buffer), "%.10g", value);
+  return buffer;
+}
+
+struct CsvField {
+  const char *data;
+  size_t size;
+  bool quoted;
+};
+
+// Splits CSV/TSV text into records and fields. A quote toggles quoting
+// wherever it appears, so whether a byte is inside a quoted field only
+// depends on the number of quotes before it; that is what lets a big file
+// be cut into chunks that are parsed independently.
+class CsvReader {
+public:
+  // The start of the first record after p, given whether p is inside
+  // quotes
+  static const char *recordStart(const char *p, const char *end,
+                                 bool in_quote) {
+    while (p < end) {
+      if (in_quote) {
+        p = (const char *)memchr(p, '"', end - p);
+        if (!p)
+          return end;
+      } else {
+        p = findAny(p, end, '\n', '"', '\n');
+        if (p == end || *p == '\n')
+          return p == end ? end : p + 1;
+      }
+      in_quote = !in_quote;
+      p++;
+    }
+    return end;
+  }
+
+  // Calls fn(count) for each record in [p, end) with the first `wanted`
+  // fields in fields[0, count); the rest of the line is skipped without
+  // being split. Stops early when fn returns false and returns where the
+  // next record starts.
+  template <typename Fn>
+  static const char *read(const char *p, const char *end, char delim,
+                          size_t wanted, vector<CsvField> &fields, Fn fn) {
+    while (p < end) {
+      if (*p == '\n' || (*p == '\r' && p + 1 < end && p[1] == '\n')) {
+        p += *p == '\r' ? 2 : 1;
+        continue;
+      }
+      size_t count = 0;
+      bool line_done = false;
+      while (count < wanted && !line_done) {
+        const char *start = p;
+        bool quoted = false;
+        for (;;) {
+          p = findAny(p, end, delim, '\n', '"');
+          if (p == end || *p != '"')
+            break;
+          quoted = true;
+          const char *close = (const char *)memchr(p + 1, '"', end - p - 1);
+          p = close ? close + 1 : end;
+        }
+        if (count >= fields.size())
+          fields.resize(count + 1);
+        CsvField &field = fields[count++];
+        field.data = start;
+        field.size = p - start;
+        field.quoted = quoted;
+        line_done = p == end || *p == '\n';
+        if (line_done && field.size > 0 && start[field.size - 1] == '\r')
+          field.size--;
+        if (p < end)
+          p++;
+      }
+      while (!line_done && p < end) {
+        p = findAny(p, end, '\n', '"', '\n');
+        if (p < end && *p == '"') {
+          const char *close = (const char *)memchr(p + 1, '"', end - p - 1);
+          p = close ? close + 1 : end;
+          continue;
+        }
+        if (p < end)
+          p++;
+        line_done = true;
+      }
+      if (!fn(count))
+        break;
+    }
+    return p;
+  }
+};
+
+// Copies a field's text without its CSV quoting
+static void csvText(const CsvField &field, string &out) {
+  if (!field.quoted) {
+    out.assign(field.data, field.size);
+    return;
+  }
+  out.clear();
+  bool in_quote = false;
+  for (size_t i = 0; i < field.size; i++) {
+    char c = field.data[i];
+    if (c != '"') {
+      out += c;
+    } else if (in_quote && i + 1 < field.size && field.data[i + 1] == '"') {
+      out += '"';
+      i++;
+    } else {
+      in_quote = !in_quote;
+    }
+  }
+}
+
+// Orders numbers numerically and everything else as text
+static bool valueLess(const string &a, const string &b) {
+  double x, y;
+  if (parseDecimal(a.data(), a.size(), x) &&
+      parseDecimal(b.data(), b.size(), y))
+    return x < y;
+  return a < b;
+}
+
+enum QueryAggregate {
+  AGG_NONE,
+  AGG_COUNT,
+  AGG_SUM,
+  AGG_AVG,
+  AGG_MIN,
+  AGG_MAX
+};
+
+enum QueryOp { OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE, OP_HAS, OP_LACKS };
+
+struct QueryItem {
+  QueryAggregate aggregate;
+  size_t column; // SIZE_MAX for count(*)
+  string label;
+};
+
+struct QueryCondition {
+  size_t column;
+  QueryOp op;
+  string text;
+  double number;
+  bool numeric;
+};
+
+// Aggregates skip empty fields. sum and avg use the values that parse as
+// numbers; min and max compare numerically when every value is a number
+// and as text otherwise.
+struct AggregateState {
+  AggregateState()
+      : count(0), numbers(0), sum(0), min(HUGE_VAL), max(-HUGE_VAL) {}
+  uint64_t count;
+  uint64_t numbers;
+  double sum, min, max;
+  string min_text, max_text;
+};
+
+// query <file> [select ...] [where ...] [group by ...] [order by ...]
+// [limit n] over a mapped CSV/TSV file. The file is cut into chunks that
+// are scanned on all cores; only the columns the query mentions are
+// split out of each line.
+class CsvQuery {
+public:
+  CsvQuery()
+      : records(0), group_column(SIZE_MAX), order_item(SIZE_MAX),
+        order_column(SIZE_MAX), descending(false), limit(SIZE_MAX),
+        aggregated(false) {}
+
+  bool parse(const string &text, const vector<string> &header,
+             string &error) {
+    tokenize(text);
+    columns = header;
+    size_t i = 0;
+    if (keyword(i, "select")) {
+      i++;
+      for (;;) {
+        if (i < tokens.size() && tokens[i] == "*" && !quoted[i]) {
+          for (size_t c = 0; c < header.size(); c++)
+            addItem(AGG_NONE, c);
+          i++;
+        } else {
+          QueryItem item;
+          if (!parseItem(i, item, error))
+            return false;
+          items.push_back(item);
+        }
+        if (i < tokens.size() && tokens[i] == "," && !quoted[i]) {
+          i++;
+          continue;
+        }
+        break;
+      }
+    }
+    if (keyword(i, "where")) {
+      i++;
+      where.push_back(vector<QueryCondition>());
+      for (;;) {
+        QueryCondition condition;
+        if (!parseCondition(i, condition, error))
+          return false;
+        where.back().push_back(condition);
+        if (keyword(i, "and")) {
+          i++;
+        } else if (keyword(i, "or")) {
+          where.push_back(vector<QueryCondition>());
+          i++;
+        } else {
+          break;
+        }
+      }
+    }
+    if (keyword(i, "group")) {
+      if (!keyword(i + 1, "by") || i + 2 >= tokens.size()) {
+        error = "Expected 'group by <column>'";
+        return false;
+      }
+      i += 2;
+      if (!resolveColumn(i++, group_column, error))
+        return false;
+    }
+
+    aggregated = group_column != SIZE_MAX;
+    for (const QueryItem &item : items)
+      aggregated = aggregated || item.aggregate != AGG_NONE;
+    if (items.empty()) {
+      if (group_column != SIZE_MAX) {
+        addItem(AGG_NONE, group_column);
+        addItem(AGG_COUNT, SIZE_MAX);
+      } else {
+        for (size_t c = 0; c < header.size(); c++)
+          addItem(AGG_NONE, c);
+      }
+    }
+    for (const QueryItem &item : items) {
+      if (aggregated && item.aggregate == AGG_NONE &&
+          item.column != group_column) {
+        error = "'" + item.label + "' must be grouped by or aggregated";
+        return false;
+      }
+    }
+
+    if (keyword(i, "order")) {
+      if (!keyword(i + 1, "by")) {
+        error = "Expected 'order by <column>'";
+        return false;
+      }
+      i += 2;
+      QueryItem key;
+      if (!parseItem(i, key, error))
+        return false;
+      for (size_t k = 0; k < items.size() && order_item == SIZE_MAX; k++) {
+        if (items[k].aggregate == key.aggregate &&
+            items[k].column == key.column)
+          order_item = k;
+      }
+      if (order_item == SIZE_MAX) {
+        if (aggregated || key.aggregate != AGG_NONE) {
+          error = "'" + key.label + "' must be selected to order by it";
+          return false;
+        }
+        order_column = key.column;
+      }
+      if (keyword(i, "desc") || keyword(i, "asc"))
+        descending = keyword(i++, "desc");
+    }
+    if (keyword(i, "limit")) {
+      if (i + 1 >= tokens.size() || !isdigit((unsigned char)tokens[i + 1][0])) {
+        error = "Expected 'limit <number>'";
+        return false;
+      }
+      limit = strtoull(tokens[i + 1].c_str(), NULL, 10);
+      i += 2;
+    }
+    if (i < tokens.size()) {
+      error = "Unexpected '" + tokens[i] + "'";
+      return false;
+    }
+    return true;
+  }
+
+  void run(const char *begin, const char *end, char delim, unsigned threads) {
+    // Only the columns up to the last one used are split out
+    wanted = 0;
+    for (const QueryItem &item : items) {
+      if (item.column != SIZE_MAX)
+        wanted = max(wanted, item.column + 1);
+    }
+    for (const vector<QueryCondition> &all : where) {
+      for (const QueryCondition &condition : all)
+        wanted = max(wanted, condition.column + 1);
+    }
+    if (group_column != SIZE_MAX)
+      wanted = max(wanted, group_column + 1);
+    if (order_column != SIZE_MAX)
+      wanted = max(wanted, order_column + 1);
+
+    size_t size = end - begin;
+    size_t count = size < CHUNK_BYTES * 4
+                       ? 1
+                       : min<size_t>(threads * 4, size / CHUNK_BYTES);
+    vector<const char *> bounds(count + 1);
+    for (size_t i = 0; i < count; i++)
+      bounds[i] = begin + size / count * i;
+    bounds[count] = end;
+
+    // Whether a boundary falls inside a quoted field depends on the parity
+    // of the quotes before it; each chunk then starts at the first real
+    // record start after its boundary
+    vector<size_t> quotes(count);
+    if (count > 1) {
+      forEach(count, threads, [&](size_t i) {
+        quotes[i] = countByte(bounds[i], bounds[i + 1], '"');
+      });
+    }
+    chunks.assign(count, Chunk());
+    size_t parity = 0;
+    chunks[0].begin = begin;
+    for (size_t i = 1; i < count; i++) {
+      parity += quotes[i - 1];
+      chunks[i].begin = max(chunks[i - 1].begin,
+                            CsvReader::recordStart(bounds[i], end, parity & 1));
+      chunks[i - 1].end = chunks[i].begin;
+    }
+    chunks[count - 1].end = end;
+
+    forEach(count, threads, [&](size_t i) { scan(chunks[i], delim); });
+    collect();
+  }
+
+  vector<string> labels() const {
+    vector<string> names;
+    for (const QueryItem &item : items)
+      names.push_back(item.label);
+    return names;
+  }
+
+  vector<vector<string>> rows;
+  uint64_t records;
+
+private:
+  static const size_t CHUNK_BYTES = 1 << 20;
+
+  struct Chunk {
+    Chunk() : begin(0), end(0), records(0) {}
+    const char *begin, *end;
+    uint64_t records;
+    vector<vector<string>> rows;
+    unordered_map<string, vector<AggregateState>> groups;
+  };
+
+  vector<string> tokens;
+  vector<bool> quoted;
+  vector<string> columns;
+  vector<QueryItem> items;
+  vector<vector<QueryCondition>> where; // ORs of ANDs
+  size_t group_column;
+  size_t order_item;
+  size_t order_column; // sort key that is not selected
+  bool descending;
+  size_t limit;
+  bool aggregated;
+  size_t wanted;
+  vector<Chunk> chunks;
+
+  template <typename Fn>
+  static void forEach(size_t count, unsigned threads, Fn fn) {
+    atomic<size_t> next(0);
+    auto work = [&]() {
+      blockThreadSignals();
+      size_t i;
+      while ((i = next++) < count)
+        fn(i);
+    };
+    vector<thread> workers;
+    for (unsigned t = 1; t < min<size_t>(threads, count); t++)
+      workers.push_back(thread(work));
+    work();
+    for (thread &worker : workers)
+      worker.join();
+  }
+
+  void tokenize(const string &text) {
+    size_t i = 0;
+    while (i < text.size()) {
+      char c = text[i];
+      if (isspace((unsigned char)c)) {
+        i++;
+      } else if (c == '\'' || c == '"') {
+        size_t close = text.find(c, i + 1);
+        if (close == string::npos)
+          close = text.size();
+        tokens.push_back(text.substr(i + 1, close - i - 1));
+        quoted.push_back(true);
+        i = close + 1;
+      } else if (strchr(",()*", c)) {
+        tokens.push_back(string(1, c));
+        quoted.push_back(false);
+        i++;
+      } else if (strchr("=<>!~", c)) {
+        size_t length = i + 1 < text.size() && strchr("=>~", text[i + 1]) &&
+                                !(c == '>' && text[i + 1] == '>')
+                            ? 2
+                            : 1;
+        tokens.push_back(text.substr(i, length));
+        quoted.push_back(false);
+        i += length;
+      } else {
+        size_t start = i;
+        while (i < text.size() && !isspace((unsigned char)text[i]) &&
+               !strchr(",()=<>!~'\"", text[i]))
+          i++;
+        tokens.push_back(text.substr(start, i - start));
+        quoted.push_back(false);
+      }
+    }
+  }
+
+  bool keyword(size_t i, const char *word) const {
+    return i < tokens.size() && !quoted[i] &&
+           strcasecmp(tokens[i].c_str(), word) == 0;
+  }
+
+  bool resolveColumn(size_t i, size_t &column, string &error) const {
+    for (int exact = 1; exact >= 0; exact--) {
+      for (size_t c = 0; c < columns.size(); c++) {
+        if (exact ? columns[c] == tokens[i]
+                  : strcasecmp(columns[c].c_str(), tokens[i].c_str()) == 0) {
+          column = c;
+          return true;
+        }
+      }
+    }
+    error = "Unknown column '" + tokens[i] + "'";
+    return false;
+  }
+
+  void addItem(QueryAggregate aggregate, size_t column) {
+    static const char *const names[] = {"", "count", "sum", "avg", "min",
+                                        "max"};
+    QueryItem item;
+    item.aggregate = aggregate;
+    item.column = column;
+    string name = column == SIZE_MAX ? "*" : columns[column];
+    item.label = aggregate == AGG_NONE
+                     ? name
+                     : string(names[aggregate]) + "(" + name + ")";
+    items.push_back(item);
+  }
+
+  bool parseItem(size_t &i, QueryItem &item, string &error) {
+    static const char *const names[] = {"count", "sum", "avg", "min", "max"};
+    if (i >= tokens.size()) {
+      error = "Expected a column";
+      return false;
+    }
+    QueryAggregate aggregate = AGG_NONE;
+    for (int k = 0; k < 5 && i + 1 < tokens.size(); k++) {
+      if (keyword(i, names[k]) && tokens[i + 1] == "(")
+        aggregate = (QueryAggregate)(AGG_COUNT + k);
+    }
+    size_t column = SIZE_MAX;
+    if (aggregate != AGG_NONE) {
+      i += 2;
+      if (i < tokens.size() && tokens[i] == "*" && aggregate == AGG_COUNT) {
+        i++;
+      } else if (i >= tokens.size() || !resolveColumn(i++, column, error)) {
+        if (error.empty())
+          error = "Expected a column";
+        return false;
+      }
+      if (i >= tokens.size() || tokens[i] != ")") {
+        error = "Expected ')'";
+        return false;
+      }
+      i++;
+    } else if (!resolveColumn(i++, column, error)) {
+      return false;
+    }
+    addItem(aggregate, column);
+    item = items.back();
+    items.pop_back();
+    return true;
+  }
+
+  bool parseCondition(size_t &i, QueryCondition &condition, string &error) {
+    static const char *const ops[] = {"=", "!=", "<", "<=", ">", ">=", "~",
+                                      "!~"};
+    if (i >= tokens.size()) {
+      error = "Expected a condition";
+      return false;
+    }
+    if (!resolveColumn(i++, condition.column, error))
+      return false;
+    if (i + 1 >= tokens.size()) {
+      error = "Expected '<column> <op> <value>'";
+      return false;
+    }
+    string op = tokens[i] == "==" ? "=" : tokens[i] == "<>" ? "!=" : tokens[i];
+    int found = -1;
+    for (int k = 0; k < 8; k++) {
+      if (op == ops[k])
+        found = k;
+    }
+    if (found < 0 || quoted[i]) {
+      error = "Unknown operator '" + tokens[i] + "'";
+      return false;
+    }
+    condition.op = (QueryOp)found;
+    condition.text = tokens[i + 1];
+    condition.numeric =
+        !quoted[i + 1] && found < OP_HAS &&
+        parseDecimal(condition.text.data(), condition.text.size(),
+                     condition.number);
+    i += 2;
+    return true;
+  }
+
+  static CsvField field(const vector<CsvField> &fields, size_t count,
+                        size_t column) {
+    if (column < count)
+      return fields[column];
+    CsvField empty = {"", 0, false};
+    return empty;
+  }
+
+  static bool test(const QueryCondition &condition, const CsvField &field,
+                   string &scratch) {
+    const char *data = field.data;
+    size_t size = field.size;
+    if (field.quoted) {
+      csvText(field, scratch);
+      data = scratch.data();
+      size = scratch.size();
+    }
+    if (condition.op == OP_HAS || condition.op == OP_LACKS) {
+      bool found = search(data, data + size, condition.text.begin(),
+                          condition.text.end()) != data + size ||
+                   condition.text.empty();
+      return found == (condition.op == OP_HAS);
+    }
+
+    int order;
+    if (condition.numeric) {
+      // A typed comparison: values that are not numbers never match
+      double value;
+      if (!parseDecimal(data, size, value))
+        return condition.op == OP_NE;
+      order = value < condition.number ? -1 : value > condition.number;
+    } else {
+      int c = memcmp(data, condition.text.data(),
+                     min(size, condition.text.size()));
+      order = c ? c : size < condition.text.size()   ? -1
+                      : size > condition.text.size() ? 1
+                                                     : 0;
+    }
+    switch (condition.op) {
+    case OP_EQ:
+      return order == 0;
+    case OP_NE:
+      return order != 0;
+    case OP_LT:
+      return order < 0;
+    case OP_LE:
+      return order <= 0;
+    case OP_GT:
+      return order > 0;
+    default:
+      return order >= 0;
+    }
+  }
+
+  bool matches(const vector<CsvField> &fields, size_t count,
+               string &scratch) const {
+    if (where.empty())
+      return true;
+    for (const vector<QueryCondition> &all : where) {
+      bool ok = true;
+      for (size_t k = 0; k < all.size() && ok; k++)
+        ok = test(all[k], field(fields, count, all[k].column), scratch);
+      if (ok)
+        return true;
+    }
+    return false;
+  }
+
+  static void update(AggregateState &state, const QueryItem &item,
+                     const CsvField &field, string &scratch) {
+    if (item.column == SIZE_MAX) {
+      state.count++;
+      return;
+    }
+    if (field.size == 0)
+      return;
+    state.count++;
+    if (item.aggregate == AGG_COUNT)
+      return;
+    const char *data = field.data;
+    size_t size = field.size;
+    if (field.quoted) {
+      csvText(field, scratch);
+      data = scratch.data();
+      size = scratch.size();
+    }
+    double value;
+    if (parseDecimal(data, size, value)) {
+      state.numbers++;
+      state.sum += value;
+      state.min = min(state.min, value);
+      state.max = max(state.max, value);
+    }
+    if (item.aggregate == AGG_MIN &&
+        (state.count == 1 || state.min_text.compare(0, string::npos, data,
+                                                    size) > 0))
+      state.min_text.assign(data, size);
+    if (item.aggregate == AGG_MAX &&
+        (state.count == 1 || state.max_text.compare(0, string::npos, data,
+                                                    size) < 0))
+      state.max_text.assign(data, size);
+  }
+
+  static void merge(AggregateState &into, const AggregateState &from) {
+    if (from.count == 0)
+      return;
+    if (into.count == 0 || from.min_text < into.min_text)
+      into.min_text = from.min_text;
+    if (into.count == 0 || from.max_text > into.max_text)
+      into.max_text = from.max_text;
+    into.count += from.count;
+    into.numbers += from.numbers;
+    into.sum += from.sum;
+    into.min = min(into.min, from.min);
+    into.max = max(into.max, from.max);
+  }
+
+  static string finish(const AggregateState &state, QueryAggregate aggregate) {
+    bool all_numbers = state.count > 0 && state.numbers == state.count;
+    switch (aggregate) {
+    case AGG_COUNT:
+      return to_string(state.count);
+    case AGG_SUM:
+      return state.numbers ? formatNumber(state.sum) : "";
+    case AGG_AVG:
+      return state.numbers ? formatNumber(state.sum / state.numbers) : "";
+    case AGG_MIN:
+      return all_numbers ? formatNumber(state.min) : state.min_text;
+    case AGG_MAX:
+      return all_numbers ? formatNumber(state.max) : state.max_text;
+    default:
+      return "";
+    }
+  }
+
+  void scan(Chunk &chunk, char delim) {
+    vector<CsvField> fields(wanted);
+    string scratch, key;
+    bool early_stop = !aggregated && order_item == SIZE_MAX &&
+                      order_column == SIZE_MAX && limit != SIZE_MAX;
+    CsvReader::read(
+        chunk.begin, chunk.end, delim, wanted, fields, [&](size_t count) {
+          chunk.records++;
+          if (!matches(fields, count, scratch))
+            return true;
+          if (aggregated) {
+            if (group_column == SIZE_MAX)
+              key.clear();
+            else
+              csvText(field(fields, count, group_column), key);
+            unordered_map<string, vector<AggregateState>>::iterator it =
+                chunk.groups.find(key);
+            if (it == chunk.groups.end())
+              it = chunk.groups
+                       .insert(make_pair(
+                           key, vector<AggregateState>(items.size())))
+                       .first;
+            for (size_t k = 0; k < items.size(); k++) {
+              if (items[k].aggregate != AGG_NONE)
+                update(it->second[k], items[k],
+                       field(fields, count, items[k].column), scratch);
+            }
+            return true;
+          }
+          vector<string> row(items.size() + (order_column != SIZE_MAX));
+          for (size_t k = 0; k < items.size(); k++)
+            csvText(field(fields, count, items[k].column), row[k]);
+          if (order_column != SIZE_MAX)
+            csvText(field(fields, count, order_column), row.back());
+          chunk.rows.push_back(row);
+          return !early_stop || chunk.rows.size() < limit;
+        });
+  }
+
+  void collect() {
+    records = 0;
+    rows.clear();
+    size_t sort_key = order_item != SIZE_MAX ? order_item
+                      : order_column != SIZE_MAX ? items.size()
+                                                 : SIZE_MAX;
+    if (!aggregated) {
+      for (Chunk &chunk : chunks) {
+        records += chunk.records;
+        for (vector<string> &row : chunk.rows) {
+          rows.push_back(vector<string>());
+          rows.back().swap(row);
+        }
+      }
+    } else {
+      unordered_map<string, vector<AggregateState>> groups;
+      for (Chunk &chunk : chunks) {
+        records += chunk.records;
+        for (auto &pair : chunk.groups) {
+          vector<AggregateState> &states = groups[pair.first];
+          if (states.empty())
+            states.resize(items.size());
+          for (size_t k = 0; k < items.size(); k++)
+            merge(states[k], pair.second[k]);
+        }
+      }
+      // An aggregate over no rows still has one row
+      if (groups.empty() && group_column == SIZE_MAX)
+        groups[""].resize(items.size());
+      vector<pair<string, vector<string>>> keyed;
+      for (auto &pair : groups) {
+        vector<string> row(items.size());
+        for (size_t k = 0; k < items.size(); k++)
+          row[k] = items[k].aggregate == AGG_NONE
+                       ? pair.first
+                       : finish(pair.second[k], items[k].aggregate);
+        keyed.push_back(make_pair(pair.first, row));
+      }
+      sort(keyed.begin(), keyed.end(),
+           [](const pair<string, vector<string>> &a,
+              const pair<string, vector<string>> &b) {
+             return valueLess(a.first, b.first);
+           });
+      for (auto &pair : keyed)
+        rows.push_back(pair.second);
+    }
+    chunks.clear();
+
+    if (sort_key != SIZE_MAX) {
+      bool desc = descending;
+      stable_sort(rows.begin(), rows.end(),
+                  [sort_key, desc](const vector<string> &a,
+                                   const vector<string> &b) {
+                    return desc ? valueLess(b[sort_key], a[sort_key])
+                                : valueLess(a[sort_key], b[sort_key]);
+                  });
+    }
+    if (rows.size() > limit)
+      rows.resize(limit);
+    if (order_column != SIZE_MAX) {
+      for (vector<string> &row : rows)
+        row.pop_back();
+    }
+  }
+};
+#endif
+
+#ifdef __linux__
+// Reads a small /proc file into a caller-supplied buffer without allocating.
+// Returns the length read (NUL-terminated), or -1.
+static ssize_t readProcFile(const char *path, char *buffer, size_t size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  size_t used = 0;
+  while (used + 1 < size) {
+    ssize_t n = read(fd, buffer + used, size - 1 - used);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    used += n;
+  }
+  close(fd);
+  buffer[used] = '\0';
+  return (ssize_t)used;
+}
+
+// The whole file, for the few that have no useful size limit
+static bool readProcFile(const char *path, string &out) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  out.clear();
+  char buffer[65536];
+  while (true) {
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    out.append(buffer, n);
+  }
+  close(fd);
+  return !out.empty();
+}
+
+static uint64_t parseNumber(const char *&pos, const char *end) {
+  while (pos < end && (*pos == ' ' || *pos == '\t'))
+    pos++;
+  uint64_t value = 0;
+  while (pos < end && *pos >= '0' && *pos <= '9')
+    value = value * 10 + (*pos++ - '0');
+  return value;
+}
+
+static void skipField(const char *&pos, const char *end) {
+  while (pos < end && *pos == ' ')
+    pos++;
+  while (pos < end && *pos != ' ')
+    pos++;
+}
+
+struct ProcInfo {
+  int pid;
+  uint64_t start_time;
+  char state;
+  char name[32];
+  string cmdline;
+  unsigned uid;
+  uint64_t cpu_ticks;
+  double cpu_percent;
+  uint64_t rss_pages;
+  uint64_t shared_pages;
+  int threads;
+  uint64_t seen;
+  chrono::steady_clock::time_point read_at;
+  int idle_streak;
+  uint64_t next_check;
+};
+
+// Process table built straight from /proc. stat is parsed in place from a
+// stack buffer; status (owner) and cmdline are read once per process and
+// statm only when the resident size moved. Processes that have been idle
+// for a while are re-read on a backoff of up to IDLE_BACKOFF refreshes, so
+// a refresh on a host full of sleeping daemons costs a fraction of a full
+// scan.
+class ProcessTable {
+public:
+  static const int IDLE_BACKOFF = 4;
+
+  ProcessTable() : generation(0) {
+    ticks_per_second = sysconf(_SC_CLK_TCK);
+    if (ticks_per_second <= 0)
+      ticks_per_second = 100;
+  }
+
+  // A full refresh re-reads every process, ignoring the idle backoff
+  void refresh(bool full = false) {
+    generation++;
+
+    DIR *dir = opendir("/proc");
+    if (!dir)
+      return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      const char *name = entry->d_name;
+      if (name[0] < '1' || name[0] > '9')
+        continue;
+      int pid = atoi(name);
+      ProcInfo &info = procs[pid];
+      bool fresh = info.seen == 0 || info.pid != pid;
+      if (fresh) {
+        info = ProcInfo();
+        info.pid = pid;
+      } else if (!full && generation < info.next_check) {
+        info.seen = generation;
+        continue;
+      }
+      if (!readStat(info, fresh)) {
+        procs.erase(pid);
+        continue;
+      }
+      info.seen = generation;
+    }
+    closedir(dir);
+
+    for (auto it = procs.begin(); it != procs.end();) {
+      if (it->second.seen != generation)
+        it = procs.erase(it);
+      else
+        ++it;
+    }
+  }
+
+  size_t size() const { return procs.size(); }
+
+  vector<const ProcInfo *> sorted(bool by_memory) const {
+    vector<const ProcInfo *> list;
+    list.reserve(procs.size());
+    for (const auto &pair : procs)
+      list.push_back(&pair.second);
+    sort(list.begin(), list.end(),
+         [by_memory](const ProcInfo *a, const ProcInfo *b) {
+           if (by_memory && a->rss_pages != b->rss_pages)
+             return a->rss_pages > b->rss_pages;
+           if (!by_memory && a->cpu_percent != b->cpu_percent)
+             return a->cpu_percent > b->cpu_percent;
+           return a->pid < b->pid;
+         });
+    return list;
+  }
+
+  // Matches the process name or its full command line
+  vector<const ProcInfo *> match(const string &pattern) const {
+    vector<const ProcInfo *> found;
+    for (const auto &pair : procs) {
+      const ProcInfo &info = pair.second;
+      if (strstr(info.name, pattern.c_str()) ||
+          info.cmdline.find(pattern) != string::npos)
+        found.push_back(&info);
+    }
+    sort(found.begin(), found.end(),
+         [](const ProcInfo *a, const ProcInfo *b) { return a->pid < b->pid; });
+    return found;
+  }
+
+private:
+  unordered_map<int, ProcInfo> procs;
+  uint64_t generation;
+  long ticks_per_second;
+
+  bool readStat(ProcInfo &info, bool fresh) {
+    char path[64], buffer[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", info.pid);
+    ssize_t length = readProcFile(path, buffer, sizeof(buffer));
+    if (length <= 0)
+      return false;
+    const char *end = buffer + length;
+    const char *open_paren = strchr(buffer, '(');
+    const char *close_paren = strrchr(buffer, ')');
+    if (!open_paren || !close_paren || close_paren + 2 >= end)
+      return false;
+
+    // Fields are numbered from 1 as in proc(5); the state is field 3
+    const char *pos = close_paren + 2;
+    char state = *pos++;
+    uint64_t utime = 0, stime = 0, start_time = 0, rss = 0;
+    int threads = 0;
+    for (int field = 4; field <= 24 && pos < end; field++) {
+      if (field == 14)
+        utime = parseNumber(pos, end);
+      else if (field == 15)
+        stime = parseNumber(pos, end);
+      else if (field == 20)
+        threads = (int)parseNumber(pos, end);
+      else if (field == 22)
+        start_time = parseNumber(pos, end);
+      else if (field == 24)
+        rss = parseNumber(pos, end);
+      else
+        skipField(pos, end);
+    }
+
+    // A recycled pid is a different process
+    if (!fresh && start_time != info.start_time) {
+      int pid = info.pid;
+      info = ProcInfo();
+      info.pid = pid;
+      fresh = true;
+    }
+
+    uint64_t ticks = utime + stime;
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    if (fresh) {
+      size_t name_length = min((size_t)(close_paren - open_paren - 1),
+                               sizeof(info.name) - 1);
+      memcpy(info.name, open_paren + 1, name_length);
+      info.name[name_length] = '\0';
+      info.start_time = start_time;
+      readOwner(info);
+      readCmdline(info);
+      info.cpu_percent = 0;
+    } else {
+      double seconds = elapsedNanos(info.read_at, now) / 1e9;
+      if (seconds > 0) {
+        info.cpu_percent =
+            (ticks - info.cpu_ticks) * 100.0 / ticks_per_second / seconds;
+      }
+    }
+    info.read_at = now;
+
+    if (fresh || rss != info.rss_pages)
+      readStatm(info);
+    info.rss_pages = rss;
+    info.state = state;
+    info.threads = threads;
+
+    if (!fresh && ticks == info.cpu_ticks && state != 'R')
+      info.idle_streak = min(info.idle_streak + 1, IDLE_BACKOFF);
+    else
+      info.idle_streak = 0;
+    info.next_check = generation + 1 + info.idle_streak;
+    info.cpu_ticks = ticks;
+    return true;
+  }
+
+  void readStatm(ProcInfo &info) {
+    char path[64], buffer[256];
+    snprintf(path, sizeof(path), "/proc/%d/statm", info.pid);
+    ssize_t length = readProcFile(path, buffer, sizeof(buffer));
+    if (length <= 0)
+      return;
+    const char *pos = buffer, *end = buffer + length;
+    skipField(pos, end);
+    skipField(pos, end);
+    info.shared_pages = parseNumber(pos, end);
+  }
+
+  void readOwner(ProcInfo &info) {
+    char path[64], buffer[2048];
+    snprintf(path, sizeof(path), "/proc/%d/status", info.pid);
+    ssize_t length = readProcFile(path, buffer, sizeof(buffer));
+    if (length <= 0)
+      return;
+    const char *uid = strstr(buffer, "\nUid:");
+    if (uid) {
+      const char *pos = uid + 5;
+      info.uid = (unsigned)parseNumber(pos, buffer + length);
+    }
+  }
+
+  void readCmdline(ProcInfo &info) {
+    char path[64], buffer[4096];
+    snprintf(path, sizeof(path), "/proc/%d/cmdline", info.pid);
+    ssize_t length = readProcFile(path, buffer, sizeof(buffer));
+    if (length <= 0) {
+      info.cmdline = string("[") + info.name + "]";
+      return;
+    }
+    while (length > 0 && buffer[length - 1] == '\0')
+      length--;
+    for (ssize_t i = 0; i < length; i++) {
+      if (buffer[i] == '\0')
+        buffer[i] = ' ';
+    }
+    info.cmdline.assign(buffer, length);
+  }
+};
+
+const int ProcessTable::IDLE_BACKOFF;
+#endif
+
+#ifdef __linux__
+struct CpuTimes {
+  uint64_t busy;
+  uint64_t total;
+};
+
+struct MemoryInfo {
+  uint64_t total;
+  uint64_t free;
+  uint64_t available;
+  uint64_t buffers;
+  uint64_t cached;
+  uint64_t shared;
+  uint64_t reclaimable;
+  uint64_t swap_total;
+  uint64_t swap_free;
+};
+
+struct PressureInfo {
+  bool available;
+  double some_avg10;
+  double full_avg10;
+  uint64_t some_total_us;
+  uint64_t full_total_us;
+};
+
+// Native collectors for /proc/meminfo, /proc/stat, /proc/uptime,
+// /proc/cpuinfo and /proc/pressure. Everything is parsed in place from
+// stack buffers, and results are cached for TTL_MS so repeated commands do
+// not re-read the kernel's tables.
+class SystemMetrics {
+public:
+  static const int TTL_MS = 1000;
+
+  SystemMetrics() : uptime_seconds(0) { memset(&mem, 0, sizeof(mem)); }
+
+  const MemoryInfo &memory() {
+    if (stale(mem_stamp)) {
+      char buffer[8192];
+      ssize_t length = readProcFile("/proc/meminfo", buffer, sizeof(buffer));
+      if (length > 0) {
+        const char *end = buffer + length;
+        mem.total = meminfoField(buffer, end, "MemTotal:");
+        mem.free = meminfoField(buffer, end, "MemFree:");
+        mem.available = meminfoField(buffer, end, "MemAvailable:");
+        mem.buffers = meminfoField(buffer, end, "Buffers:");
+        mem.cached = meminfoField(buffer, end, "Cached:");
+        mem.shared = meminfoField(buffer, end, "Shmem:");
+        mem.reclaimable = meminfoField(buffer, end, "SReclaimable:");
+        mem.swap_total = meminfoField(buffer, end, "SwapTotal:");
+        mem.swap_free = meminfoField(buffer, end, "SwapFree:");
+      }
+    }
+    return mem;
+  }
+
+  // Index 0 is the aggregate line, then one entry per core
+  const vector<CpuTimes> &cpuTimes() {
+    if (stale(cpu_stamp))
+      readCpuTimes(cpu);
+    return cpu;
+  }
+
+  // Uncached, for sampling over an interval
+  void readCpuTimes(vector<CpuTimes> &out) {
+    char buffer[131072];
+    ssize_t length = readProcFile("/proc/stat", buffer, sizeof(buffer));
+    out.clear();
+    if (length <= 0)
+      return;
+    const char *pos = buffer, *end = buffer + length;
+    while (pos + 3 < end && memcmp(pos, "cpu", 3) == 0) {
+      skipField(pos, end);
+      uint64_t values[8] = {0};
+      for (int i = 0; i < 8; i++)
+        values[i] = parseNumber(pos, end);
+      CpuTimes times;
+      // user nice system idle iowait irq softirq steal
+      times.total = 0;
+      for (int i = 0; i < 8; i++)
+        times.total += values[i];
+      times.busy = times.total - values[3] - values[4];
+      out.push_back(times);
+      const char *newline = (const char *)memchr(pos, '\n', end - pos);
+      if (!newline)
+        break;
+      pos = newline + 1;
+    }
+  }
+
+  double uptime() {
+    if (stale(uptime_stamp)) {
+      char buffer[128];
+      if (readProcFile("/proc/uptime", buffer, sizeof(buffer)) > 0)
+        uptime_seconds = atof(buffer);
+    }
+    return uptime_seconds;
+  }
+
+  const string &cpuModel() {
+    if (cpu_model.empty()) {
+      // The model is in the first processor's block; no need to read the
+      // whole file on hosts with hundreds of cores
+      char buffer[8192];
+      ssize_t length = readProcFile("/proc/cpuinfo", buffer, sizeof(buffer));
+      const char *keys[] = {"model name", "Hardware", "cpu model", "Model"};
+      for (size_t k = 0; length > 0 && k < 4 && cpu_model.empty(); k++) {
+        const char *line = strstr(buffer, keys[k]);
+        const char *colon = line ? strchr(line, ':') : NULL;
+        if (!colon)
+          continue;
+        const char *start = colon + 1;
+        while (*start == ' ' || *start == '\t')
+          start++;
+        const char *stop = strchr(start, '\n');
+        cpu_model.assign(start, stop ? stop - start : strlen(start));
+      }
+      if (cpu_model.empty())
+        cpu_model = "Unknown";
+    }
+    return cpu_model;
+  }
+
+  // resource is "cpu", "memory" or "io"
+  PressureInfo pressure(const char *resource) {
+    PressureInfo info;
+    memset(&info, 0, sizeof(info));
+    char path[64], buffer[512];
+    snprintf(path, sizeof(path), "/proc/pressure/%s", resource);
+    if (readProcFile(path, buffer, sizeof(buffer)) <= 0)
+      return info;
+    info.available = true;
+    const char *some = strstr(buffer, "some ");
+    const char *full = strstr(buffer, "full ");
+    if (some)
+      parsePressureLine(some, info.some_avg10, info.some_total_us);
+    if (full)
+      parsePressureLine(full, info.full_avg10, info.full_total_us);
+    return info;
+  }
+
+private:
+  MemoryInfo mem;
+  vector<CpuTimes> cpu;
+  double uptime_seconds;
+  string cpu_model;
+  chrono::steady_clock::time_point mem_stamp, cpu_stamp, uptime_stamp;
+
+  static bool stale(chrono::steady_clock::time_point &stamp) {
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    if (stamp.time_since_epoch().count() != 0 &&
+        now - stamp < chrono::milliseconds(TTL_MS))
+      return false;
+    stamp = now;
+    return true;
+  }
+
+  // meminfo values are in kB
+  static uint64_t meminfoField(const char *buffer, const char *end,
+                               const char *key) {
+    size_t key_length = strlen(key);
+    const char *pos = buffer;
+    while (pos < end) {
+      if (strncmp(pos, key, key_length) == 0) {
+        pos += key_length;
+        return parseNumber(pos, end) * 1024;
+      }
+      const char *newline = (const char *)memchr(pos, '\n', end - pos);
+      if (!newline)
+        break;
+      pos = newline + 1;
+    }
+    return 0;
+  }
+
+  static void parsePressureLine(const char *line, double &avg10,
+                                uint64_t &total) {
+    const char *avg = strstr(line, "avg10=");
+    const char *tot = strstr(line, "total=");
+    const char *newline = strchr(line, '\n');
+    if (avg && (!newline || avg < newline))
+      avg10 = atof(avg + 6);
+    if (tot && (!newline || tot < newline))
+      total = strtoull(tot + 6, NULL, 10);
+  }
+};
+
+const int SystemMetrics::TTL_MS;
+#endif
+
+#ifdef __linux__
+struct EntryStat {
+  uint64_t dev;
+  uint64_t ino;
+  int64_t mtime_ns;
+  uint64_t bytes;
+  uint64_t links;
+  bool is_dir;
+};
+
+// statx where the C library has it, fstatat otherwise. Never follows
+// symlinks; bytes is the space actually allocated, as du reports it.
+static bool statEntry(int dirfd, const char *name, EntryStat &out) {
+#ifdef STATX_BLOCKS
+  struct statx stx;
+  int flags = AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC;
+  if (name[0] == '\0')
+    flags |= AT_EMPTY_PATH;
+  if (statx(dirfd, name, flags,
+            STATX_TYPE | STATX_INO | STATX_MTIME | STATX_BLOCKS |
+                STATX_NLINK,
+            &stx) != 0)
+    return false;
+  out.dev = ((uint64_t)stx.stx_dev_major << 32) | stx.stx_dev_minor;
+  out.ino = stx.stx_ino;
+  out.mtime_ns = (int64_t)stx.stx_mtime.tv_sec * 1000000000 +
+                 stx.stx_mtime.tv_nsec;
+  out.bytes = stx.stx_blocks * 512;
+  out.links = stx.stx_nlink;
+  out.is_dir = S_ISDIR(stx.stx_mode);
+#else
+  struct stat st;
+  int flags = AT_SYMLINK_NOFOLLOW;
+  if (name[0] == '\0')
+    flags |= AT_EMPTY_PATH;
+  if (fstatat(dirfd, name, &st, flags) != 0)
+    return false;
+  out.dev = st.st_dev;
+  out.ino = st.st_ino;
+  out.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  out.bytes = (uint64_t)st.st_blocks * 512;
+  out.links = st.st_nlink;
+  out.is_dir = S_ISDIR(st.st_mode);
+#endif
+  return true;
+}
+
+// What a directory holds directly, remembered between scans. Valid while
+// the directory's mtime is unchanged, i.e. nothing was added, removed or
+// renamed in it. Hard-linked files are kept apart so each inode is only
+// counted once per scan, as du does.
+struct UsageDir {
+  int64_t mtime_ns;
+  int64_t last_used; // when a scan last went through it
+  uint64_t file_bytes;
+  uint64_t file_count;
+  vector<string> subdirs;
+  vector<pair<uint64_t, uint64_t>> linked;
+};
+
+struct UsageNode {
+  string name;
+  size_t parent;
+  uint64_t total_bytes;
+  uint64_t total_files;
+};
+
+// Walks a tree with a pool of threads, one directory per work item, and
+// sums allocated sizes per subtree. Directories whose inode and mtime match
+// the cache are not listed again; only their subdirectories are visited.
+// Stays on the filesystem the walk started on.
+class DiskUsageScanner {
+public:
+  typedef map<pair<uint64_t, uint64_t>, UsageDir> Cache;
+
+  DiskUsageScanner(const Cache &previous, bool use_cache)
+      : previous(previous), use_cache(use_cache), pending(0), dirs_scanned(0),
+        dirs_cached(0), errors(0) {}
+
+  bool scan(const string &root, unsigned thread_count) {
+    EntryStat st;
+    if (!statEntry(AT_FDCWD, root.c_str(), st) || !st.is_dir)
+      return false;
+    root_dev = st.dev;
+
+    UsageNode node;
+    node.name = root;
+    node.parent = SIZE_MAX;
+    node.total_bytes = node.total_files = 0;
+    nodes.push_back(node);
+    queue.push_back(make_pair(root, (size_t)0));
+    pending = 1;
+
+    vector<thread> workers;
+    for (unsigned i = 0; i < thread_count; i++)
+      workers.push_back(thread(&DiskUsageScanner::work, this));
+    for (size_t i = 0; i < workers.size(); i++)
+      workers[i].join();
+
+    // Children are always created after their parent
+    for (size_t i = nodes.size() - 1; i > 0; i--) {
+      nodes[nodes[i].parent].total_bytes += nodes[i].total_bytes;
+      nodes[nodes[i].parent].total_files += nodes[i].total_files;
+    }
+    return true;
+  }
+
+  const vector<UsageNode> &tree() const { return nodes; }
+  const Cache &updated() const { return fresh; }
+  uint64_t scanned() const { return dirs_scanned; }
+  uint64_t cached() const { return dirs_cached; }
+  uint64_t failures() const { return errors; }
+
+private:
+  const Cache &previous;
+  bool use_cache;
+  uint64_t root_dev;
+  vector<UsageNode> nodes;
+  Cache fresh;
+  vector<pair<string, size_t>> queue;
+  size_t pending;
+  uint64_t dirs_scanned;
+  uint64_t dirs_cached;
+  uint64_t errors;
+  set<uint64_t> seen_links;
+  mutex lock;
+  condition_variable ready;
+
+  void work() {
+    blockThreadSignals();
+    unique_lock<mutex> guard(lock);
+    while (true) {
+      while (queue.empty() && pending > 0)
+        ready.wait(guard);
+      if (queue.empty())
+        break;
+      pair<string, size_t> item = queue.back();
+      queue.pop_back();
+      guard.unlock();
+      visit(item.first, item.second);
+      guard.lock();
+      if (--pending == 0)
+        ready.notify_all();
+    }
+  }
+
+  void visit(const string &path, size_t index) {
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    EntryStat self;
+    if (fd < 0 || !statEntry(fd, "", self)) {
+      if (fd >= 0)
+        close(fd);
+      lock_guard<mutex> guard(lock);
+      errors++;
+      return;
+    }
+
+    pair<uint64_t, uint64_t> key(self.dev, self.ino);
+    UsageDir dir;
+    bool hit = false;
+    if (use_cache) {
+      Cache::const_iterator it = previous.find(key);
+      if (it != previous.end() && it->second.mtime_ns == self.mtime_ns) {
+        dir = it->second;
+        hit = true;
+      }
+    }
+
+    if (hit) {
+      close(fd);
+    } else {
+      dir.mtime_ns = self.mtime_ns;
+      dir.file_bytes = self.bytes;
+      dir.file_count = 0;
+      DIR *listing = fdopendir(fd);
+      if (!listing) {
+        close(fd);
+        lock_guard<mutex> guard(lock);
+        errors++;
+        return;
+      }
+      struct dirent *entry;
+      while ((entry = readdir(listing)) != NULL) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' &&
+            (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+          continue;
+        EntryStat st;
+        if (!statEntry(dirfd(listing), name, st))
+          continue;
+        if (st.is_dir) {
+          if (st.dev == root_dev)
+            dir.subdirs.push_back(name);
+        } else if (st.links > 1) {
+          dir.linked.push_back(make_pair(st.ino, st.bytes));
+          dir.file_count++;
+        } else {
+          dir.file_bytes += st.bytes;
+          dir.file_count++;
+        }
+      }
+      closedir(listing);
+    }
+
+    lock_guard<mutex> guard(lock);
+    if (hit)
+      dirs_cached++;
+    else
+      dirs_scanned++;
+    nodes[index].total_bytes += dir.file_bytes;
+    nodes[index].total_files += dir.file_count;
+    for (size_t i = 0; i < dir.linked.size(); i++) {
+      if (seen_links.insert(dir.linked[i].first).second)
+        nodes[index].total_bytes += dir.linked[i].second;
+    }
+    string prefix = path == "/" ? path : path + "/";
+    for (size_t i = 0; i < dir.subdirs.size(); i++) {
+      UsageNode child;
+      child.name = dir.subdirs[i];
+      child.parent = index;
+      child.total_bytes = child.total_files = 0;
+      nodes.push_back(child);
+      queue.push_back(make_pair(prefix + dir.subdirs[i], nodes.size() - 1));
+      pending++;
+    }
+    fresh[key] = dir;
+    if (!dir.subdirs.empty())
+      ready.notify_all();
+  }
+};
+#endif
+
+struct FrecencyEntry {
+  string path;
+  double rank;
+  time_t last_access;
+};
+
+// Every directory the shell has been in, ranked by frecency: how often it
+// was visited, weighted by how recently (the z/zoxide scheme). Lookups go
+// through a trigram index over the lowercased paths, rebuilt only after
+// the set of directories changes. A background thread ages ranks and
+// forgets directories that no longer exist.
+class FrecencyDb {
+public:
+  static const int MAX_TOTAL_RANK = 10000;
+  static const int AGING_INTERVAL_SECONDS = 600;
+  static const int PRUNE_INTERVAL_SECONDS = 86400;
+
+  FrecencyDb()
+      : dirty(false), index_dirty(true), last_pruned(0), aging(false) {}
+  ~FrecencyDb() { stopAging(); }
+
+  void load(const string &path) {
+    lock_guard<mutex> guard(lock);
+    file_path = path;
+    entries.clear();
+    by_path.clear();
+    last_pruned = 0;
+    readFile(path, entries, last_pruned);
+    for (size_t i = 0; i < entries.size(); i++)
+      by_path[entries[i].path] = i;
+    index_dirty = true;
+  }
+
+  // Merges with whatever other sessions saved meanwhile; the newer entry
+  // for a directory wins. Directories aged out here stay out unless
+  // another session has visited them since.
+  void save() {
+    lock_guard<mutex> guard(lock);
+    if (!dirty || file_path.empty())
+      return;
+    vector<FrecencyEntry> on_disk;
+    time_t pruned_on_disk = 0;
+    readFile(file_path, on_disk, pruned_on_disk);
+    last_pruned = max(last_pruned, pruned_on_disk);
+    for (const FrecencyEntry &entry : on_disk) {
+      auto gone = forgotten.find(entry.path);
+      if (gone != forgotten.end() && entry.last_access <= gone->second)
+        continue;
+      auto it = by_path.find(entry.path);
+      if (it == by_path.end()) {
+        by_path[entry.path] = entries.size();
+        entries.push_back(entry);
+        index_dirty = true;
+      } else if (entry.last_access > entries[it->second].last_access) {
+        entries[it->second] = entry;
+      }
+    }
+
+    // Rank 0, so versions that don't know the line skip it
+    ostringstream out;
+    out << PRUNED_KEY << "|0|" << last_pruned << "\n";
+    for (const FrecencyEntry &entry : entries) {
+      out << entry.path << "|" << entry.rank << "|" << entry.last_access
+          << "\n";
+    }
+    if (replaceFile(file_path, out.str())) {
+      dirty = false;
+      forgotten.clear();
+    }
+  }
+
+  void visit(const string &path) {
+    if (path.empty())
+      return;
+    lock_guard<mutex> guard(lock);
+    forgotten.erase(path);
+    auto it = by_path.find(path);
+    if (it == by_path.end()) {
+      FrecencyEntry entry;
+      entry.path = path;
+      entry.rank = 0;
+      by_path[path] = entries.size();
+      entries.push_back(entry);
+      it = by_path.find(path);
+      index_dirty = true;
+    }
+    entries[it->second].rank += 1;
+    entries[it->second].last_access = time(0);
+    dirty = true;
+  }
+
+  // Best matches for the query words, highest score first. All words must
+  // appear in order in the path; matches whose last word falls in the
+  // final path component rank above the rest, and when nothing matches
+  // that way the joined words are tried as a fuzzy subsequence of the
+  // path. No words lists everything.
+  vector<pair<double, string>> query(const vector<string> &words,
+                                     size_t limit) {
+    vector<string> lowered_words;
+    for (const string &word : words)
+      lowered_words.push_back(lowercase(word));
+
+    lock_guard<mutex> guard(lock);
+    if (index_dirty)
+      rebuildIndex();
+
+    time_t now = time(0);
+    vector<pair<double, string>> strong, weak, fuzzy;
+    const vector<uint32_t> *candidates = candidateSet(lowered_words);
+    size_t count = candidates ? candidates->size() : entries.size();
+    for (size_t c = 0; c < count; c++) {
+      size_t i = candidates ? (*candidates)[c] : c;
+      const string &path = lowered[i];
+      size_t base = path.find_last_of("/\\");
+      base = base == string::npos ? 0 : base + 1;
+      size_t last = lowered_words.empty()
+                        ? path.size()
+                        : matchInOrder(path, lowered_words);
+      if (last != string::npos) {
+        (last >= base ? strong : weak).push_back(
+            make_pair(frecency(entries[i], now), entries[i].path));
+      }
+    }
+
+    if (strong.empty() && weak.empty()) {
+      string joined;
+      for (const string &word : lowered_words)
+        joined += word;
+      for (size_t i = 0; i < entries.size(); i++) {
+        if (isSubsequence(joined, lowered[i]))
+          fuzzy.push_back(make_pair(frecency(entries[i], now),
+                                    entries[i].path));
+      }
+    }
+
+    vector<pair<double, string>> &best =
+        !strong.empty() ? strong : (!weak.empty() ? weak : fuzzy);
+    sort(best.rbegin(), best.rend());
+    if (best.size() > limit)
+      best.resize(limit);
+    return best;
+  }
+
+  size_t size() {
+    lock_guard<mutex> guard(lock);
+    return entries.size();
+  }
+
+  void startAging() {
+    if (aging)
+      return;
+    aging = true;
+    ager_state = make_shared<AgerState>();
+    ager = thread(&FrecencyDb::agingLoop, this, ager_state);
+  }
+
+  // A thread stuck checking a dead mount is left behind rather than
+  // waited for; it gives up as soon as its stat returns
+  void stopAging() {
+    if (!aging)
+      return;
+    aging = false;
+    bool stuck;
+    {
+      lock_guard<mutex> guard(ager_state->lock);
+      ager_state->stop = true;
+      stuck = ager_state->checking;
+    }
+    ager_state->wake.notify_all();
+    if (stuck)
+      ager.detach();
+    else
+      ager.join();
+    ager_state.reset();
+  }
+
+private:
+  string file_path;
+  vector<FrecencyEntry> entries;
+  unordered_map<string, size_t> by_path;
+  bool dirty;
+  // Aged-out paths and their last access, until the next save
+  unordered_map<string, time_t> forgotten;
+
+  vector<string> lowered;
+  unordered_map<uint32_t, vector<uint32_t>> trigrams;
+  bool index_dirty;
+
+  // Path of the line that records when deleted directories were last
+  // looked for; not an absolute path, so no directory can clash with it
+  static const char *const PRUNED_KEY;
+  time_t last_pruned;
+
+  // What the aging thread shares with us. It outlives the database when
+  // the thread is left behind in stopAging, so it is held by both.
+  struct AgerState {
+    AgerState() : stop(false), checking(false) {}
+    mutex lock;
+    condition_variable wake;
+    atomic<bool> stop;
+    bool checking;
+  };
+
+  mutex lock;
+  shared_ptr<AgerState> ager_state;
+  thread ager;
+  bool aging;
+
+  static string lowercase(const string &str) {
+    string out = str;
+    transform(out.begin(), out.end(), out.begin(), ::tolower);
+    return out;
+  }
+
+  static uint32_t trigram(const char *p) {
+    return ((uint32_t)(uint8_t)p[0] << 16) | ((uint32_t)(uint8_t)p[1] << 8) |
+           (uint8_t)p[2];
+  }
+
+  static double frecency(const FrecencyEntry &entry, time_t now) {
+    double age = difftime(now, entry.last_access);
+    if (age < 3600)
+      return entry.rank * 4;
+    if (age < 86400)
+      return entry.rank * 2;
+    if (age < 604800)
+      return entry.rank / 2;
+    return entry.rank / 4;
+  }
+
+  // Position of the last word's match, or npos
+  static size_t matchInOrder(const string &path, const vector<string> &words) {
+    size_t pos = 0, last = string::npos;
+    for (const string &word : words) {
+      last = path.find(word, pos);
+      if (last == string::npos)
+        return string::npos;
+      pos = last + word.size();
+    }
+    return last;
+  }
+
+  static bool isSubsequence(const string &needle, const string &haystack) {
+    size_t j = 0;
+    for (size_t i = 0; i < haystack.size() && j < needle.size(); i++) {
+      if (haystack[i] == needle[j])
+        j++;
+    }
+    return j == needle.size();
+  }
+
+  void rebuildIndex() {
+    lowered.resize(entries.size());
+    trigrams.clear();
+    for (size_t i = 0; i < entries.size(); i++) {
+      lowered[i] = lowercase(entries[i].path);
+      const string &path = lowered[i];
+      for (size_t j = 0; j + 3 <= path.size(); j++) {
+        vector<uint32_t> &list = trigrams[trigram(path.data() + j)];
+        if (list.empty() || list.back() != i)
+          list.push_back((uint32_t)i);
+      }
+    }
+    index_dirty = false;
+  }
+
+  // Narrows the search to the paths sharing the rarest trigram of any
+  // query word; the caller still checks each candidate, so one short
+  // postings list beats intersecting them all. Returns null when the words
+  // are too short to use the index.
+  const vector<uint32_t> *candidateSet(const vector<string> &words) {
+    static const vector<uint32_t> none;
+    const vector<uint32_t> *rarest = 0;
+    for (const string &word : words) {
+      for (size_t j = 0; j + 3 <= word.size(); j++) {
+        auto it = trigrams.find(trigram(word.data() + j));
+        if (it == trigrams.end())
+          return &none;
+        if (!rarest || it->second.size() < rarest->size())
+          rarest = &it->second;
+      }
+    }
+    return rarest;
+  }
+
+  static void readFile(const string &path, vector<FrecencyEntry> &out,
+                       time_t &pruned) {
+    ifstream in(path.c_str());
+    string line;
+    while (getline(in, line)) {
+      size_t key_size = strlen(PRUNED_KEY);
+      if (line.compare(0, key_size, PRUNED_KEY) == 0 &&
+          line.compare(key_size, 3, "|0|") == 0) {
+        pruned = (time_t)atoll(line.c_str() + key_size + 3);
+        continue;
+      }
+      size_t time_sep = line.rfind('|');
+      if (time_sep == string::npos || time_sep == 0)
+        continue;
+      size_t rank_sep = line.rfind('|', time_sep - 1);
+      if (rank_sep == string::npos)
+        continue;
+      FrecencyEntry entry;
+      entry.path = line.substr(0, rank_sep);
+      entry.rank = atof(line.c_str() + rank_sep + 1);
+      entry.last_access = (time_t)atoll(line.c_str() + time_sep + 1);
+      if (!entry.path.empty() && entry.rank > 0)
+        out.push_back(entry);
+    }
+  }
+
+  // Scales ranks down once their sum passes MAX_TOTAL_RANK, dropping
+  // entries that fall below 1, and at most once a day forgets deleted
+  // directories. Existence checks run without the lock, since they can
+  // block on slow mounts. Returns false if told to stop meanwhile, in
+  // which case this object may be gone.
+  bool ageOnce(const shared_ptr<AgerState> &state) {
+    vector<string> paths;
+    time_t now = time(0);
+    {
+      lock_guard<mutex> guard(lock);
+      if (now - last_pruned >= PRUNE_INTERVAL_SECONDS) {
+        last_pruned = now;
+        dirty = true;
+        for (const FrecencyEntry &entry : entries)
+          paths.push_back(entry.path);
+      }
+    }
+    set<string> missing;
+    if (!paths.empty()) {
+      {
+        lock_guard<mutex> guard(state->lock);
+        if (state->stop)
+          return false;
+        state->checking = true;
+      }
+      for (size_t i = 0; i < paths.size(); i++) {
+        if (!directoryExists(paths[i]))
+          missing.insert(paths[i]);
+        if (i % 64 == 63 && state->stop)
+          break;
+      }
+      lock_guard<mutex> guard(state->lock);
+      state->checking = false;
+      if (state->stop)
+        return false;
+    }
+
+    lock_guard<mutex> guard(lock);
+    double total = 0;
+    for (const FrecencyEntry &entry : entries)
+      total += entry.rank;
+    double scale = total > MAX_TOTAL_RANK ? 0.9 * MAX_TOTAL_RANK / total : 1;
+
+    vector<FrecencyEntry> kept;
+    for (FrecencyEntry &entry : entries) {
+      entry.rank *= scale;
+      if (entry.rank >= 1 && !missing.count(entry.path))
+        kept.push_back(entry);
+      else
+        forgotten[entry.path] = entry.last_access;
+    }
+    if (kept.size() != entries.size() || scale < 1) {
+      entries.swap(kept);
+      by_path.clear();
+      for (size_t i = 0; i < entries.size(); i++)
+        by_path[entries[i].path] = i;
+      index_dirty = true;
+      dirty = true;
+    }
+    return true;
+  }
+
+  void agingLoop(shared_ptr<AgerState> state) {
+    blockThreadSignals();
+    while (ageOnce(state)) {
+      unique_lock<mutex> guard(state->lock);
+      state->wake.wait_for(guard, chrono::seconds(AGING_INTERVAL_SECONDS),
+                           [&state]() { return state->stop.load(); });
+      if (state->stop)
+        break;
+    }
+  }
+};
+
+const int FrecencyDb::AGING_INTERVAL_SECONDS;
+const int FrecencyDb::PRUNE_INTERVAL_SECONDS;
+const char *const FrecencyDb::PRUNED_KEY = "#pruned";
+
+enum PromptSegmentKind {
+  PROMPT_TEXT,
+  PROMPT_TIME,
+  PROMPT_USER,
+  PROMPT_CWD,
+  PROMPT_VCS,
+  PROMPT_DURATION
+};
+
+struct PromptSegment {
+  PromptSegmentKind kind;
+  string text;
+};
+
+// Splits a template such as "{user}@neoshell {cwd}\n> " into literal and
+// placeholder segments once per theme change, so drawing the prompt is a
+// walk over a short vector. Unknown placeholders stay literal.
+static vector<PromptSegment> compilePrompt(const string &format) {
+  static const char *names[] = {"time", "user", "cwd", "vcs", "duration"};
+  static const PromptSegmentKind kinds[] = {PROMPT_TIME, PROMPT_USER,
+                                            PROMPT_CWD, PROMPT_VCS,
+                                            PROMPT_DURATION};
+  vector<PromptSegment> segments;
+  PromptSegment literal;
+  literal.kind = PROMPT_TEXT;
+  size_t pos = 0;
+  while (pos < format.size()) {
+    size_t open = format.find('{', pos);
+    size_t close = open == string::npos ? open : format.find('}', open);
+    if (close == string::npos) {
+      literal.text += format.substr(pos);
+      break;
+    }
+    literal.text += format.substr(pos, open - pos);
+    string name = format.substr(open + 1, close - open - 1);
+    size_t k = 0;
+    while (k < 5 && name != names[k])
+      k++;
+    if (k == 5) {
+      literal.text += format.substr(open, close - open + 1);
+    } else {
+      if (!literal.text.empty())
+        segments.push_back(literal);
+      literal.text.clear();
+      PromptSegment placeholder;
+      placeholder.kind = kinds[k];
+      segments.push_back(placeholder);
+    }
+    pos = close + 1;
+  }
+  if (!literal.text.empty())
+    segments.push_back(literal);
+  return segments;
+}
+
+struct VcsStatus {
+  string branch;
+  bool dirty;
+};
+
+// Works out the git branch and dirty state of a directory off the main
+// thread, since `git status` can take seconds in a big repository. The
+// prompt waits a few milliseconds for a fresh answer and otherwise draws
+// the last one known for that directory; the late answer shows next time.
+class VcsStatusWorker {
+public:
+  VcsStatusWorker()
+      : requested(0), completed(0), stopping(false), started(false) {}
+  ~VcsStatusWorker() { stop(); }
+
+  bool lookup(const string &dir, int budget_ms, VcsStatus &status) {
+    unique_lock<mutex> guard(lock);
+    if (!started) {
+      started = true;
+      worker = thread(&VcsStatusWorker::loop, this);
+    }
+    pending_dir = dir;
+    uint64_t wanted = ++requested;
+    wake.notify_all();
+    done.wait_for(guard, chrono::milliseconds(budget_ms),
+                  [&]() { return completed >= wanted; });
+    auto it = results.find(dir);
+    if (it == results.end())
+      return false;
+    status = it->second;
+    return !status.branch.empty();
+  }
+
+  void stop() {
+    {
+      lock_guard<mutex> guard(lock);
+      if (!started)
+        return;
+      stopping = true;
+    }
+    wake.notify_all();
+    worker.join();
+    started = stopping = false;
+  }
+
+private:
+  static const size_t MAX_CACHED_DIRS = 256;
+
+  mutex lock;
+  condition_variable wake, done;
+  thread worker;
+  string pending_dir;
+  uint64_t requested, completed;
+  bool stopping, started;
+  map<string, VcsStatus> results;
+
+  void loop() {
+    blockThreadSignals();
+    unique_lock<mutex> guard(lock);
+    while (true) {
+      wake.wait(guard, [this]() { return stopping || completed < requested; });
+      if (stopping)
+        break;
+      string dir = pending_dir;
+      uint64_t serving = requested;
+      guard.unlock();
+      VcsStatus status = compute(dir);
+      guard.lock();
+      if (results.size() >= MAX_CACHED_DIRS)
+        results.clear();
+      results[dir] = status;
+      completed = serving;
+      done.notify_all();
+    }
+  }
+
+  static bool readFirstLine(const string &path, string &line) {
+    ifstream file(path.c_str());
+    return file.is_open() && getline(file, line);
+  }
+
+  static VcsStatus compute(const string &dir) {
+    VcsStatus status;
+    status.dirty = false;
+
+    // Walk up to the work tree root; .git is a file in worktrees
+    string root = dir, git_dir, head;
+    while (true) {
+      string line;
+      if (directoryExists(root + "/.git")) {
+        git_dir = root + "/.git";
+        break;
+      }
+      if (readFirstLine(root + "/.git", line) &&
+          line.compare(0, 8, "gitdir: ") == 0) {
+        git_dir = line.substr(8);
+        if (git_dir[0] != '/')
+          git_dir = root + "/" + git_dir;
+        break;
+      }
+      size_t slash = root.find_last_of("/\\");
+      if (slash == string::npos || root.size() <= 1)
+        return status;
+      root = slash == 0 ? "/" : root.substr(0, slash);
+    }
+    if (!readFirstLine(git_dir + "/HEAD", head))
+      return status;
+    if (head.compare(0, 16, "ref: refs/heads/") == 0)
+      status.branch = head.substr(16);
+    else
+      status.branch = head.substr(0, 7);
+
+    // --no-optional-locks keeps status from refreshing the index, which
+    // takes index.lock and can make the user's own git commands fail
+#ifdef _WIN32
+    string command = "git --no-optional-locks -C \"" + root +
+                     "\" status --porcelain --untracked-files=no 2>nul";
+    FILE *pipe = _popen(command.c_str(), "r");
+#else
+    string quoted = "'";
+    for (char c : root)
+      quoted += c == '\'' ? string("'\\''") : string(1, c);
+    quoted += "'";
+    string command = "git --no-optional-locks -C " + quoted +
+                     " status --porcelain --untracked-files=no 2>/dev/null";
+    FILE *pipe = popen(command.c_str(), "r");
+#endif
+    if (pipe) {
+      char buffer[256];
+      status.dirty = fgets(buffer, sizeof(buffer), pipe) != 0;
+      while (fgets(buffer, sizeof(buffer), pipe)) {
+      }
+#ifdef _WIN32
+      _pclose(pipe);
+#else
+      pclose(pipe);
+#endif
+    }
+    return status;
+  }
+};
+
+static string formatBytes(uint64_t bytes) {
+  static const char *const units[] = {"B", "K", "M", "G", "T", "P"};
+  double value = (double)bytes;
+  int unit = 0;
+  while (value >= 1024 && unit < 5) {
+    value /= 1024;
+    unit++;
+  }
+  char buffer[32];
+  if (unit == 0)
+    snprintf(buffer, sizeof(buffer), "%uB", (unsigned)bytes);
+  else
+    snprintf(buffer, sizeof(buffer), value < 10 ? "%.1f%s" : "%.0f%s", value,
+             units[unit]);
+  return buffer;
+}
+
+// Reads sizes like 4096, 64K, 1.5M or 2G
+static bool parseBytes(const string &text, uint64_t &bytes) {
+  char *unit;
+  double value = strtod(text.c_str(), &unit);
+  if (unit == text.c_str() || value < 0)
+    return false;
+  string suffix = unit;
+  if (suffix.size() > 1 && (suffix[1] == 'b' || suffix[1] == 'B'))
+    suffix.erase(1);
+  int shift = suffix.empty() || suffix == "b" || suffix == "B" ? 0
+              : suffix == "k" || suffix == "K"                 ? 10
+              : suffix == "m" || suffix == "M"                 ? 20
+              : suffix == "g" || suffix == "G"                 ? 30
+                                                               : -1;
+  if (shift < 0)
+    return false;
+  bytes = (uint64_t)(value * (double)(1ULL << shift));
+  return true;
+}
+
+#ifndef _WIN32
+// Puts the terminal into non-canonical, no-echo mode for the lifetime of the
+// object so full-screen builtins can react to single key presses. Ctrl-C
+// arrives as a key (3) instead of killing the shell.
+class RawTerminal {
+public:
+  RawTerminal() : active(false) {
+    if (isatty(0) && tcgetattr(0, &saved) == 0) {
+      struct termios raw = saved;
+      raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+      raw.c_cc[VMIN] = 0;
+      raw.c_cc[VTIME] = 0;
+      active = tcsetattr(0, TCSANOW, &raw) == 0;
+    }
+  }
+
+  ~RawTerminal() {
+    if (active)
+      tcsetattr(0, TCSANOW, &saved);
+  }
+
+  bool ok() const { return active; }
+
+  // Waits up to timeout_ms for a key press. Returns the key, or -1.
+  int readKey(int timeout_ms) {
+    struct pollfd pfd;
+    pfd.fd = 0;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+      return -1;
+    char c;
+    return read(0, &c, 1) == 1 ? (unsigned char)c : -1;
+  }
+
+  static int rows() {
+    struct winsize ws;
+    return ioctl(1, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 ? ws.ws_row : 24;
+  }
+
+  static int columns() {
+    struct winsize ws;
+    return ioctl(1, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+  }
+
+  // Rewrites only the screen lines that differ from the last frame, then
+  // keeps lines as the new last frame
+  static void redraw(vector<string> &lines, vector<string> &previous) {
+    string frame;
+    for (size_t i = 0; i < lines.size(); i++) {
+      if (i < previous.size() && previous[i] == lines[i])
+        continue;
+      frame += "\033[" + to_string(i + 1) + ";1H" + lines[i] + "\033[K";
+    }
+    if (lines.size() < previous.size())
+      frame += "\033[" + to_string(lines.size() + 1) + ";1H\033[J";
+    cout << frame << flush;
+    previous.swap(lines);
+  }
+
+private:
+  bool active;
+  struct termios saved;
+};
+#endif
+
+// Session logs are "NSR1" followed by records: a tag byte, a varint count of
+// microseconds since the previous record, then the tag's varint fields.
+// Strings are stored as a varint length and the raw bytes.
+enum SessionTag { SESSION_INPUT = 1, SESSION_CWD = 2, SESSION_RESULT = 3 };
+
+static const char SESSION_MAGIC[4] = {'N', 'S', 'R', '1'};
+
+struct SessionEntry {
+  int tag;
+  uint64_t at_us;
+  string text;
+  uint64_t output_bytes;
+  uint64_t duration_us;
+  uint64_t status;
+};
+
+class SessionRecorder {
+public:
+  SessionRecorder() : recording(false), last_us(0) {}
+  ~SessionRecorder() { stop(); }
+
+  bool active() const { return recording; }
+  const string &path() const { return file_path; }
+
+  bool start(const string &path) {
+    stop();
+    out.open(path.c_str(), ios::binary | ios::trunc);
+    if (!out.is_open())
+      return false;
+    out.write(SESSION_MAGIC, sizeof(SESSION_MAGIC));
+    file_path = path;
+    epoch = chrono::steady_clock::now();
+    last_us = 0;
+    last_cwd.clear();
+    recording = true;
+    return true;
+  }
+
+  void stop() {
+    if (!recording)
+      return;
+    recording = false;
+    out.close();
+  }
+
+  void input(const string &line) {
+    begin(SESSION_INPUT);
+    putVarint(record, line.size());
+    record += line;
+    commit(false);
+  }
+
+  // Only written when the directory actually changed
+  void cwd(const string &path) {
+    if (path == last_cwd)
+      return;
+    last_cwd = path;
+    begin(SESSION_CWD);
+    putVarint(record, path.size());
+    record += path;
+    commit(false);
+  }
+
+  void result(uint64_t output_bytes, uint64_t duration_ns, int status) {
+    begin(SESSION_RESULT);
+    putVarint(record, output_bytes);
+    putVarint(record, duration_ns / 1000);
+    putVarint(record, (uint64_t)(status < 0 ? 0 : status));
+    commit(true);
+  }
+
+private:
+  bool recording;
+  ofstream out;
+  string file_path;
+  string record;
+  string last_cwd;
+  chrono::steady_clock::time_point epoch;
+  uint64_t last_us;
+
+  void begin(SessionTag tag) {
+    uint64_t now_us =
+        elapsedNanos(epoch, chrono::steady_clock::now()) / 1000;
+    record.clear();
+    record += (char)tag;
+    putVarint(record, now_us - last_us);
+    last_us = now_us;
+  }
+
+  void commit(bool flush) {
+    out.write(record.data(), record.size());
+    if (flush)
+      out.flush();
+  }
+};
+
+static bool loadSessionLog(const string &path, vector<SessionEntry> &entries) {
+  ifstream file(path.c_str(), ios::binary);
+  if (!file.is_open())
+    return false;
+  stringstream ss;
+  ss << file.rdbuf();
+  string data = ss.str();
+  if (data.size() < sizeof(SESSION_MAGIC) ||
+      memcmp(data.data(), SESSION_MAGIC, sizeof(SESSION_MAGIC)) != 0)
+    return false;
+
+  const char *pos = data.data() + sizeof(SESSION_MAGIC);
+  const char *end = data.data() + data.size();
+  uint64_t at_us = 0;
+  while (pos < end) {
+    SessionEntry entry;
+    entry.tag = (uint8_t)*pos++;
+    entry.output_bytes = entry.duration_us = entry.status = 0;
+    uint64_t delta, length;
+    if (!getVarint(pos, end, delta))
+      break;
+    at_us += delta;
+    entry.at_us = at_us;
+    if (entry.tag == SESSION_INPUT || entry.tag == SESSION_CWD) {
+      if (!getVarint(pos, end, length) || length > (uint64_t)(end - pos))
+        break;
+      entry.text.assign(pos, (size_t)length);
+      pos += length;
+    } else if (entry.tag == SESSION_RESULT) {
+      if (!getVarint(pos, end, entry.output_bytes) ||
+          !getVarint(pos, end, entry.duration_us) ||
+          !getVarint(pos, end, entry.status))
+        break;
+    } else {
+      break;
+    }
+    entries.push_back(entry);
+  }
+  return true;
+}
+
+// One replayed command: what the log says happened and what happened now
+struct ReplayCommand {
+  string input;
+  bool recorded_result;
+  uint64_t recorded_bytes;
+  uint64_t recorded_us;
+  uint64_t recorded_status;
+  string recorded_cwd;
+  uint64_t at_us;
+  bool replayed_result;
+  uint64_t replayed_bytes;
+  uint64_t replayed_us;
+  uint64_t replayed_status;
+  string replayed_cwd;
+};
+
+#ifdef __linux__
+// Daemon protocol: a client connects to the Unix socket and sends its cwd
+// (NUL-terminated) with its stdin, stdout and stderr attached as
+// SCM_RIGHTS. It may then send 'I' to forward a Ctrl-C and 'W' when its
+// window is resized, and receives the session's exit code as a 4-byte int
+// when the session ends.
+static const char DAEMON_INTERRUPT = 'I';
+static const char DAEMON_RESIZE = 'W';
+
+static bool socketAddress(const string &path, struct sockaddr_un &addr) {
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+    return false;
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  return true;
+}
+
+static int connectDaemon(const string &path) {
+  struct sockaddr_un addr;
+  if (!socketAddress(path, addr))
+    return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Receives the client's hello: the cwd and three fds. Returns false on a
+// malformed or short message, or with errno set to EAGAIN when it has not
+// arrived yet.
+static bool receiveHello(int conn, string &cwd, int fds[3]) {
+  char buffer[4096];
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  struct iovec iov = {buffer, sizeof(buffer) - 1};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+    errno = EAGAIN;
+    return false;
+  }
+  if (n <= 0) {
+    errno = ECONNRESET;
+    return false;
+  }
+  buffer[n] = '\0';
+  cwd = buffer;
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+    if (cmsg && cmsg->cmsg_type == SCM_RIGHTS) {
+      int *passed = (int *)CMSG_DATA(cmsg);
+      size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (size_t i = 0; i < count; i++)
+        close(passed[i]);
+    }
+    errno = EBADMSG;
+    return false;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+  return true;
+}
+
+static volatile sig_atomic_t relay_resized = 0, relay_hangup = 0;
+
+static void noteRelaySignal(int sig) {
+  if (sig == SIGWINCH)
+    relay_resized = 1;
+  else
+    relay_hangup = 1;
+}
+
+// Gives a daemon session a terminal it controls, so programs that open
+// /dev/tty (ssh and sudo password prompts) work. The client's terminal is
+// normally already the controlling terminal of the client's own session,
+// so the session gets a new pty instead. Forks: the child returns, as the
+// session, on the pty. This process stays behind to relay between the pty
+// and the client's terminal, which it puts in raw mode, and exits with
+// the session's status. Returns unchanged if no pty is to be had.
+static void startSessionTerminal() {
+  struct termios modes;
+  struct winsize size;
+  if (tcgetattr(STDIN_FILENO, &modes) != 0 ||
+      ioctl(STDIN_FILENO, TIOCGWINSZ, &size) != 0)
+    return;
+  int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  const char *name = NULL;
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0 ||
+      !(name = ptsname(master))) {
+    if (master >= 0)
+      close(master);
+    return;
+  }
+  string slave_name = name;
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(master);
+    return;
+  }
+  if (pid == 0) {
+    close(master);
+    setsid();
+    int slave = open(slave_name.c_str(), O_RDWR);
+    if (slave < 0)
+      _exit(1);
+    ioctl(slave, TIOCSCTTY, 0);
+    tcsetattr(slave, TCSANOW, &modes);
+    ioctl(slave, TIOCSWINSZ, &size);
+    for (int i = 0; i < 3; i++)
+      dup2(slave, i);
+    if (slave > 2)
+      close(slave);
+    return;
+  }
+
+  // Ctrl-C reaches the session as a byte through the pty, so the
+  // forwarded SIGINT is not needed here
+  struct sigaction note;
+  memset(&note, 0, sizeof(note));
+  note.sa_handler = noteRelaySignal;
+  sigemptyset(&note.sa_mask);
+  sigaction(SIGWINCH, &note, NULL);
+  sigaction(SIGHUP, &note, NULL);
+  signal(SIGINT, SIG_IGN);
+  signal(SIGQUIT, SIG_IGN);
+  struct termios raw = modes;
+  cfmakeraw(&raw);
+  tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+  struct pollfd fds[2];
+  fds[0].fd = STDIN_FILENO;
+  fds[1].fd = master;
+  fds[0].events = fds[1].events = POLLIN;
+  char buffer[4096];
+  while (!relay_hangup) {
+    if (relay_resized) {
+      relay_resized = 0;
+      if (ioctl(STDIN_FILENO, TIOCGWINSZ, &size) == 0)
+        ioctl(master, TIOCSWINSZ, &size);
+    }
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+      if (n > 0)
+        writeAll(master, buffer, n);
+      else if (n == 0 || errno != EINTR)
+        fds[0].fd = -1;
+    }
+    if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+      // EIO once the session and everything it started are gone
+      ssize_t n = read(master, buffer, sizeof(buffer));
+      if (n > 0)
+        writeAll(STDOUT_FILENO, buffer, n);
+      else if (n == 0 || errno != EINTR)
+        break;
+    }
+  }
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &modes);
+  // Hangs up the session if it is still running
+  close(master);
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+  }
+  _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+}
+
+// The client side is only reached from main()
+#ifndef NEOSHELL_NO_MAIN
+static string defaultDaemonSocket() {
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  if (runtime && *runtime)
+    return string(runtime) + "/neoshell.sock";
+  return "/tmp/neoshell-" + to_string(getuid()) + ".sock";
+}
+
+static volatile sig_atomic_t client_socket = -1;
+
+static void forwardSignal(int sig) {
+  char byte = sig == SIGWINCH ? DAEMON_RESIZE : DAEMON_INTERRUPT;
+  if (client_socket >= 0 && write(client_socket, &byte, 1) < 0) {
+  }
+}
+
+// neoshell --client: hands this terminal to a session in the daemon and
+// waits for it to finish. Deliberately does no more than that, so it
+// starts in well under a millisecond.
+static int runDaemonClient(const string &path) {
+  int fd = connectDaemon(path);
+  if (fd < 0) {
+    cerr << "Error: No NeoShell daemon listening on " << path << endl;
+    return 1;
+  }
+
+  vector<char> cwd(256);
+  while (!getcwd(&cwd[0], cwd.size()) && errno == ERANGE)
+    cwd.resize(cwd.size() * 2);
+  if (!getcwd(&cwd[0], cwd.size()))
+    cwd[0] = '\0';
+  int fds[3] = {0, 1, 2};
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = {&cwd[0], strlen(&cwd[0]) + 1};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  if (sendmsg(fd, &msg, 0) < 0) {
+    cerr << "Error: Cannot start a session: " << strerror(errno) << endl;
+    return 1;
+  }
+
+  // The terminal sends Ctrl-C and resizes to us, not to the session
+  client_socket = fd;
+  struct sigaction forward;
+  memset(&forward, 0, sizeof(forward));
+  forward.sa_handler = forwardSignal;
+  sigemptyset(&forward.sa_mask);
+  sigaction(SIGINT, &forward, NULL);
+  sigaction(SIGWINCH, &forward, NULL);
+  signal(SIGQUIT, SIG_IGN);
+
+  int32_t code = 1;
+  size_t got = 0;
+  while (got < sizeof(code)) {
+    ssize_t n = read(fd, (char *)&code + got, sizeof(code) - got);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      cerr << "Error: Lost connection to the NeoShell daemon" << endl;
+      return 1;
+    }
+    got += n;
+  }
+  return code;
+}
+#endif
+
+struct DaemonSession {
+  int conn;
+  int state_fd;
+  pid_t pid;
+  string state;
+};
+
+// What onchange watches: a directory tree, optionally narrowed by a glob
+// or to one file
+struct WatchSpec {
+  string root;
+  string pattern;
+  bool recursive;
+};
+
+// Recursive inotify watches, one per directory (never per file), so memory
+// grows with the number of directories rather than files. Version control
+// metadata is skipped since it churns on every git command.
+class TreeWatcher {
+public:
+  TreeWatcher() : fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)), full(false) {}
+  ~TreeWatcher() {
+    if (fd >= 0)
+      close(fd);
+  }
+
+  int descriptor() const { return fd; }
+  size_t watched() const { return dirs.size(); }
+  bool hitLimit() const { return full; }
+
+  void add(const WatchSpec &spec) {
+    specs.push_back(spec);
+    addTree(spec.root, spec.recursive);
+  }
+
+  // Drains pending events, adding watches for new directories. Matching
+  // paths are collected in changed (at most max_paths of them). Returns the
+  // number of matching events.
+  size_t readEvents(set<string> &changed, size_t max_paths) {
+    alignas(struct inotify_event) char buffer[65536];
+    size_t count = 0;
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+      for (char *p = buffer; p < buffer + n;) {
+        struct inotify_event *event = (struct inotify_event *)p;
+        p += sizeof(struct inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW) {
+          count++;
+          continue;
+        }
+        auto it = dirs.find(event->wd);
+        if (it == dirs.end())
+          continue;
+        if (event->mask & IN_IGNORED) {
+          dirs.erase(it);
+          continue;
+        }
+        string path = it->second;
+        if (event->len > 0)
+          path += "/" + string(event->name);
+        if ((event->mask & IN_ISDIR) &&
+            (event->mask & (IN_CREATE | IN_MOVED_TO)) &&
+            recursiveUnder(it->second)) {
+          addTree(path, true);
+        }
+        if (!matches(path))
+          continue;
+        count++;
+        if (changed.size() < max_paths)
+          changed.insert(path);
+      }
+    }
+    return count;
+  }
+
+private:
+  int fd;
+  bool full;
+  unordered_map<int, string> dirs;
+  vector<WatchSpec> specs;
+
+  static bool skipped(const char *name) {
+    return !strcmp(name, ".git") || !strcmp(name, ".hg") ||
+           !strcmp(name, ".svn");
+  }
+
+  void addTree(const string &root, bool recursive) {
+    // Iterative so deep trees cannot overflow the stack
+    vector<string> pending(1, root);
+    while (!pending.empty() && !full) {
+      string dir = pending.back();
+      pending.pop_back();
+      int wd = inotify_add_watch(fd, dir.c_str(),
+                                 IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                                     IN_MOVED_FROM | IN_MOVED_TO |
+                                     IN_ONLYDIR | IN_DONT_FOLLOW);
+      if (wd < 0) {
+        if (errno == ENOSPC)
+          full = true;
+        continue;
+      }
+      dirs[wd] = dir;
+      if (!recursive)
+        continue;
+      DIR *handle = opendir(dir.c_str());
+      if (!handle)
+        continue;
+      struct dirent *entry;
+      while ((entry = readdir(handle))) {
+        const char *name = entry->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, "..") || skipped(name))
+          continue;
+        string child = dir == "/" ? "/" + string(name) : dir + "/" + name;
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+          struct stat st;
+          is_dir = lstat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (is_dir)
+          pending.push_back(child);
+      }
+      closedir(handle);
+    }
+  }
+
+  // Whether path is root itself or inside it: "src" covers "src/a" but
+  // not "src2/a"
+  static bool isUnder(const string &path, const string &root) {
+    if (path.compare(0, root.size(), root) != 0)
+      return false;
+    return path.size() == root.size() || root[root.size() - 1] == '/' ||
+           path[root.size()] == '/';
+  }
+
+  bool recursiveUnder(const string &dir) const {
+    for (const WatchSpec &spec : specs) {
+      if (spec.recursive && isUnder(dir, spec.root))
+        return true;
+    }
+    return false;
+  }
+
+  bool matches(const string &path) const {
+    for (const WatchSpec &spec : specs) {
+      if (!isUnder(path, spec.root))
+        continue;
+      if (spec.pattern.empty() ||
+          fnmatch(spec.pattern.c_str(), path.c_str(), 0) == 0)
+        return true;
+    }
+    return false;
+  }
+};
+#endif
+
+class NeoShell {
+  friend class NeoShellBench;
+
+private:
+  string username;
+  string current_theme;
+  vector<string> history;
+  map<string, string> aliases;
+  map<string, string> env_vars;
+  map<string, string> bookmarks;
+  map<string, string> command_map;
+  vector<string> todo_list;
+  bool show_timestamps;
+  bool smart_suggest;
+  int command_count;
+  time_t session_start;
+
+  // Per-stage timing of the command currently going around the loop
+  static const size_t MAX_TIMED_COMMANDS = 256;
+  uint64_t stage_ns[STAGE_COUNT];
+  chrono::steady_clock::time_point stage_mark;
+  LatencyHistogram stage_totals[STAGE_COUNT];
+  map<string, CommandTimings> command_timings;
+  chrono::steady_clock::time_point command_start;
+  TraceRecorder tracer;
+  int last_status;
+
+  // Session recording and replay
+  TeeStreambuf output_tee;
+  ByteCounter output_counter;
+  OutputCapture output_capture;
+  SessionRecorder recorder;
+  vector<ReplayCommand> replay_commands;
+  size_t replay_next;
+  bool replaying;
+  bool replay_timed;
+  chrono::steady_clock::time_point replay_start;
+
+  FrecencyDb visited_dirs;
+#ifndef _WIN32
+  GlobExpander globber;
+  FileHasher::Cache hash_cache;
+  bool hash_cache_loaded;
+#endif
+
+  // Prompt drawing; the cwd is cached between directory changes
+  static const int PROMPT_VCS_BUDGET_MS = 15;
+  static const uint64_t PROMPT_DURATION_THRESHOLD_NS = 2000000000ULL;
+  vector<PromptSegment> prompt_segments;
+  string cwd_cache;
+  bool cwd_valid;
+  bool prompt_vcs;
+  uint64_t last_command_ns;
+  VcsStatusWorker vcs_status;
+
+#ifdef __linux__
+  ProcessTable process_table;
+  chrono::steady_clock::time_point last_process_refresh;
+  map<unsigned, string> user_names;
+  SystemMetrics system_metrics;
+  DiskUsageScanner::Cache usage_cache;
+  bool usage_cache_loaded;
+
+  // Set in a session forked by the daemon: where to send our state back
+  int session_state_fd;
+  size_t session_history_base;
+#endif
+
+  void initializeCommandMap() {
+    // File and Directory Operations
+    command_map["list"] = "ls";
+    command_map["show"] = "ls";
+    command_map["files"] = "ls";
+
+    command_map["where"] = "pwd";
+    command_map["whereami"] = "pwd";
+    command_map["location"] = "pwd";
+    command_map["current"] = "pwd";
+
+    command_map["goto"] = "cd";
+    command_map["go"] = "cd";
+    command_map["navigate"] = "cd";
+    command_map["moveto"] = "cd";
+
+    command_map["makedir"] = "mkdir";
+    command_map["createdir"] = "mkdir";
+    command_map["newfolder"] = "mkdir";
+
+    command_map["remove"] = "rm";
+    command_map["delete"] = "rm";
+    command_map["erase"] = "rm";
+
+    command_map["duplicate"] = "cp";
+
+    command_map["move"] = "mv";
+    command_map["rename"] = "mv";
+
+    command_map["read"] = "cat";
+    command_map["view"] = "cat";
+    command_map["display"] = "cat";
+
+    command_map["find"] = "find";
+    command_map["search"] = "find";
+    command_map["locate"] = "find";
+
+    command_map["edit"] = "nano";
+    command_map["modify"] = "nano";
+
+    // Text Operations
+    command_map["print"] = "echo";
+    command_map["say"] = "echo";
+    command_map["write"] = "echo";
+
+    command_map["count"] = "wc";
+    command_map["lines"] = "wc";
+    command_map["words"] = "wc";
+
+    command_map["filter"] = "grep";
+    command_map["match"] = "grep";
+
+    command_map["order"] = "sort";
+    command_map["arrange"] = "sort";
+
+    command_map["distinct"] = "uniq";
+
+    command_map["first"] = "head";
+    command_map["top"] = "head";
+
+    command_map["last"] = "tail";
+    command_map["bottom"] = "tail";
+
+    // System Operations
+    command_map["who"] = "whoami";
+    command_map["user"] = "whoami";
+    command_map["me"] = "whoami";
+
+    command_map["when"] = "date";
+    command_map["time"] = "date";
+    command_map["now"] = "date";
+
+    command_map["running"] = "ps";
+    command_map["processes"] = "ps";
+    command_map["tasks"] = "ps";
+
+    command_map["stop"] = "kill";
+    command_map["terminate"] = "kill";
+
+    command_map["diskspace"] = "df";
+    command_map["space"] = "df";
+    command_map["storage"] = "df";
+
+    command_map["memory"] = "free";
+    command_map["ram"] = "free";
+
+    command_map["system"] = "uname";
+
+    // Utilities
+    command_map["clean"] = "clear";
+    command_map["cls"] = "clear";
+
+    command_map["commands"] = "help";
+  }
+
+  void getUsername() {
+#ifdef _WIN32
+    char buffer[UNLEN + 1];
+    DWORD size = UNLEN + 1;
+    username = GetUserNameA(buffer, &size) ? string(buffer) : "user";
+#else
+    struct passwd *pw = getpwuid(getuid());
+    username = pw ? string(pw->pw_name) : "user";
+#endif
+    transform(username.begin(), username.end(), username.begin(), ::tolower);
+  }
+
+  string getCurrentTime() {
+    time_t now = time(0);
+    char buffer[16];
+    strftime(buffer, sizeof(buffer), "%H:%M:%S", localtime(&now));
+    return buffer;
+  }
+
+  // Only a directory change can move us, so the path is looked up once
+  // after each one
+  const string &getCurrentPath() {
+    if (cwd_valid)
+      return cwd_cache;
+#ifdef _WIN32
+    DWORD size = GetCurrentDirectoryA(0, 0);
+    vector<char> buffer(size + 1);
+    cwd_cache = GetCurrentDirectoryA((DWORD)buffer.size(), &buffer[0])
+                    ? string(&buffer[0])
+                    : "";
+#else
+    vector<char> buffer(256);
+    while (!getcwd(&buffer[0], buffer.size()) && errno == ERANGE)
+      buffer.resize(buffer.size() * 2);
+    cwd_cache = getcwd(&buffer[0], buffer.size()) ? string(&buffer[0]) : "";
+#endif
+    cwd_valid = true;
+    return cwd_cache;
+  }
+
+  vector<string> split(const string &str, char delimiter) {
+    vector<string> tokens;
+    stringstream ss(str);
+    string token;
+    while (getline(ss, token, delimiter)) {
+      token.erase(0, token.find_first_not_of(" \t\r\n"));
+      token.erase(token.find_last_not_of(" \t\r\n") + 1);
+      if (!token.empty())
+        tokens.push_back(token);
+    }
+    return tokens;
+  }
+
+  int levenshteinDistance(const string &s1, const string &s2) {
+    int m = s1.length(), n = s2.length();
+    vector<vector<int>> dp(m + 1, vector<int>(n + 1));
+
+    for (int i = 0; i <= m; i++)
+      dp[i][0] = i;
+    for (int j = 0; j <= n; j++)
+      dp[0][j] = j;
+
+    for (int i = 1; i <= m; i++) {
+      for (int j = 1; j <= n; j++) {
+        if (s1[i - 1] == s2[j - 1]) {
+          dp[i][j] = dp[i - 1][j - 1];
+        } else {
+          dp[i][j] = 1 + min({dp[i - 1][j], dp[i][j - 1], dp[i - 1][j - 1]});
+        }
+      }
+    }
+    return dp[m][n];
+  }
+
+  vector<string> findSimilarCommands(const string &cmd) {
+    vector<pair<int, string>> scored;
+
+    for (const auto &pair : command_map) {
+      int dist = levenshteinDistance(cmd, pair.first);
+      if (dist <= 2) {
+        scored.push_back({dist, pair.first});
+      }
+    }
+
+    for (const auto &pair : aliases) {
+      int dist = levenshteinDistance(cmd, pair.first);
+      if (dist <= 2) {
+        scored.push_back({dist, pair.first});
+      }
+    }
+
+    sort(scored.begin(), scored.end());
+
+    vector<string> suggestions;
+    for (const auto &p : scored) {
+      suggestions.push_back(p.second);
+    }
+    return suggestions;
+  }
+
+  string translateCommand(const string &human_cmd) {
+    string lower_cmd = human_cmd;
+    transform(lower_cmd.begin(), lower_cmd.end(), lower_cmd.begin(), ::tolower);
+
+    if (command_map.find(lower_cmd) != command_map.end()) {
+      return command_map[lower_cmd];
+    }
+
+    return human_cmd;
+  }
+
+  string expandVariables(const string &input) {
+    string result = input;
+    size_t pos = 0;
+    while ((pos = result.find('$', pos)) != string::npos) {
+      size_t end = pos + 1;
+      while (end < result.length() &&
+             (isalnum(result[end]) || result[end] == '_')) {
+        end++;
+      }
+      string var_name = result.substr(pos + 1, end - pos - 1);
+      if (env_vars.find(var_name) != env_vars.end()) {
+        result.replace(pos, end - pos, env_vars[var_name]);
+      }
+      pos = end;
+    }
+    return result;
+  }
+
+  void beginStages() {
+    memset(stage_ns, 0, sizeof(stage_ns));
+    stage_mark = chrono::steady_clock::now();
+  }
+
+  // Charge the time since the previous mark to the given stage
+  void markStage(Stage stage) {
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    stage_ns[stage] += elapsedNanos(stage_mark, now);
+    tracer.span("stage", STAGE_NAMES[stage], stage_mark, now);
+    stage_mark = now;
+  }
+
+  void recordTimings(const string &name) {
+    auto it = command_timings.find(name);
+    if (it == command_timings.end()) {
+      string key = command_timings.size() < MAX_TIMED_COMMANDS ? name
+                                                               : "(other)";
+      it = command_timings.insert(make_pair(key, CommandTimings())).first;
+    }
+
+    uint64_t total = 0;
+    for (int i = 0; i < STAGE_COUNT; i++) {
+      stage_totals[i].record(stage_ns[i]);
+      it->second.stages[i].record(stage_ns[i]);
+      if (i != STAGE_READ)
+        total += stage_ns[i];
+    }
+    it->second.total.record(total);
+  }
+
+  // Run a command through the system shell like system() does, but with the
+  // spawn and the wait for the child timed as separate stages
+  int runExternal(const string &command) {
+#ifdef _WIN32
+    int status = system(command.c_str());
+    markStage(STAGE_EXEC);
+    last_status = status;
+    return status;
+#else
+    struct sigaction ignore, saved_int, saved_quit;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGINT, &ignore, &saved_int);
+    sigaction(SIGQUIT, &ignore, &saved_quit);
+
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    // While something is listening to our output, route the child's stdout
+    // and stderr through pipes so it can be seen too
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    int out_pipe[2] = {-1, -1}, err_pipe[2] = {-1, -1};
+    bool tap = output_tee.hasSinks() && !isInteractiveCommand(command) &&
+               !startsBackgroundJob(command) &&
+               (makeOutputPty(out_pipe) || makePipe(out_pipe)) &&
+               makePipe(err_pipe);
+    if (tap) {
+      posix_spawn_file_actions_adddup2(&actions, out_pipe[1], 1);
+      posix_spawn_file_actions_adddup2(&actions, err_pipe[1], 2);
+    } else {
+      // The output side may have opened before the error pipe failed
+      for (int i = 0; i < 2; i++) {
+        if (out_pipe[i] >= 0)
+          close(out_pipe[i]);
+        if (err_pipe[i] >= 0)
+          close(err_pipe[i]);
+        out_pipe[i] = err_pipe[i] = -1;
+      }
+    }
+    cout.flush();
+
+    const char *argv[] = {"sh", "-c", command.c_str(), NULL};
+    pid_t pid;
+    int status = -1;
+    chrono::steady_clock::time_point spawned = chrono::steady_clock::now();
+    int err = posix_spawn(&pid, "/bin/sh", &actions, &attr,
+                          (char *const *)argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    markStage(STAGE_EXEC);
+
+    for (int i = 0; i < 2; i++) {
+      if (out_pipe[i] >= 0 && (i == 1 || err != 0))
+        close(out_pipe[i]);
+      if (err_pipe[i] >= 0 && (i == 1 || err != 0))
+        close(err_pipe[i]);
+    }
+
+    if (err == 0) {
+      bool reaped = tap && pumpChildOutput(pid, out_pipe[0], err_pipe[0],
+                                           status);
+      while (!reaped && waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+      }
+      int code = WIFEXITED(status) ? WEXITSTATUS(status)
+                                   : 128 + WTERMSIG(status);
+      last_status = code;
+      if (tracer.active()) {
+        tracer.span("process", command.c_str(), spawned,
+                    chrono::steady_clock::now(), (int)pid, code);
+      }
+    } else {
+      last_status = 127;
+    }
+    markStage(STAGE_WAIT);
+
+    sigaction(SIGINT, &saved_int, NULL);
+    sigaction(SIGQUIT, &saved_quit, NULL);
+    return status;
+#endif
+  }
+
+#ifndef _WIN32
+  // Programs that need the terminal itself, so their output is never piped
+  bool isInteractiveCommand(const string &command) {
+    static const char *const interactive[] = {
+        "nano", "vi",  "vim",  "nvim", "emacs", "less", "more", "man",
+        "top",  "htop", "ssh", "tmux", "screen", "watch", "sh",  "bash",
+        "zsh",  "python", "python3"};
+    string first = command.substr(0, command.find(' '));
+    first = first.substr(first.find_last_of('/') + 1);
+    for (size_t i = 0; i < sizeof(interactive) / sizeof(interactive[0]); i++) {
+      if (first == interactive[i])
+        return true;
+    }
+    return false;
+  }
+
+  // True if the command line puts something in the background with a lone
+  // '&'. Its output would keep the pipes open long after the command itself
+  // is done, so such commands are not tapped.
+  bool startsBackgroundJob(const string &command) {
+    char quote = 0;
+    for (size_t i = 0; i < command.size(); i++) {
+      char c = command[i];
+      if (quote) {
+        if (c == quote)
+          quote = 0;
+        else if (c == '\\' && quote == '"')
+          i++;
+      } else if (c == '\'' || c == '"') {
+        quote = c;
+      } else if (c == '\\') {
+        i++;
+      } else if (c == '&') {
+        // && and redirections like 2>&1, &> and >&2
+        if (i + 1 < command.size() &&
+            (command[i + 1] == '&' || command[i + 1] == '>')) {
+          i++;
+          continue;
+        }
+        if (i > 0 && (command[i - 1] == '>' || command[i - 1] == '<'))
+          continue;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Copies a child's stdout and stderr pipes through to our own, handing
+  // every chunk to the output tee. Stops once the child has exited and what
+  // it left in the pipes is read, even if something it started still holds
+  // them open. Closes both fds; returns true if the child was reaped into
+  // status.
+  bool pumpChildOutput(pid_t pid, int out_fd, int err_fd, int &status) {
+    struct pollfd fds[2];
+    fds[0].fd = out_fd;
+    fds[1].fd = err_fd;
+    fds[0].events = fds[1].events = POLLIN;
+    int open_fds = 2;
+    bool reaped = false;
+    int drain_passes = 16;
+    unsigned passes = 0;
+    char buffer[65536];
+    while (open_fds > 0) {
+      // Checked now and then rather than on every chunk, which would add a
+      // syscall per read to large outputs
+      if (!reaped && passes++ % 64 == 0 &&
+          waitpid(pid, &status, WNOHANG) == pid) {
+        reaped = true;
+        for (int i = 0; i < 2; i++) {
+          if (fds[i].fd >= 0)
+            fcntl(fds[i].fd, F_SETFL, fcntl(fds[i].fd, F_GETFL) | O_NONBLOCK);
+        }
+      }
+      int ready = poll(fds, 2, reaped ? 0 : 100);
+      if (ready < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      if (ready == 0 || (reaped && --drain_passes == 0)) {
+        if (reaped)
+          break;
+        passes = 0;
+        continue;
+      }
+      for (int i = 0; i < 2; i++) {
+        if (fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+          continue;
+        ssize_t n = read(fds[i].fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n <= 0) {
+          close(fds[i].fd);
+          fds[i].fd = -1;
+          open_fds--;
+          continue;
+        }
+        writeAll(i == 0 ? 1 : 2, buffer, n);
+        output_tee.feed(buffer, n);
+      }
+    }
+    for (int i = 0; i < 2; i++) {
+      if (fds[i].fd >= 0)
+        close(fds[i].fd);
+    }
+    return reaped;
+  }
+
+  // Starts one job with stdout and stderr sharing a pipe and stdin on
+  // /dev/null, so jobs never fight over the terminal
+  bool spawnJob(ParallelJob &job) {
+    int fds[2];
+    if (!makePipe(fds))
+      return false;
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 2);
+
+    const char *argv[] = {"sh", "-c", job.command.c_str(), NULL};
+    job.started = chrono::steady_clock::now();
+    int err = posix_spawn(&job.pid, "/bin/sh", &actions, &attr,
+                          (char *const *)argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(fds[1]);
+    if (err != 0) {
+      close(fds[0]);
+      return false;
+    }
+    job.fd = fds[0];
+    job.output.clear();
+    job.attempts++;
+    return true;
+  }
+
+  // parallel [-j N] [-k] [--retries N] [-a file] <command> [::: inputs...]
+  // Runs the command once per input, N at a time, substituting {} (or
+  // appending the input). Each job's output is collected and printed in one
+  // piece, as jobs finish or, with -k, in input order. Without ::: or -a the
+  // inputs are read from stdin, one per line.
+  void builtinParallel(const vector<string> &args, bool keep_order) {
+    size_t slots = max(1u, thread::hardware_concurrency());
+    int retries = 0;
+    vector<string> inputs, command_words;
+    string input_file;
+    bool have_inputs = false;
+    size_t i = 1;
+    for (; i < args.size(); i++) {
+      if (args[i] == "-j" && i + 1 < args.size()) {
+        slots = max(1, atoi(args[++i].c_str()));
+      } else if (args[i] == "-k") {
+        keep_order = true;
+      } else if (args[i] == "--retries" && i + 1 < args.size()) {
+        retries = max(0, atoi(args[++i].c_str()));
+      } else if (args[i] == "-a" && i + 1 < args.size()) {
+        input_file = args[++i];
+        have_inputs = true;
+      } else {
+        break;
+      }
+    }
+    for (; i < args.size(); i++) {
+      if (args[i] == ":::") {
+        // Inputs are often URLs or other words with ? or [ in them
+        expandPaths(args, i + 1, args.size(), inputs, true);
+        have_inputs = true;
+        break;
+      }
+      command_words.push_back(args[i]);
+    }
+    if (command_words.empty()) {
+      cout << "Usage: " << args[0]
+           << " [-j N] [-k] [--retries N] [-a file] <command> "
+              "[::: inputs...]"
+           << endl;
+      cout << "  {} in the command is replaced by each input" << endl;
+      return;
+    }
+
+    string line;
+    if (!input_file.empty()) {
+      ifstream file(input_file.c_str());
+      if (!file.is_open()) {
+        cout << "Error: Cannot open '" << input_file << "'" << endl;
+        return;
+      }
+      while (getline(file, line)) {
+        if (!line.empty())
+          inputs.push_back(line);
+      }
+    } else if (!have_inputs) {
+      if (isatty(STDIN_FILENO))
+        cout << "Reading inputs, one per line (Ctrl-D to finish)" << endl;
+      while (getline(cin, line)) {
+        if (!line.empty())
+          inputs.push_back(line);
+      }
+      cin.clear();
+    }
+    if (inputs.empty()) {
+      cout << "No inputs to run" << endl;
+      return;
+    }
+
+    string command = command_words[0];
+    for (size_t w = 1; w < command_words.size(); w++)
+      command += " " + command_words[w];
+    bool substitutes = command.find("{}") != string::npos;
+    vector<ParallelJob> queue;
+    for (size_t n = 0; n < inputs.size(); n++) {
+      ParallelJob job;
+      job.index = n;
+      job.command = command;
+      string quoted = shellQuote(inputs[n]);
+      if (substitutes) {
+        size_t pos = 0;
+        while ((pos = job.command.find("{}", pos)) != string::npos) {
+          job.command.replace(pos, 2, quoted);
+          pos += quoted.size();
+        }
+      } else {
+        job.command += " " + quoted;
+      }
+      job.attempts = 0;
+      job.pid = -1;
+      job.fd = -1;
+      job.status = 0;
+      queue.push_back(job);
+    }
+    reverse(queue.begin(), queue.end());
+
+    struct sigaction ignore, saved_int, saved_quit;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGINT, &ignore, &saved_int);
+    sigaction(SIGQUIT, &ignore, &saved_quit);
+    cout.flush();
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<ParallelJob> running;
+    vector<ParallelJob> failed;
+    map<size_t, string> held;
+    size_t next_to_print = 0, done = 0, retried = 0;
+    bool interrupted = false;
+    vector<struct pollfd> fds;
+    char buffer[65536];
+
+    while (!running.empty() || (!queue.empty() && !interrupted)) {
+      while (running.size() < slots && !queue.empty() && !interrupted) {
+        ParallelJob job = queue.back();
+        queue.pop_back();
+        if (spawnJob(job)) {
+          running.push_back(job);
+        } else if (!running.empty()) {
+          // Out of processes or fds for now; try again when a job ends
+          queue.push_back(job);
+          break;
+        } else {
+          job.status = 127;
+          failed.push_back(job);
+          done++;
+          if (keep_order)
+            held[job.index];
+        }
+      }
+      // Only when every spawn failed, which has used up the queue
+      if (running.empty())
+        break;
+
+      fds.resize(running.size());
+      for (size_t r = 0; r < running.size(); r++) {
+        fds[r].fd = running[r].fd;
+        fds[r].events = POLLIN;
+        fds[r].revents = 0;
+      }
+      if (poll(&fds[0], fds.size(), -1) < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+
+      for (size_t r = running.size(); r-- > 0;) {
+        if (!(fds[r].revents & (POLLIN | POLLHUP | POLLERR)))
+          continue;
+        ParallelJob &job = running[r];
+        ssize_t n = read(job.fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n > 0) {
+          job.output.append(buffer, n);
+          continue;
+        }
+
+        close(job.fd);
+        int status = 0;
+        while (waitpid(job.pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        job.status = WIFEXITED(status) ? WEXITSTATUS(status)
+                                       : 128 + WTERMSIG(status);
+        if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+          interrupted = true;
+        if (tracer.active()) {
+          tracer.span("process", job.command.c_str(), job.started,
+                      chrono::steady_clock::now(), (int)job.pid, job.status);
+        }
+
+        ParallelJob finished = job;
+        running.erase(running.begin() + r);
+        if (finished.status != 0 && finished.attempts <= retries &&
+            !interrupted) {
+          retried++;
+          queue.push_back(finished);
+          continue;
+        }
+        done++;
+        if (finished.status != 0)
+          failed.push_back(finished);
+        if (!keep_order) {
+          cout << finished.output << flush;
+          continue;
+        }
+        held[finished.index].swap(finished.output);
+        while (!held.empty() && held.begin()->first == next_to_print) {
+          cout << held.begin()->second << flush;
+          held.erase(held.begin());
+          next_to_print++;
+        }
+      }
+    }
+    // Jobs skipped after an interrupt leave gaps; print what finished
+    for (auto &entry : held)
+      cout << entry.second;
+
+    sigaction(SIGINT, &saved_int, NULL);
+    sigaction(SIGQUIT, &saved_quit, NULL);
+
+    uint64_t elapsed = elapsedNanos(start, chrono::steady_clock::now());
+    cout << "\n" << done << "/" << inputs.size() << " jobs in "
+         << formatDuration(elapsed) << ", " << failed.size() << " failed";
+    if (retried > 0)
+      cout << ", " << retried << " retried";
+    cout << endl;
+    sort(failed.begin(), failed.end(),
+         [](const ParallelJob &a, const ParallelJob &b) {
+           return a.index < b.index;
+         });
+    for (const ParallelJob &job : failed)
+      cout << "  exit " << job.status << ": " << job.command << endl;
+    if (interrupted)
+      cout << "Interrupted; " << inputs.size() - done << " jobs not run" << endl;
+    last_status = failed.empty() && done == inputs.size() ? 0 : 1;
+  }
+
+  // watch [-n secs] <command>: reruns the command every few seconds,
+  // redrawing only the lines of its output that changed
+  void builtinWatch(const vector<string> &args) {
+    double interval = 2.0;
+    size_t first = 1;
+    if (args.size() > 2 && args[1] == "-n") {
+      interval = max(0.1, atof(args[2].c_str()));
+      first = 3;
+    }
+    if (first >= args.size()) {
+      cout << "Usage: watch [-n <seconds>] <command>" << endl;
+      return;
+    }
+    ParallelJob job;
+    job.command = args[first];
+    for (size_t i = first + 1; i < args.size(); i++)
+      job.command += " " + args[i];
+
+    RawTerminal terminal;
+    if (!terminal.ok()) {
+      cout << "Watch mode needs an interactive terminal" << endl;
+      return;
+    }
+
+    vector<string> previous;
+    cout << "\033[?25l\033[2J" << flush;
+    while (true) {
+      chrono::steady_clock::time_point next =
+          chrono::steady_clock::now() +
+          chrono::milliseconds((int64_t)(interval * 1000));
+      job.attempts = 0;
+      int status = 127;
+      string output;
+      if (spawnJob(job)) {
+        char buffer[65536];
+        ssize_t n;
+        while ((n = read(job.fd, buffer, sizeof(buffer))) != 0) {
+          if (n < 0 && errno != EINTR)
+            break;
+          if (n > 0)
+            output.append(buffer, n);
+        }
+        close(job.fd);
+        while (waitpid(job.pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        status = WIFEXITED(status) ? WEXITSTATUS(status)
+                                   : 128 + WTERMSIG(status);
+      }
+
+      int rows = RawTerminal::rows();
+      size_t width = RawTerminal::columns();
+      vector<string> lines;
+      char header[64];
+      snprintf(header, sizeof(header), "Every %.1fs: ", interval);
+      string right = (status ? "exit " + to_string(status) + "  " : "") +
+                     getCurrentTime();
+      string title = header + job.command;
+      if (title.size() + right.size() < width)
+        title += string(width - title.size() - right.size(), ' ') + right;
+      lines.push_back(title.substr(0, width));
+      lines.push_back("");
+
+      string line;
+      for (size_t i = 0; i <= output.size() && (int)lines.size() < rows;
+           i++) {
+        if (i == output.size() || output[i] == '\n') {
+          if (i < output.size() || !line.empty())
+            lines.push_back(line.substr(0, width));
+          line.clear();
+        } else if (output[i] == '\t') {
+          line.append(8 - line.size() % 8, ' ');
+        } else if (output[i] != '\r') {
+          line += output[i];
+        }
+      }
+      RawTerminal::redraw(lines, previous);
+
+      int key = -1;
+      chrono::steady_clock::time_point now;
+      while ((now = chrono::steady_clock::now()) < next) {
+        key = terminal.readKey(
+            (int)(chrono::duration_cast<chrono::milliseconds>(next - now)
+                      .count()) +
+            1);
+        if (key == 'q' || key == 'Q' || key == 3 || key == 27)
+          break;
+      }
+      if (key == 'q' || key == 'Q' || key == 3 || key == 27)
+        break;
+    }
+    cout << "\033[?25h\033[" << RawTerminal::rows() << ";1H" << endl;
+  }
+#endif
+
+#ifdef __linux__
+  const string &userName(unsigned uid) {
+    auto it = user_names.find(uid);
+    if (it != user_names.end())
+      return it->second;
+    struct passwd *pw = getpwuid(uid);
+    return user_names[uid] = pw ? string(pw->pw_name) : to_string(uid);
+  }
+
+  string formatProcess(const ProcInfo &info, size_t width) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), "%7d %-9.9s %c %5.1f %6s %6s %4d ",
+             info.pid, userName(info.uid).c_str(), info.state,
+             info.cpu_percent,
+             formatBytes(info.rss_pages * page_size).c_str(),
+             formatBytes(info.shared_pages * page_size).c_str(),
+             info.threads);
+    string line = string(buffer) + info.cmdline;
+    if (line.size() > width)
+      line.resize(width);
+    return line;
+  }
+
+  // running/processes/tasks [pattern] [--sort cpu|mem] [-n N|all] [--live]
+  void builtinProcesses(const vector<string> &args) {
+    bool by_memory = false, live = false;
+    size_t limit = 30;
+    string pattern;
+    for (size_t i = 1; i < args.size(); i++) {
+      if (args[i] == "--live" || args[i] == "-l") {
+        live = true;
+      } else if (args[i] == "--sort" && i + 1 < args.size()) {
+        string key = args[++i];
+        by_memory = key == "mem" || key == "memory" || key == "rss";
+      } else if (args[i] == "-n" && i + 1 < args.size()) {
+        i++;
+        limit = args[i] == "all" ? SIZE_MAX : (size_t)atoi(args[i].c_str());
+      } else if (args[i] == "all") {
+        limit = SIZE_MAX;
+      } else {
+        pattern = args[i];
+      }
+    }
+
+    if (live) {
+      showProcessesLive(by_memory);
+      return;
+    }
+
+    // CPU usage needs two samples; reuse the previous refresh when recent
+    process_table.refresh(true);
+    if (chrono::steady_clock::now() - last_process_refresh >
+        chrono::seconds(5)) {
+      this_thread::sleep_for(chrono::milliseconds(200));
+      process_table.refresh(true);
+    }
+    last_process_refresh = chrono::steady_clock::now();
+
+    vector<const ProcInfo *> list = pattern.empty()
+                                        ? process_table.sorted(by_memory)
+                                        : process_table.match(pattern);
+    size_t width = isatty(1) ? RawTerminal::columns() : 200;
+    cout << "    PID USER      S  CPU%    RSS    SHR  THR COMMAND" << endl;
+    for (size_t i = 0; i < list.size() && i < limit; i++) {
+      cout << formatProcess(*list[i], width) << endl;
+    }
+    if (list.size() > limit) {
+      cout << "... " << (list.size() - limit) << " more ("
+           << process_table.size() << " processes, use -n all)" << endl;
+    }
+  }
+
+  // Full-screen view refreshed every second; only rows whose text changed
+  // are rewritten
+  void showProcessesLive(bool by_memory) {
+    RawTerminal terminal;
+    if (!terminal.ok()) {
+      cout << "Live mode needs an interactive terminal" << endl;
+      return;
+    }
+
+    vector<string> previous;
+    cout << "\033[?25l\033[2J" << flush;
+    while (true) {
+      process_table.refresh();
+      int rows = RawTerminal::rows();
+      size_t width = RawTerminal::columns();
+      vector<const ProcInfo *> list = process_table.sorted(by_memory);
+
+      vector<string> lines;
+      char header[160];
+      snprintf(header, sizeof(header),
+               "NeoShell processes: %u total, sorted by %s  "
+               "(q quit, c cpu, m memory)",
+               (unsigned)list.size(), by_memory ? "memory" : "cpu");
+      lines.push_back(string(header).substr(0, width));
+      lines.push_back(string("    PID USER      S  CPU%    RSS    SHR  THR "
+                             "COMMAND")
+                          .substr(0, width));
+      for (size_t i = 0; i < list.size() && (int)lines.size() < rows - 1;
+           i++) {
+        lines.push_back(formatProcess(*list[i], width));
+      }
+
+      RawTerminal::redraw(lines, previous);
+
+      int key = terminal.readKey(1000);
+      if (key == 'q' || key == 'Q' || key == 3 || key == 27)
+        break;
+      if (key == 'm' || key == 'c') {
+        bool wanted = key == 'm';
+        if (wanted != by_memory) {
+          by_memory = wanted;
+          previous.clear();
+          cout << "\033[2J";
+        }
+      }
+    }
+    cout << "\033[?25h\033[" << RawTerminal::rows() << ";1H" << endl;
+  }
+
+  // True when stop/terminate was given a name rather than pids
+  bool hasProcessPattern(const vector<string> &args) {
+    for (size_t i = 1; i < args.size(); i++) {
+      if (args[i][0] == '-')
+        continue;
+      if (args[i].find_first_not_of("0123456789") != string::npos)
+        return true;
+    }
+    return false;
+  }
+
+  // stop/terminate <pattern> [-9] [-y]: signals every process whose name or
+  // command line matches, asking first when more than one does
+  void builtinStop(const vector<string> &args) {
+    int signal_number = SIGTERM;
+    bool confirmed = false;
+    string pattern;
+    for (size_t i = 1; i < args.size(); i++) {
+      if (args[i] == "-9" || args[i] == "-KILL")
+        signal_number = SIGKILL;
+      else if (args[i] == "-y")
+        confirmed = true;
+      else
+        pattern = args[i];
+    }
+
+    process_table.refresh(true);
+    vector<const ProcInfo *> found = process_table.match(pattern);
+    found.erase(remove_if(found.begin(), found.end(),
+                          [](const ProcInfo *p) { return p->pid == getpid(); }),
+                found.end());
+    if (found.empty()) {
+      cout << "No running programs match '" << pattern << "'" << endl;
+      return;
+    }
+
+    size_t width = isatty(1) ? RawTerminal::columns() : 200;
+    if (found.size() > 1 && !confirmed) {
+      cout << "Matching programs:" << endl;
+      for (const ProcInfo *info : found)
+        cout << formatProcess(*info, width) << endl;
+      cout << "Stop all " << found.size() << "? [y/N] " << flush;
+      string answer;
+      if (!readInput(answer) || (answer != "y" && answer != "yes")) {
+        cout << "Cancelled" << endl;
+        return;
+      }
+    }
+
+    for (const ProcInfo *info : found) {
+      if (kill(info->pid, signal_number) == 0) {
+        cout << "Stopped " << info->pid << " (" << info->name << ")" << endl;
+      } else {
+        cout << "Error: Cannot stop " << info->pid << " (" << info->name
+             << "): " << strerror(errno) << endl;
+      }
+    }
+  }
+#endif
+
+#ifdef __linux__
+  string osName() {
+    char buffer[4096];
+    if (readProcFile("/etc/os-release", buffer, sizeof(buffer)) > 0) {
+      const char *line = strstr(buffer, "PRETTY_NAME=");
+      if (line) {
+        const char *start = line + 12;
+        if (*start == '"')
+          start++;
+        size_t length = strcspn(start, "\"\n");
+        return string(start, length);
+      }
+    }
+    return "Linux";
+  }
+
+  void builtinMemory() {
+    const MemoryInfo &mem = system_metrics.memory();
+    uint64_t buff_cache = mem.buffers + mem.cached + mem.reclaimable;
+    uint64_t used = mem.total - mem.available;
+    cout << "            total      used      free    shared  buff/cache"
+            " available"
+         << endl;
+    cout << "Mem:   " << setw(10) << formatBytes(mem.total) << setw(10)
+         << formatBytes(used) << setw(10) << formatBytes(mem.free) << setw(10)
+         << formatBytes(mem.shared) << setw(12) << formatBytes(buff_cache)
+         << setw(10) << formatBytes(mem.available) << endl;
+    cout << "Swap:  " << setw(10) << formatBytes(mem.swap_total) << setw(10)
+         << formatBytes(mem.swap_total - mem.swap_free) << setw(10)
+         << formatBytes(mem.swap_free) << endl;
+
+    PressureInfo psi = system_metrics.pressure("memory");
+    if (psi.available) {
+      cout << fixed << setprecision(2) << "Pressure (10s): some "
+           << psi.some_avg10 << "%, full " << psi.full_avg10 << "%" << endl;
+      cout.unsetf(ios::floatfield);
+      cout << setprecision(6);
+    }
+  }
+
+  // Mount points in /proc/mounts escape spaces and friends as \ooo
+  static string unescapeMountPath(const char *start, size_t length) {
+    string path;
+    for (size_t i = 0; i < length; i++) {
+      if (start[i] == '\\' && i + 3 < length && isdigit(start[i + 1])) {
+        path += (char)((start[i + 1] - '0') * 64 + (start[i + 2] - '0') * 8 +
+                       (start[i + 3] - '0'));
+        i += 3;
+      } else {
+        path += start[i];
+      }
+    }
+    return path;
+  }
+
+  void builtinDiskSpace(const vector<string> &args) {
+    // Hosts with many container mounts go well past any fixed buffer
+    string table;
+    if (!readProcFile("/proc/mounts", table)) {
+      cout << "Error: Cannot read /proc/mounts" << endl;
+      return;
+    }
+
+    // Each line: device mountpoint type options dump pass
+    vector<pair<string, string>> mounts;
+    const char *pos = table.data(), *end = pos + table.size();
+    while (pos < end) {
+      const char *newline = (const char *)memchr(pos, '\n', end - pos);
+      const char *line_end = newline ? newline : end;
+      const char *device = pos;
+      const char *device_end = (const char *)memchr(pos, ' ', line_end - pos);
+      if (device_end) {
+        const char *mount = device_end + 1;
+        const char *mount_end =
+            (const char *)memchr(mount, ' ', line_end - mount);
+        if (mount_end) {
+          mounts.push_back(
+              make_pair(string(device, device_end - device),
+                        unescapeMountPath(mount, mount_end - mount)));
+        }
+      }
+      pos = line_end + 1;
+    }
+
+    // With a path argument, show only the filesystem holding it
+    if (args.size() > 1) {
+      char resolved[PATH_MAX];
+      if (!realpath(args[1].c_str(), resolved)) {
+        cout << "Error: Cannot access '" << args[1] << "'" << endl;
+        return;
+      }
+      size_t best = mounts.size();
+      for (size_t i = 0; i < mounts.size(); i++) {
+        const string &mp = mounts[i].second;
+        bool inside = strncmp(resolved, mp.c_str(), mp.size()) == 0 &&
+                      (mp == "/" || resolved[mp.size()] == '/' ||
+                       resolved[mp.size()] == '\0');
+        if (inside &&
+            (best == mounts.size() || mp.size() >= mounts[best].second.size()))
+          best = i;
+      }
+      if (best == mounts.size()) {
+        cout << "Error: No filesystem found for '" << args[1] << "'" << endl;
+        return;
+      }
+      mounts[0] = mounts[best];
+      mounts.resize(1);
+    }
+
+    cout << left << setw(24) << "Filesystem" << right << setw(8) << "Size"
+         << setw(8) << "Used" << setw(8) << "Avail" << setw(6) << "Use%"
+         << "  Mounted on" << endl;
+    set<string> shown;
+    for (const auto &mount : mounts) {
+      struct statvfs vfs;
+      if (statvfs(mount.second.c_str(), &vfs) != 0 || vfs.f_blocks == 0)
+        continue;
+      if (!shown.insert(mount.second).second)
+        continue;
+      uint64_t size = (uint64_t)vfs.f_blocks * vfs.f_frsize;
+      uint64_t free_bytes = (uint64_t)vfs.f_bfree * vfs.f_frsize;
+      uint64_t avail = (uint64_t)vfs.f_bavail * vfs.f_frsize;
+      uint64_t used = size - free_bytes;
+      int percent =
+          used + avail ? (int)((used * 100 + used + avail - 1) / (used + avail))
+                       : 0;
+      string device = mount.first;
+      if (device.size() > 23)
+        device = device.substr(0, 22) + "~";
+      cout << left << setw(24) << device << right << setw(8)
+           << formatBytes(size) << setw(8) << formatBytes(used) << setw(8)
+           << formatBytes(avail) << setw(5) << percent << "%  "
+           << mount.second << endl;
+    }
+  }
+
+  // Samples /proc/stat and PSI over an interval: utilisation per core and
+  // the share of time tasks were stalled on cpu, memory and io
+  void sampleSystem(double seconds) {
+    if (seconds <= 0 || seconds > 3600)
+      seconds = 1.0;
+    const char *resources[] = {"cpu", "memory", "io"};
+    vector<CpuTimes> before, after;
+    PressureInfo psi_before[3], psi_after[3];
+
+    system_metrics.readCpuTimes(before);
+    for (int i = 0; i < 3; i++)
+      psi_before[i] = system_metrics.pressure(resources[i]);
+    cout << "Sampling for " << seconds << "s..." << endl;
+    this_thread::sleep_for(chrono::milliseconds((long)(seconds * 1000)));
+    system_metrics.readCpuTimes(after);
+    for (int i = 0; i < 3; i++)
+      psi_after[i] = system_metrics.pressure(resources[i]);
+
+    size_t count = min(before.size(), after.size());
+    if (count == 0) {
+      cout << "Error: Cannot read /proc/stat" << endl;
+      return;
+    }
+    vector<double> usage(count);
+    for (size_t i = 0; i < count; i++) {
+      uint64_t total = after[i].total - before[i].total;
+      uint64_t busy = after[i].busy - before[i].busy;
+      usage[i] = total ? busy * 100.0 / total : 0.0;
+    }
+
+    char line[128];
+    int bar = (int)(usage[0] / 5 + 0.5);
+    snprintf(line, sizeof(line), "\nCPU: %5.1f%%  [%s%s]", usage[0],
+             string(bar, '#').c_str(), string(20 - bar, '.').c_str());
+    cout << line << endl;
+    for (size_t i = 1; i < count; i++) {
+      snprintf(line, sizeof(line), "  cpu%-4u%5.1f%%", (unsigned)(i - 1),
+               usage[i]);
+      cout << line;
+      if (i % 6 == 0 || i + 1 == count)
+        cout << endl;
+    }
+
+    if (psi_after[0].available) {
+      double interval_us = seconds * 1e6;
+      cout << "\nPressure (share of time stalled):" << endl;
+      for (int i = 0; i < 3; i++) {
+        double some = (psi_after[i].some_total_us -
+                       psi_before[i].some_total_us) * 100.0 / interval_us;
+        double full = (psi_after[i].full_total_us -
+                       psi_before[i].full_total_us) * 100.0 / interval_us;
+        snprintf(line, sizeof(line), "  %-7s some %6.2f%%", resources[i],
+                 some);
+        cout << line;
+        // Full stalls are not defined for cpu at the system level
+        if (i > 0) {
+          snprintf(line, sizeof(line), "   full %6.2f%%", full);
+          cout << line;
+        }
+        cout << endl;
+      }
+    } else {
+      cout << "\nPressure stall information is not available on this kernel"
+           << endl;
+    }
+
+    const MemoryInfo &mem = system_metrics.memory();
+    cout << "\nMemory: " << formatBytes(mem.total - mem.available) << " used, "
+         << formatBytes(mem.available) << " available of "
+         << formatBytes(mem.total) << endl;
+  }
+#endif
+
+  // Where NeoShell keeps its files between sessions
+  string dataFilePath(const string &name) {
+#ifdef _WIN32
+    const char *home = getenv("USERPROFILE");
+#else
+    const char *home = getenv("HOME");
+#endif
+    return string(home ? home : ".") + "/" + name;
+  }
+
+#ifdef __linux__
+  static const size_t USAGE_CACHE_LIMIT = 200000;
+
+  // NSU1 files, from before entries were stamped, still load
+  void loadUsageCache() {
+    usage_cache_loaded = true;
+    ifstream file(dataFilePath(".neoshell_usage_cache").c_str(), ios::binary);
+    if (!file.is_open())
+      return;
+    stringstream ss;
+    ss << file.rdbuf();
+    string data = ss.str();
+    bool stamped = data.compare(0, 4, "NSU2") == 0;
+    if (!stamped && data.compare(0, 4, "NSU1") != 0)
+      return;
+
+    const char *pos = data.data() + 4, *end = data.data() + data.size();
+    while (pos < end) {
+      uint64_t dev, ino, mtime, used = 0, count, length;
+      UsageDir dir;
+      if (!getVarint(pos, end, dev) || !getVarint(pos, end, ino) ||
+          !getVarint(pos, end, mtime) ||
+          (stamped && !getVarint(pos, end, used)) ||
+          !getVarint(pos, end, dir.file_bytes) ||
+          !getVarint(pos, end, dir.file_count) || !getVarint(pos, end, count))
+        break;
+      dir.mtime_ns = (int64_t)mtime;
+      dir.last_used = (int64_t)used;
+      bool ok = true;
+      for (uint64_t i = 0; i < count && ok; i++) {
+        ok = getVarint(pos, end, length) && length <= (uint64_t)(end - pos);
+        if (ok) {
+          dir.subdirs.push_back(string(pos, (size_t)length));
+          pos += length;
+        }
+      }
+      uint64_t linked = 0, link_ino, link_bytes;
+      ok = ok && getVarint(pos, end, linked);
+      for (uint64_t i = 0; i < linked && ok; i++) {
+        ok = getVarint(pos, end, link_ino) && getVarint(pos, end, link_bytes);
+        if (ok)
+          dir.linked.push_back(make_pair(link_ino, link_bytes));
+      }
+      if (!ok)
+        break;
+      usage_cache[make_pair(dev, ino)] = dir;
+    }
+  }
+
+  // Past the size limit, only the most recently scanned directories are
+  // kept, which also clears out ones that were deleted or moved
+  void saveUsageCache() {
+    if (usage_cache.size() > USAGE_CACHE_LIMIT) {
+      vector<int64_t> stamps;
+      for (const auto &pair : usage_cache)
+        stamps.push_back(pair.second.last_used);
+      nth_element(stamps.begin(), stamps.end() - USAGE_CACHE_LIMIT,
+                  stamps.end());
+      int64_t oldest_kept = *(stamps.end() - USAGE_CACHE_LIMIT);
+      for (DiskUsageScanner::Cache::iterator it = usage_cache.begin();
+           it != usage_cache.end();) {
+        if (it->second.last_used < oldest_kept)
+          usage_cache.erase(it++);
+        else
+          ++it;
+      }
+    }
+    string data = "NSU2";
+    for (const auto &pair : usage_cache) {
+      putVarint(data, pair.first.first);
+      putVarint(data, pair.first.second);
+      putVarint(data, (uint64_t)pair.second.mtime_ns);
+      putVarint(data, (uint64_t)pair.second.last_used);
+      putVarint(data, pair.second.file_bytes);
+      putVarint(data, pair.second.file_count);
+      putVarint(data, pair.second.subdirs.size());
+      for (const string &name : pair.second.subdirs) {
+        putVarint(data, name.size());
+        data += name;
+      }
+      putVarint(data, pair.second.linked.size());
+      for (const auto &link : pair.second.linked) {
+        putVarint(data, link.first);
+        putVarint(data, link.second);
+      }
+    }
+    replaceFile(dataFilePath(".neoshell_usage_cache"), data);
+  }
+
+  void printUsageTree(const vector<UsageNode> &nodes,
+                      const vector<vector<size_t>> &children, size_t index,
+                      const string &indent, int depth, size_t top_n) {
+    vector<size_t> sorted = children[index];
+    sort(sorted.begin(), sorted.end(), [&nodes](size_t a, size_t b) {
+      return nodes[a].total_bytes > nodes[b].total_bytes;
+    });
+    size_t shown = min(top_n, sorted.size());
+    for (size_t i = 0; i < shown; i++) {
+      const UsageNode &node = nodes[sorted[i]];
+      bool last = i + 1 == shown && sorted.size() <= top_n;
+      cout << setw(8) << formatBytes(node.total_bytes) << "  " << indent
+           << (last ? "`-- " : "|-- ") << node.name << "/" << endl;
+      if (depth > 1) {
+        printUsageTree(nodes, children, sorted[i],
+                       indent + (last ? "    " : "|   "), depth - 1, top_n);
+      }
+    }
+    if (sorted.size() > top_n) {
+      uint64_t rest = 0;
+      for (size_t i = top_n; i < sorted.size(); i++)
+        rest += nodes[sorted[i]].total_bytes;
+      cout << setw(8) << formatBytes(rest) << "  " << indent << "`-- ("
+           << (sorted.size() - top_n) << " more)" << endl;
+    }
+  }
+
+  // usage [dir] [-n N] [-d depth] [-j threads] [--fresh]
+  void builtinUsage(const vector<string> &args) {
+    string root = ".";
+    size_t top_n = 10;
+    int depth = 2;
+    unsigned threads = max(4u, min(32u, thread::hardware_concurrency() * 2));
+    bool fresh = false;
+    for (size_t i = 1; i < args.size(); i++) {
+      if (args[i] == "-n" && i + 1 < args.size())
+        top_n = max(1, atoi(args[++i].c_str()));
+      else if (args[i] == "-d" && i + 1 < args.size())
+        depth = max(1, atoi(args[++i].c_str()));
+      else if (args[i] == "-j" && i + 1 < args.size())
+        threads = max(1, atoi(args[++i].c_str()));
+      else if (args[i] == "--fresh")
+        fresh = true;
+      else
+        root = args[i];
+    }
+
+    char resolved[PATH_MAX];
+    if (!realpath(root.c_str(), resolved)) {
+      cout << "Error: Cannot access directory '" << root << "'" << endl;
+      return;
+    }
+    if (!usage_cache_loaded)
+      loadUsageCache();
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    DiskUsageScanner scanner(usage_cache, !fresh);
+    if (!scanner.scan(resolved, threads)) {
+      cout << "Error: '" << root << "' is not a directory" << endl;
+      return;
+    }
+    uint64_t elapsed = elapsedNanos(start, chrono::steady_clock::now());
+
+    const vector<UsageNode> &nodes = scanner.tree();
+    vector<vector<size_t>> children(nodes.size());
+    for (size_t i = 1; i < nodes.size(); i++)
+      children[nodes[i].parent].push_back(i);
+
+    cout << setw(8) << formatBytes(nodes[0].total_bytes) << "  " << resolved
+         << endl;
+    printUsageTree(nodes, children, 0, "", depth, top_n);
+    cout << "\n" << nodes[0].total_files << " files in " << nodes.size()
+         << " directories (" << scanner.cached() << " unchanged since last "
+         << "scan), " << formatDuration(elapsed) << endl;
+    if (scanner.failures() > 0) {
+      cout << scanner.failures() << " directories could not be read" << endl;
+    }
+
+    int64_t now = (int64_t)time(0);
+    for (const auto &pair : scanner.updated()) {
+      UsageDir &dir = usage_cache[pair.first];
+      dir = pair.second;
+      dir.last_used = now;
+    }
+    saveUsageCache();
+  }
+
+  // A path, directory or glob to watch. Globs match anywhere below their
+  // leading non-glob directory; a file is watched through its directory.
+  static bool parseWatchSpec(string path, WatchSpec &spec) {
+    while (path.size() > 1 && path[path.size() - 1] == '/')
+      path.erase(path.size() - 1);
+    bool is_glob = path.find_first_of("*?[") != string::npos;
+    spec.recursive = is_glob || directoryExists(path);
+    if (spec.recursive && !is_glob) {
+      spec.root = path;
+      spec.pattern.clear();
+      return true;
+    }
+    struct stat st;
+    if (!is_glob && stat(path.c_str(), &st) != 0)
+      return false;
+    size_t slash =
+        path.rfind('/', is_glob ? path.find_first_of("*?[") : path.size());
+    if (slash == string::npos) {
+      spec.root = ".";
+      spec.pattern = "./" + path;
+    } else {
+      spec.root = slash == 0 ? "/" : path.substr(0, slash);
+      spec.pattern = path;
+    }
+    return directoryExists(spec.root);
+  }
+
+  pid_t startWatchedCommand(const string &command) {
+    sigset_t none, defaults;
+    sigemptyset(&none);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+                                        POSIX_SPAWN_SETSIGDEF |
+                                        POSIX_SPAWN_SETPGROUP);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    const char *argv[] = {"sh", "-c", command.c_str(), NULL};
+    pid_t pid;
+    cout.flush();
+    int err = posix_spawn(&pid, "/bin/sh", &actions, &attr,
+                          (char *const *)argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    return err == 0 ? pid : -1;
+  }
+
+  // onchange [-d ms] <paths/globs...> -- <command>
+  // Runs the command whenever something under the paths changes, once per
+  // burst of events: it waits until the tree has been quiet for the
+  // debounce window. Changes during a run cancel it and start a new one.
+  void builtinOnChange(const vector<string> &args) {
+    static const int KILL_GRACE_MS = 2000;
+    static const size_t MAX_REPORTED_PATHS = 1000;
+    int debounce_ms = 200;
+    size_t i = 1;
+    if (args.size() > 2 && args[1] == "-d") {
+      debounce_ms = max(0, atoi(args[2].c_str()));
+      i = 3;
+    }
+    vector<string> paths;
+    for (; i < args.size() && args[i] != "--"; i++)
+      paths.push_back(args[i]);
+    string command;
+    for (i++; i < args.size(); i++)
+      command += (command.empty() ? "" : " ") + args[i];
+    if (paths.empty() || command.empty()) {
+      cout << "Usage: onchange [-d <ms>] <paths/globs...> -- <command>"
+           << endl;
+      return;
+    }
+
+    TreeWatcher watcher;
+    if (watcher.descriptor() < 0) {
+      cout << "Error: Cannot start watching: " << strerror(errno) << endl;
+      return;
+    }
+    for (const string &path : paths) {
+      WatchSpec spec;
+      if (!parseWatchSpec(path, spec)) {
+        cout << "Error: Cannot watch '" << path << "'" << endl;
+        return;
       }
+      watcher.add(spec);
     }
-    return dp[m][n];
-  }
-
-  vector<string> findSimilarCommands(const string &cmd) {
-    vector<pair<int, string>> scored;
+    if (watcher.hitLimit()) {
+      cout << "Warning: inotify watch limit reached after "
+           << watcher.watched()
+           << " directories; raise fs.inotify.max_user_watches" << endl;
+    }
+    cout << "Watching " << watcher.watched()
+         << " directories, Ctrl-C to stop" << endl;
+
+    sigset_t handled, saved_mask;
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGCHLD);
+    sigaddset(&handled, SIGINT);
+    sigaddset(&handled, SIGQUIT);
+    sigprocmask(SIG_BLOCK, &handled, &saved_mask);
+    int signals = signalfd(-1, &handled, SFD_NONBLOCK | SFD_CLOEXEC);
+    int poller = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = watcher.descriptor();
+    epoll_ctl(poller, EPOLL_CTL_ADD, watcher.descriptor(), &event);
+    event.data.fd = signals;
+    epoll_ctl(poller, EPOLL_CTL_ADD, signals, &event);
+
+    typedef chrono::steady_clock clock;
+    pid_t running = -1;
+    clock::time_point run_start, quiet_at, kill_at;
+    bool pending = false, restart = false, killing = false, killed = false;
+    bool stop = false;
+    set<string> changed;
+    while (!stop) {
+      clock::time_point now = clock::now();
+      int timeout = -1;
+      if (pending) {
+        timeout = (int)max<int64_t>(
+            0, chrono::duration_cast<chrono::milliseconds>(quiet_at - now)
+                   .count());
+      }
+      if (killing && !killed) {
+        int until_kill = (int)max<int64_t>(
+            0, chrono::duration_cast<chrono::milliseconds>(kill_at - now)
+                   .count());
+        timeout = timeout < 0 ? until_kill : min(timeout, until_kill);
+      }
+      struct epoll_event events[2];
+      int ready = epoll_wait(poller, events, 2, timeout);
+      if (ready < 0 && errno != EINTR)
+        break;
 
-    for (const auto &pair : command_map) {
-      int dist = levenshteinDistance(cmd, pair.first);
-      if (dist <= 2) {
-        scored.push_back({dist, pair.first});
+      for (int e = 0; e < ready; e++) {
+        if (events[e].data.fd == watcher.descriptor()) {
+          if (watcher.readEvents(changed, MAX_REPORTED_PATHS) > 0) {
+            pending = true;
+            quiet_at = clock::now() + chrono::milliseconds(debounce_ms);
+          }
+          continue;
+        }
+        struct signalfd_siginfo info;
+        while (read(signals, &info, sizeof(info)) == sizeof(info)) {
+          if (info.ssi_signo != SIGCHLD) {
+            stop = true;
+            continue;
+          }
+          int status;
+          if (running > 0 && waitpid(running, &status, WNOHANG) == running) {
+            int code = WIFEXITED(status) ? WEXITSTATUS(status)
+                                         : 128 + WTERMSIG(status);
+            cout << "[onchange] " << (killing ? "cancelled" : "exit " +
+                                                                 to_string(code))
+                 << " after "
+                 << formatDuration(elapsedNanos(run_start, clock::now()))
+                 << endl;
+            running = -1;
+            killing = killed = false;
+          }
+        }
       }
-    }
 
-    for (const auto &pair : aliases) {
-      int dist = levenshteinDistance(cmd, pair.first);
-      if (dist <= 2) {
-        scored.push_back({dist, pair.first});
+      now = clock::now();
+      // Still cancelled, not a failure, when SIGTERM was ignored
+      if (killing && !killed && now >= kill_at) {
+        kill(-running, SIGKILL);
+        killed = true;
+      }
+      if (pending && now >= quiet_at) {
+        pending = false;
+        cout << "[onchange] ";
+        if (changed.empty()) {
+          // Only a queue overflow: something changed, we don't know what
+          cout << "changes detected" << endl;
+        } else {
+          cout << changed.size()
+               << (changed.size() >= MAX_REPORTED_PATHS ? "+" : "")
+               << (changed.size() == 1 ? " file changed: "
+                                       : " files changed: ");
+          size_t shown = 0;
+          for (auto it = changed.begin(); it != changed.end() && shown < 3;
+               ++it, ++shown)
+            cout << (shown ? ", " : "") << *it;
+          cout << (changed.size() > 3 ? ", ..." : "") << endl;
+        }
+        changed.clear();
+        restart = true;
+        if (running > 0 && !killing) {
+          kill(-running, SIGTERM);
+          killing = true;
+          kill_at = now + chrono::milliseconds(KILL_GRACE_MS);
+        }
+      }
+      if (restart && running < 0) {
+        restart = false;
+        running = startWatchedCommand(command);
+        run_start = clock::now();
+        if (running < 0)
+          cout << "Error: Cannot run '" << command << "'" << endl;
       }
     }
 
-    sort(scored.begin(), scored.end());
-
-    vector<string> suggestions;
-    for (const auto &p : scored) {
-      suggestions.push_back(p.second);
+    if (running > 0) {
+      kill(-running, SIGTERM);
+      clock::time_point give_up =
+          clock::now() + chrono::milliseconds(KILL_GRACE_MS);
+      pid_t done;
+      while ((done = waitpid(running, NULL, WNOHANG)) == 0 &&
+             clock::now() < give_up)
+        this_thread::sleep_for(chrono::milliseconds(10));
+      if (done == 0) {
+        kill(-running, SIGKILL);
+        while (waitpid(running, NULL, 0) < 0 && errno == EINTR) {
+        }
+      }
     }
-    return suggestions;
+    close(poller);
+    close(signals);
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+    cout << "Stopped watching" << endl;
   }
+#endif
 
-  string translateCommand(const string &human_cmd) {
-    string lower_cmd = human_cmd;
-    transform(lower_cmd.begin(), lower_cmd.end(), lower_cmd.begin(), ::tolower);
+  // Every directory change the user asks for goes through here so it can
+  // be remembered for fuzzy jumping
+  bool changeDirectory(const string &path) {
+#ifdef _WIN32
+    if (!SetCurrentDirectoryA(path.c_str()))
+      return false;
+#else
+    if (chdir(path.c_str()) != 0)
+      return false;
+#endif
+    cwd_valid = false;
+    visited_dirs.visit(getCurrentPath());
+    return true;
+  }
 
-    if (command_map.find(lower_cmd) != command_map.end()) {
-      return command_map[lower_cmd];
+  // goto <dir> goes there if it exists; otherwise the words are matched
+  // against every directory visited before and the best-ranked one wins
+  void jumpTo(const vector<string> &words) {
+    if (words.size() == 1 && changeDirectory(words[0]))
+      return;
+    if (words.size() == 1 && directoryExists(words[0])) {
+      cout << "Cannot access directory: " << words[0] << endl;
+      return;
     }
 
-    return human_cmd;
+    vector<pair<double, string>> matches = visited_dirs.query(words, 1);
+    if (!matches.empty() && changeDirectory(matches[0].second)) {
+      cout << "-> " << matches[0].second << endl;
+      return;
+    }
+    string joined = words[0];
+    for (size_t i = 1; i < words.size(); i++)
+      joined += " " + words[i];
+    cout << "Cannot access directory: " << joined << endl;
   }
 
-  string expandVariables(const string &input) {
-    string result = input;
-    size_t pos = 0;
-    while ((pos = result.find('$', pos)) != string::npos) {
-      size_t end = pos + 1;
-      while (end < result.length() &&
-             (isalnum(result[end]) || result[end] == '_')) {
-        end++;
-      }
-      string var_name = result.substr(pos + 1, end - pos - 1);
-      if (env_vars.find(var_name) != env_vars.end()) {
-        result.replace(pos, end - pos, env_vars[var_name]);
-      }
-      pos = end;
+  void listVisitedDirs(const vector<string> &words) {
+    vector<pair<double, string>> matches = visited_dirs.query(words, 10);
+    if (matches.empty()) {
+      cout << "No visited directories match" << endl;
+      return;
     }
-    return result;
+    for (const auto &match : matches) {
+      cout << fixed << setprecision(1) << setw(8) << match.first << "  "
+           << match.second << endl;
+    }
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
   }
 
   void builtinList(const vector<string> &args) {
@@ -271,7 +6914,7 @@ private:
     if (args.size() > 1) {
       cmd += " " + args[1];
     }
-    system(cmd.c_str());
+    runExternal(cmd);
 #endif
   }
 
@@ -320,17 +6963,535 @@ private:
 #endif
   }
 
+#ifndef _WIN32
+  // Expands glob patterns in args[from, to) into paths. Plain names are
+  // kept as they are. Returns false (after saying so) when a pattern
+  // matches nothing, unless keep_unmatched passes it through literally as
+  // sh does, for arguments that need not be files at all.
+  bool expandPaths(const vector<string> &args, size_t from, size_t to,
+                   vector<string> &paths, bool keep_unmatched = false) {
+    for (size_t i = from; i < to; i++) {
+      if (!GlobExpander::hasGlob(args[i])) {
+        paths.push_back(args[i]);
+      } else if (!globber.expand(args[i], paths)) {
+        if (keep_unmatched) {
+          paths.push_back(args[i]);
+          continue;
+        }
+        cout << "No files match '" << args[i] << "'" << endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Runs the operations with a progress line on a terminal, then either
+  // lists each result (for a handful of files) or summarises
+  void runBulkOps(vector<BulkOp> &ops, const char *verb, const char *done_verb,
+                  const char *single_message, const char *error_message) {
+    static const size_t LISTED_RESULTS = 10;
+    bool show_progress = isatty(STDOUT_FILENO) != 0;
+    bool progress_shown = false;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    size_t failed = BulkFileOps::run(ops, [&](size_t done) {
+      if (!show_progress || done == ops.size())
+        return;
+      cout << "\r" << verb << " " << done << "/" << ops.size() << flush;
+      progress_shown = true;
+    });
+    if (progress_shown)
+      cout << "\r\033[K";
+
+    if (ops.size() <= LISTED_RESULTS) {
+      for (const BulkOp &op : ops) {
+        if (op.error == 0) {
+          cout << single_message << op.from;
+          if (!op.to.empty())
+            cout << " -> " << op.to;
+          cout << endl;
+        } else {
+          cout << "Error: " << error_message << " '" << op.from
+               << "': " << strerror(op.error) << endl;
+        }
+      }
+    } else {
+      cout << done_verb << " " << ops.size() - failed << " of " << ops.size()
+           << " files in "
+           << formatDuration(elapsedNanos(start, chrono::steady_clock::now()))
+           << endl;
+      size_t shown = 0;
+      for (const BulkOp &op : ops) {
+        if (op.error == 0 || shown++ == 5)
+          continue;
+        cout << "  " << op.from << ": " << strerror(op.error) << endl;
+      }
+      if (failed > 5)
+        cout << "  ... and " << failed - 5 << " more errors" << endl;
+    }
+    last_status = failed ? 1 : 0;
+  }
+
+  static const size_t HASH_CACHE_LIMIT = 500000;
+
+  void loadHashCache() {
+    hash_cache_loaded = true;
+    ifstream file(dataFilePath(".neoshell_hash_cache").c_str(), ios::binary);
+    if (!file.is_open())
+      return;
+    stringstream ss;
+    ss << file.rdbuf();
+    string data = ss.str();
+    if (data.compare(0, 4, "NSH1") != 0)
+      return;
+
+    const uint8_t *pos = (const uint8_t *)data.data() + 4;
+    const uint8_t *end = (const uint8_t *)data.data() + data.size();
+    while (pos < end) {
+      uint64_t dev, ino, size, mtime, have;
+      const char *cursor = (const char *)pos;
+      if (!getVarint(cursor, (const char *)end, dev) ||
+          !getVarint(cursor, (const char *)end, ino) ||
+          !getVarint(cursor, (const char *)end, size) ||
+          !getVarint(cursor, (const char *)end, mtime) ||
+          !getVarint(cursor, (const char *)end, have))
+        break;
+      pos = (const uint8_t *)cursor;
+      size_t need = (have & HASH_EDGES ? 8 : 0) + (have & HASH_XXH64 ? 8 : 0) +
+                    (have & HASH_SHA256 ? 32 : 0);
+      if ((size_t)(end - pos) < need)
+        break;
+      FileDigest digest;
+      digest.size = size;
+      digest.mtime_ns = (int64_t)mtime;
+      digest.have = (uint8_t)have;
+      digest.used = false;
+      if (have & HASH_EDGES) {
+        digest.edges = readLe64(pos);
+        pos += 8;
+      }
+      if (have & HASH_XXH64) {
+        digest.xxh64 = readLe64(pos);
+        pos += 8;
+      }
+      if (have & HASH_SHA256) {
+        memcpy(digest.sha256, pos, 32);
+        pos += 32;
+      }
+      hash_cache[make_pair(dev, ino)] = digest;
+    }
+  }
+
+  // Past the size limit, entries not looked at this session are dropped
+  void saveHashCache() {
+    if (hash_cache.size() > HASH_CACHE_LIMIT) {
+      for (FileHasher::Cache::iterator it = hash_cache.begin();
+           it != hash_cache.end();) {
+        if (it->second.used)
+          ++it;
+        else
+          hash_cache.erase(it++);
+      }
+    }
+    string data = "NSH1";
+    for (const auto &pair : hash_cache) {
+      const FileDigest &digest = pair.second;
+      putVarint(data, pair.first.first);
+      putVarint(data, pair.first.second);
+      putVarint(data, digest.size);
+      putVarint(data, (uint64_t)digest.mtime_ns);
+      putVarint(data, digest.have);
+      if (digest.have & HASH_EDGES)
+        putLe64(data, digest.edges);
+      if (digest.have & HASH_XXH64)
+        putLe64(data, digest.xxh64);
+      if (digest.have & HASH_SHA256)
+        data.append((const char *)digest.sha256, 32);
+    }
+    replaceFile(dataFilePath(".neoshell_hash_cache"), data);
+  }
+
+  static string digestString(const FileDigest &digest, HashKind kind) {
+    if (kind == HASH_SHA256)
+      return hexString(digest.sha256, 32);
+    char buffer[17];
+    snprintf(buffer, sizeof(buffer), "%016llx",
+             (unsigned long long)digest.xxh64);
+    return buffer;
+  }
+
+  // checksum [--sha256] <files/patterns...>
+  void builtinChecksum(const vector<string> &args) {
+    HashKind kind = HASH_XXH64;
+    vector<string> patterns(1, args[0]);
+    for (size_t i = 1; i < args.size(); i++) {
+      if (args[i] == "--sha256")
+        kind = HASH_SHA256;
+      else if (args[i] == "--xxh64")
+        kind = HASH_XXH64;
+      else
+        patterns.push_back(args[i]);
+    }
+    if (patterns.size() < 2) {
+      cout << "Usage: checksum [--sha256] <file|pattern>..." << endl;
+      return;
+    }
+    vector<string> paths;
+    if (!expandPaths(patterns, 1, patterns.size(), paths))
+      return;
+
+    vector<HashJob> jobs(paths.size());
+    vector<HashJob *> pending;
+    for (size_t i = 0; i < paths.size(); i++) {
+      HashJob &job = jobs[i];
+      struct stat st;
+      if (stat(paths[i].c_str(), &st) != 0) {
+        job.path = paths[i];
+        job.error = errno;
+        continue;
+      }
+      FileHasher::initJob(job, paths[i], st);
+      if (S_ISREG(st.st_mode))
+        pending.push_back(&job);
+      else
+        job.error = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+    }
+
+    if (!hash_cache_loaded)
+      loadHashCache();
+    FileHasher hasher(hash_cache);
+    hasher.run(pending, kind);
+
+    size_t failed = 0;
+    for (const HashJob &job : jobs) {
+      if (job.error) {
+        cout << "Error: Cannot read '" << job.path
+             << "': " << strerror(job.error) << endl;
+        failed++;
+      } else {
+        cout << digestString(job.digest, kind) << "  " << job.path << endl;
+      }
+    }
+    if (hasher.filesRead() > 0)
+      saveHashCache();
+    last_status = failed ? 1 : 0;
+  }
+
+  // Groups the jobs that agree on key(job), keeping groups of two or more
+  template <typename Key>
+  static vector<vector<HashJob *>> collisions(const vector<HashJob *> &jobs,
+                                              Key key) {
+    unordered_map<string, vector<HashJob *>> groups;
+    for (HashJob *job : jobs) {
+      if (!job->error)
+        groups[key(*job)].push_back(job);
+    }
+    vector<vector<HashJob *>> result;
+    for (auto &pair : groups) {
+      if (pair.second.size() > 1)
+        result.push_back(pair.second);
+    }
+    return result;
+  }
+
+  static vector<HashJob *> flatten(const vector<vector<HashJob *>> &groups) {
+    vector<HashJob *> jobs;
+    for (const vector<HashJob *> &group : groups)
+      jobs.insert(jobs.end(), group.begin(), group.end());
+    return jobs;
+  }
+
+  // Lists regular files below root without following symlinks. A file
+  // reached again through another hard link is only counted once.
+  void collectFiles(const string &root, uint64_t min_size,
+                    vector<HashJob> &files, size_t &unreadable) {
+    set<pair<uint64_t, uint64_t>> seen;
+    vector<string> stack(1, root);
+    while (!stack.empty()) {
+      string dir = stack.back();
+      stack.pop_back();
+      DIR *handle = opendir(dir.c_str());
+      if (!handle) {
+        unreadable++;
+        continue;
+      }
+      string prefix = dir == "." ? "" : dir.back() == '/' ? dir : dir + "/";
+      while (struct dirent *entry = readdir(handle)) {
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+          continue;
+        if (entry->d_type == DT_DIR) {
+          stack.push_back(prefix + name);
+          continue;
+        }
+        if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN)
+          continue;
+        struct stat st;
+        if (fstatat(dirfd(handle), name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+          unreadable++;
+          continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+          stack.push_back(prefix + name);
+        } else if (S_ISREG(st.st_mode) && st.st_size > 0 &&
+                   (uint64_t)st.st_size >= min_size &&
+                   seen.insert(make_pair((uint64_t)st.st_dev,
+                                         (uint64_t)st.st_ino))
+                       .second) {
+          files.push_back(HashJob());
+          FileHasher::initJob(files.back(), prefix + name, st);
+        }
+      }
+      closedir(handle);
+    }
+  }
+
+  // dupes [dir] [--sha256] [--min-size <size>]
+  void builtinDupes(const vector<string> &args) {
+    string root = ".";
+    HashKind kind = HASH_XXH64;
+    uint64_t min_size = 1;
+    for (size_t i = 1; i < args.size(); i++) {
+      if (args[i] == "--sha256") {
+        kind = HASH_SHA256;
+      } else if (args[i] == "--min-size" && i + 1 < args.size() &&
+                 parseBytes(args[i + 1], min_size)) {
+        i++;
+      } else if (args[i][0] == '-') {
+        cout << "Usage: dupes [dir] [--sha256] [--min-size <bytes>]" << endl;
+        return;
+      } else {
+        root = args[i];
+      }
+    }
+    if (!directoryExists(root)) {
+      cout << "Error: '" << root << "' is not a directory" << endl;
+      return;
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<HashJob> files;
+    size_t unreadable = 0;
+    collectFiles(root, min_size, files, unreadable);
+    uint64_t scanned_bytes = 0;
+    vector<HashJob *> all;
+    for (HashJob &job : files) {
+      scanned_bytes += job.digest.size;
+      all.push_back(&job);
+    }
+
+    // Each stage only looks at files that still collide after the last:
+    // same size, then same first and last blocks, then same contents
+    auto sizeKey = [](const HashJob &job) {
+      return string((const char *)&job.digest.size, 8);
+    };
+    auto edgesKey = [](const HashJob &job) {
+      return string((const char *)&job.digest.size, 8) +
+             string((const char *)&job.digest.edges, 8);
+    };
+    auto fullKey = [kind](const HashJob &job) {
+      return string((const char *)&job.digest.size, 8) +
+             (kind == HASH_SHA256
+                  ? string((const char *)job.digest.sha256, 32)
+                  : string((const char *)&job.digest.xxh64, 8));
+    };
+
+    if (!hash_cache_loaded)
+      loadHashCache();
+    FileHasher hasher(hash_cache);
+    vector<HashJob *> candidates = flatten(collisions(all, sizeKey));
+    hasher.run(candidates, HASH_EDGES);
+    candidates = flatten(collisions(candidates, edgesKey));
+    hasher.run(candidates, kind);
+    vector<vector<HashJob *>> groups = collisions(candidates, fullKey);
+
+    size_t failed = 0;
+    for (const HashJob &job : files)
+      failed += job.error != 0;
+
+    sort(groups.begin(), groups.end(),
+         [](const vector<HashJob *> &a, const vector<HashJob *> &b) {
+           uint64_t wasted_a = a[0]->digest.size * (a.size() - 1);
+           uint64_t wasted_b = b[0]->digest.size * (b.size() - 1);
+           if (wasted_a != wasted_b)
+             return wasted_a > wasted_b;
+           return a[0]->path < b[0]->path;
+         });
+    uint64_t reclaimable = 0;
+    for (vector<HashJob *> &group : groups) {
+      sort(group.begin(), group.end(), [](const HashJob *a, const HashJob *b) {
+        return a->path < b->path;
+      });
+      uint64_t wasted = group[0]->digest.size * (group.size() - 1);
+      reclaimable += wasted;
+      cout << group.size() << " copies of " << formatBytes(group[0]->digest.size)
+           << " (" << formatBytes(wasted) << " reclaimable):" << endl;
+      for (const HashJob *job : group)
+        cout << "  " << job->path << endl;
+    }
+    uint64_t elapsed = elapsedNanos(start, chrono::steady_clock::now());
+
+    if (groups.empty())
+      cout << "No duplicates found" << endl;
+    else
+      cout << "\n" << groups.size() << " groups of duplicates, "
+           << formatBytes(reclaimable) << " reclaimable" << endl;
+    cout << files.size() << " files (" << formatBytes(scanned_bytes)
+         << ") checked in " << formatDuration(elapsed) << ": "
+         << hasher.filesRead() << " hashed (" << formatBytes(hasher.bytesRead())
+         << " read), " << hasher.cacheHits() << " from cache" << endl;
+    if (unreadable + failed > 0)
+      cout << unreadable + failed << " files or directories could not be read"
+           << endl;
+    if (hasher.filesRead() > 0)
+      saveHashCache();
+    last_status = 0;
+  }
+
+  // query [-d delim] [--no-header] <file> [select ...] [where ...]
+  //       [group by col] [order by col [desc]] [limit n]
+  void builtinQuery(const vector<string> &args) {
+    char delim = 0;
+    bool header_row = true;
+    string path, text;
+    for (size_t i = 1; i < args.size(); i++) {
+      if (!text.empty() || (!path.empty() && args[i][0] != '-')) {
+        text += (text.empty() ? "" : " ") + args[i];
+      } else if (args[i] == "-d" && i + 1 < args.size()) {
+        string d = args[++i];
+        delim = d == "tab" || d == "\\t" ? '\t' : d[0];
+      } else if (args[i] == "--no-header") {
+        header_row = false;
+      } else if (path.empty()) {
+        path = args[i];
+      } else {
+        text = args[i];
+      }
+    }
+    if (path.empty()) {
+      cout << "Usage: query <file> [select <cols>] [where <cond>] "
+              "[group by <col>] [order by <col> [desc]] [limit <n>]"
+           << endl;
+      return;
+    }
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      cout << "Error: Cannot open file '" << path << "'" << endl;
+      if (fd >= 0)
+        close(fd);
+      return;
+    }
+    MappedFile map;
+    bool mapped = map.open(fd, st.st_size);
+    close(fd);
+    if (!mapped || map.size == 0) {
+      cout << "Error: Cannot read '" << path << "'" << endl;
+      return;
+    }
+    posix_madvise((void *)map.data, map.size, POSIX_MADV_SEQUENTIAL);
+    const char *begin = (const char *)map.data, *end = begin + map.size;
+    if (map.size >= 3 && memcmp(begin, "\xEF\xBB\xBF", 3) == 0)
+      begin += 3;
+
+    // Tab for .tsv files, otherwise whichever separator the first line
+    // has most of
+    if (!delim) {
+      size_t dot = path.find_last_of('.');
+      string ext = dot == string::npos ? "" : path.substr(dot + 1);
+      const char *line_end = (const char *)memchr(begin, '\n', end - begin);
+      if (!line_end)
+        line_end = end;
+      size_t best = 0;
+      delim = ext == "tsv" || ext == "tab" ? '\t' : ',';
+      for (const char *c = ",\t;|"; *c && ext != "tsv" && ext != "tab"; c++) {
+        size_t n = count(begin, line_end, *c);
+        if (n > best) {
+          best = n;
+          delim = *c;
+        }
+      }
+    }
+
+    vector<CsvField> fields;
+    size_t field_count = 0;
+    const char *data = CsvReader::read(begin, end, delim, SIZE_MAX, fields,
+                                       [&](size_t n) {
+                                         field_count = n;
+                                         return false;
+                                       });
+    vector<string> header(field_count);
+    for (size_t i = 0; i < field_count; i++) {
+      if (header_row)
+        csvText(fields[i], header[i]);
+      else
+        header[i] = "c" + to_string(i + 1);
+    }
+    if (!header_row)
+      data = begin;
+
+    CsvQuery query;
+    string error;
+    if (!query.parse(text, header, error)) {
+      cout << "Error: " << error << endl;
+      return;
+    }
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    query.run(data, end, delim, max(1u, thread::hardware_concurrency()));
+    uint64_t elapsed = elapsedNanos(start, chrono::steady_clock::now());
+
+    vector<string> labels = query.labels();
+    vector<size_t> widths(labels.size());
+    for (size_t k = 0; k < labels.size(); k++)
+      widths[k] = labels[k].size();
+    for (const vector<string> &row : query.rows) {
+      for (size_t k = 0; k < row.size(); k++)
+        widths[k] = min<size_t>(40, max(widths[k], row[k].size()));
+    }
+    auto printRow = [&](const vector<string> &row) {
+      for (size_t k = 0; k < row.size(); k++) {
+        if (k + 1 < row.size())
+          cout << left << setw(widths[k]) << row[k] << "  ";
+        else
+          cout << row[k];
+      }
+      cout << right << endl;
+    };
+    printRow(labels);
+    for (const vector<string> &row : query.rows)
+      printRow(row);
+    cout << "\n" << query.rows.size() << " rows, " << query.records
+         << " records scanned in " << formatDuration(elapsed) << endl;
+  }
+#endif
+
   void builtinRemove(const vector<string> &args) {
     if (args.size() < 2) {
-      cout << "Usage: remove <filename>" << endl;
+      cout << "Usage: remove <file|pattern>..." << endl;
       return;
     }
 
-    if (remove(args[1].c_str()) == 0) {
-      cout << "File deleted: " << args[1] << endl;
-    } else {
-      cout << "Error: Cannot delete file '" << args[1] << "'" << endl;
+#ifdef _WIN32
+    for (size_t i = 1; i < args.size(); i++) {
+      if (remove(args[i].c_str()) == 0) {
+        cout << "File deleted: " << args[i] << endl;
+      } else {
+        cout << "Error: Cannot delete file '" << args[i] << "'" << endl;
+      }
+    }
+#else
+    vector<string> paths;
+    if (!expandPaths(args, 1, args.size(), paths))
+      return;
+    vector<BulkOp> ops(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) {
+      struct stat st;
+      ops[i].from = paths[i];
+      ops[i].is_dir = lstat(paths[i].c_str(), &st) == 0 && S_ISDIR(st.st_mode);
     }
+    runBulkOps(ops, "Deleting", "Deleted", "File deleted: ",
+               "Cannot delete");
+#endif
   }
 
   void builtinCopy(const vector<string> &args) {
@@ -339,37 +7500,294 @@ private:
       return;
     }
 
+#ifdef _WIN32
     ifstream src(args[1], ios::binary);
     if (!src.is_open()) {
       cout << "Error: Cannot open source file '" << args[1] << "'" << endl;
       return;
     }
 
-    ofstream dst(args[2], ios::binary);
-    if (!dst.is_open()) {
-      cout << "Error: Cannot create destination file '" << args[2] << "'"
-           << endl;
-      src.close();
-      return;
+    ofstream dst(args[2], ios::binary);
+    if (!dst.is_open()) {
+      cout << "Error: Cannot create destination file '" << args[2] << "'"
+           << endl;
+      src.close();
+      return;
+    }
+
+    dst << src.rdbuf();
+    src.close();
+    dst.close();
+#else
+    int src = open(args[1].c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (src < 0 || fstat(src, &st) != 0 || !S_ISREG(st.st_mode)) {
+      cout << "Error: Cannot open source file '" << args[1] << "'" << endl;
+      if (src >= 0)
+        close(src);
+      return;
+    }
+
+    int dst = open(args[2].c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   st.st_mode & 0777);
+    if (dst < 0) {
+      cout << "Error: Cannot create destination file '" << args[2] << "'"
+           << endl;
+      close(src);
+      return;
+    }
+
+    bool copied = copyRange(src, 0, dst, 0, st.st_size);
+    close(src);
+    if (close(dst) != 0 || !copied) {
+      cout << "Error: Cannot write '" << args[2] << "': " << strerror(errno)
+           << endl;
+      return;
+    }
+#endif
+    cout << "File copied: " << args[1] << " -> " << args[2] << endl;
+  }
+
+#ifndef _WIN32
+  // True if path lies below dir; both must be canonical
+  static bool pathInside(const string &path, const string &dir) {
+    string prefix = dir == "/" ? dir : dir + "/";
+    return path.size() > prefix.size() &&
+           path.compare(0, prefix.size(), prefix) == 0;
+  }
+
+  // mirror [--delete] <src> <dst>
+  void builtinMirror(const vector<string> &args) {
+    static const size_t LISTED_RESULTS = 10;
+    bool remove_extra = false;
+    vector<string> dirs;
+    for (size_t i = 1; i < args.size(); i++) {
+      if (args[i] == "--delete")
+        remove_extra = true;
+      else
+        dirs.push_back(args[i]);
+    }
+    if (dirs.size() != 2) {
+      cout << "Usage: mirror [--delete] <source dir> <destination dir>" << endl;
+      return;
+    }
+    for (string &dir : dirs) {
+      while (dir.size() > 1 && dir.back() == '/')
+        dir.pop_back();
+    }
+    const string &src = dirs[0], &dst = dirs[1];
+    if (!directoryExists(src)) {
+      cout << "Error: '" << src << "' is not a directory" << endl;
+      return;
+    }
+    if (mkdir(dst.c_str(), 0777) != 0 && errno != EEXIST) {
+      cout << "Error: Cannot create directory '" << dst
+           << "': " << strerror(errno) << endl;
+      return;
+    }
+    char src_real[PATH_MAX], dst_real[PATH_MAX];
+    if (!directoryExists(dst) || !realpath(src.c_str(), src_real) ||
+        !realpath(dst.c_str(), dst_real)) {
+      cout << "Error: '" << dst << "' is not a directory" << endl;
+      return;
+    }
+    // Either way round, --delete or the copy itself would eat the source
+    if (strcmp(src_real, dst_real) == 0 || pathInside(dst_real, src_real)) {
+      cout << "Error: The destination cannot be inside the source" << endl;
+      return;
+    }
+    if (pathInside(src_real, dst_real)) {
+      cout << "Error: The source cannot be inside the destination" << endl;
+      return;
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<MirrorEntry> entries;
+    size_t unreadable = 0;
+    if (!DirectoryMirror::walk(src, entries, unreadable)) {
+      cout << "Error: Cannot read '" << src << "': " << strerror(errno)
+           << endl;
+      return;
+    }
+
+    // Directories first, in walk order, so every file has somewhere to go
+    vector<MirrorEntry *> files;
+    for (MirrorEntry &entry : entries) {
+      if (S_ISDIR(entry.mode))
+        DirectoryMirror::sync(src, dst, entry);
+      else
+        files.push_back(&entry);
+    }
+
+    // Comparing is mostly stat calls and copying mostly waiting on the
+    // disk, so use more threads than cores
+    unsigned count = (unsigned)min<size_t>(
+        files.size(), min(16u, max(4u, 2 * thread::hardware_concurrency())));
+    atomic<size_t> next(0), done(0);
+    vector<thread> workers;
+    for (unsigned t = 0; t < count; t++) {
+      workers.push_back(thread([&]() {
+        blockThreadSignals();
+        size_t i;
+        while ((i = next++) < files.size()) {
+          DirectoryMirror::sync(src, dst, *files[i]);
+          done++;
+        }
+      }));
+    }
+    bool show_progress = isatty(STDOUT_FILENO) != 0;
+    bool progress_shown = false;
+    chrono::steady_clock::time_point last_report = start;
+    while (done.load() < files.size()) {
+      this_thread::sleep_for(chrono::milliseconds(5));
+      chrono::steady_clock::time_point now = chrono::steady_clock::now();
+      if (show_progress && now - last_report >= chrono::milliseconds(100) &&
+          done.load() < files.size()) {
+        cout << "\rMirroring " << done.load() << "/" << files.size() << flush;
+        progress_shown = true;
+        last_report = now;
+      }
+    }
+    for (thread &worker : workers)
+      worker.join();
+    if (progress_shown)
+      cout << "\r\033[K";
+
+    // Like rsync, don't delete after an error: an unread source directory
+    // would make everything under its destination look extra
+    bool source_failed = unreadable > 0;
+    for (const MirrorEntry &entry : entries)
+      source_failed = source_failed || entry.error != 0;
+    vector<BulkOp> removals;
+    if (remove_extra && !source_failed) {
+      set<string> wanted;
+      for (const MirrorEntry &entry : entries)
+        wanted.insert(entry.path);
+      vector<MirrorEntry> existing;
+      DirectoryMirror::walk(dst, existing, unreadable);
+      for (const MirrorEntry &entry : existing) {
+        if (wanted.count(entry.path))
+          continue;
+        BulkOp op;
+        op.from = dst + "/" + entry.path;
+        op.is_dir = S_ISDIR(entry.mode);
+        removals.push_back(op);
+      }
+      BulkFileOps::run(removals, [](size_t) {});
+    }
+
+    size_t copied = 0, updated = 0, unchanged = 0, failed = 0;
+    uint64_t total_bytes = 0, literal_bytes = 0;
+    vector<string> errors;
+    for (const MirrorEntry *entry : files) {
+      if (S_ISREG(entry->mode))
+        total_bytes += entry->size;
+      literal_bytes += entry->literal_bytes;
+      if (entry->error) {
+        failed++;
+        errors.push_back(entry->path + ": " + strerror(entry->error));
+      } else if (entry->action == MIRROR_COPIED) {
+        copied++;
+      } else if (entry->action == MIRROR_UPDATED) {
+        updated++;
+      } else {
+        unchanged++;
+      }
+    }
+    for (const MirrorEntry &entry : entries) {
+      if (S_ISDIR(entry.mode) && entry.error)
+        errors.push_back(entry.path + ": " + strerror(entry.error));
+    }
+    for (const BulkOp &op : removals) {
+      if (op.error)
+        errors.push_back(op.from + ": " + strerror(op.error));
+    }
+
+    if (copied + updated <= LISTED_RESULTS) {
+      for (const MirrorEntry *entry : files) {
+        if (entry->error || entry->action == MIRROR_UNCHANGED)
+          continue;
+        if (entry->action == MIRROR_COPIED)
+          cout << "Copied: " << entry->path << endl;
+        else
+          cout << "Updated: " << entry->path << " ("
+               << formatBytes(entry->literal_bytes) << " of "
+               << formatBytes(entry->size) << " changed)" << endl;
+      }
     }
-
-    dst << src.rdbuf();
-    src.close();
-    dst.close();
-    cout << "File copied: " << args[1] << " -> " << args[2] << endl;
+    cout << "Mirrored " << src << " -> " << dst << " in "
+         << formatDuration(elapsedNanos(start, chrono::steady_clock::now()))
+         << ": " << copied << " copied, " << updated << " updated, "
+         << unchanged << " unchanged";
+    if (remove_extra && !source_failed)
+      cout << ", " << removals.size() << " removed";
+    cout << endl;
+    cout << "Copied " << formatBytes(literal_bytes) << " of "
+         << formatBytes(total_bytes) << " from the source ("
+         << formatBytes(total_bytes - literal_bytes) << " saved)" << endl;
+    for (size_t i = 0; i < errors.size() && i < 5; i++)
+      cout << "  Error: " << errors[i] << endl;
+    if (errors.size() > 5)
+      cout << "  ... and " << errors.size() - 5 << " more errors" << endl;
+    if (unreadable > 0)
+      cout << unreadable << " files or directories could not be read" << endl;
+    if (remove_extra && source_failed)
+      cout << "Nothing was removed from " << dst << " because of errors"
+           << endl;
+    last_status = errors.empty() && unreadable == 0 ? 0 : 1;
   }
+#endif
 
   void builtinMove(const vector<string> &args) {
     if (args.size() < 3) {
-      cout << "Usage: move <source> <destination>" << endl;
+      cout << "Usage: move <source>... <destination>" << endl;
       return;
     }
 
+#ifdef _WIN32
     if (rename(args[1].c_str(), args[2].c_str()) == 0) {
       cout << "File moved: " << args[1] << " -> " << args[2] << endl;
     } else {
       cout << "Error: Cannot move file" << endl;
     }
+#else
+    vector<string> sources;
+    if (!expandPaths(args, 1, args.size() - 1, sources))
+      return;
+    const string &target = args.back();
+    bool into_dir = directoryExists(target);
+    if (sources.size() > 1 && !into_dir) {
+      cout << "Error: Target '" << target << "' is not a directory" << endl;
+      return;
+    }
+    vector<BulkOp> ops(sources.size());
+    for (size_t i = 0; i < sources.size(); i++) {
+      ops[i].from = sources[i];
+      ops[i].is_dir = false;
+      if (into_dir) {
+        size_t slash = sources[i].find_last_of('/');
+        ops[i].to = target + "/" +
+                    (slash == string::npos ? sources[i]
+                                           : sources[i].substr(slash + 1));
+      } else {
+        ops[i].to = target;
+      }
+    }
+    // The moves run in parallel, so two sources with the same name would
+    // silently overwrite each other in the target
+    map<string, size_t> claimed;
+    for (size_t i = 0; i < ops.size(); i++) {
+      auto it = claimed.insert(make_pair(ops[i].to, i)).first;
+      if (it->second != i) {
+        cout << "Error: '" << ops[it->second].from << "' and '"
+             << ops[i].from << "' would both be moved to '" << ops[i].to
+             << "'" << endl;
+        last_status = 1;
+        return;
+      }
+    }
+    runBulkOps(ops, "Moving", "Moved", "File moved: ", "Cannot move");
+#endif
   }
 
   void builtinPrint(const vector<string> &args) {
@@ -411,10 +7829,15 @@ private:
     cout << "  list, show, files        - Show files in directory" << endl;
     cout << "  where, whereami          - Show current path" << endl;
     cout << "  goto, go <dir>           - Change directory" << endl;
+    cout << "  goto <part of name>      - Jump to a visited directory" << endl;
+    cout << "  goto -l [part of name]   - List matching visited dirs" << endl;
     cout << "  makedir <name>           - Create directory" << endl;
-    cout << "  remove, delete <file>    - Delete file" << endl;
+    cout << "  remove, delete <files>   - Delete files (globs: * ? [] **)"
+         << endl;
     cout << "  copy <src> <dest>        - Copy file" << endl;
-    cout << "  move, rename <old> <new> - Move/rename file" << endl;
+    cout << "  mirror <src> <dst>       - Sync a folder, sending only changes"
+         << endl;
+    cout << "  move, rename <old> <new> - Move/rename file(s)" << endl;
     cout << "  read, view <file>        - Display file contents" << endl;
     cout << "  find, search <name>      - Find files" << endl;
     cout << "  edit <file>              - Edit file" << endl;
@@ -426,14 +7849,24 @@ private:
     cout << "  sort, order              - Sort lines" << endl;
     cout << "  first, top <file>        - Show first lines" << endl;
     cout << "  last, bottom <file>      - Show last lines" << endl;
+    cout << "  query <file> select ...  - Query a CSV/TSV file (where, group by)"
+         << endl;
 
     cout << "\nSYSTEM COMMANDS:" << endl;
     cout << "  who, whoami, me          - Show current user" << endl;
     cout << "  when, time, now          - Show date/time" << endl;
     cout << "  running, processes       - Show running programs" << endl;
+    cout << "  running --live           - Live view, sorted by cpu/memory"
+         << endl;
+    cout << "  stop <name|pid>          - Stop running programs" << endl;
     cout << "  diskspace, space         - Show disk space" << endl;
+    cout << "  usage [dir] [-n N]       - Largest folders (cached)" << endl;
+    cout << "  checksum [--sha256] <f>  - Hash files (xxh64, cached)" << endl;
+    cout << "  dupes [dir] [--sha256]   - Find duplicate files" << endl;
     cout << "  memory, ram              - Show memory usage" << endl;
     cout << "  system                   - Show system info" << endl;
+    cout << "  sysinfo [--sample <s>]   - System summary or CPU/PSI sample"
+         << endl;
     cout << "  clear, clean             - Clear screen" << endl;
 
     cout << "\nNEOSHELL FEATURES:" << endl;
@@ -444,8 +7877,19 @@ private:
     cout << "  note <text>              - Quick note" << endl;
     cout << "  todo add/list/done       - Manage tasks" << endl;
     cout << "  history                  - Command history" << endl;
-    cout << "  stats                    - Session statistics" << endl;
+    cout << "  output on|<n>|search <t> - Keep, show or search past output"
+         << endl;
+    cout << "  stats [json|reset]       - Session statistics" << endl;
     cout << "  theme <name>             - Change theme" << endl;
+    cout << "  trace on <file>/off      - Record a Chrome trace" << endl;
+    cout << "  record on <file>/off     - Record session for replay" << endl;
+    cout << "  parallel <cmd> ::: <in>  - Run cmd per input (-j N at once)"
+         << endl;
+    cout << "  each <cmd> ::: <in>      - Same, output in input order" << endl;
+    cout << "  onchange <paths> -- cmd  - Rerun cmd when files change"
+         << endl;
+    cout << "  watch [-n s] <cmd>       - Rerun cmd, redraw what changed"
+         << endl;
 
     cout << "\nADVANCED:" << endl;
     cout << "  !!                       - Repeat last command" << endl;
@@ -458,6 +7902,7 @@ private:
     if (args.size() > 1) {
       if (args[1] == "clear") {
         history.clear();
+        output_capture.clear();
         cout << "History cleared." << endl;
         return;
       } else if (args[1] == "search" && args.size() > 2) {
@@ -484,6 +7929,120 @@ private:
     cout << endl;
   }
 
+  // output [n|last] | output search <text> | output on [size] | off
+  // output limit <size> | clear
+  void builtinOutput(const vector<string> &args) {
+    // Looking at old output is not itself worth keeping
+    output_capture.discard();
+    const deque<CapturedCommand> &captured = output_capture.commands();
+
+    if (args.size() == 1) {
+      if (output_capture.limitBytes() == 0) {
+        cout << "Output capture is off; 'output on' keeps what later "
+                "commands print"
+             << endl;
+        return;
+      }
+      if (captured.empty()) {
+        cout << "No output captured yet" << endl;
+        return;
+      }
+      size_t start = captured.size() > 20 ? captured.size() - 20 : 0;
+      for (size_t i = start; i < captured.size(); i++) {
+        const CapturedCommand &entry = captured[i];
+        cout << setw(4) << entry.number << ": " << entry.command << "  ("
+             << formatBytes(entry.bytes)
+             << (entry.truncated ? ", start dropped" : "") << ")" << endl;
+      }
+      cout << "Keeping " << formatBytes(output_capture.storedBytes())
+           << " of " << formatBytes(output_capture.limitBytes()) << endl;
+    } else if (args[1] == "search" && args.size() > 2) {
+      string pattern = args[2];
+      for (size_t i = 3; i < args.size(); i++)
+        pattern += " " + args[i];
+      size_t matches = 0;
+      for (const CapturedCommand &entry : captured) {
+        bool shown = false;
+        string carry;
+        auto check = [&](const string &line) {
+          if (line.find(pattern) == string::npos)
+            return;
+          if (!shown)
+            cout << "#" << entry.number << ": " << entry.command << endl;
+          shown = true;
+          matches++;
+          cout << "  " << line << endl;
+        };
+        output_capture.read(entry, [&](const char *data, size_t size) {
+          const char *end = data + size;
+          while (data < end) {
+            const char *newline = (const char *)memchr(data, '\n', end - data);
+            if (!newline) {
+              carry.append(data, end);
+              break;
+            }
+            carry.append(data, newline);
+            if (!carry.empty() && carry.back() == '\r')
+              carry.pop_back();
+            check(carry);
+            carry.clear();
+            data = newline + 1;
+          }
+        });
+        if (!carry.empty())
+          check(carry);
+      }
+      if (matches == 0)
+        cout << "No captured output contains '" << pattern << "'" << endl;
+    } else if (args[1] == "on" || args[1] == "off" || args[1] == "limit") {
+      uint64_t bytes = args[1] == "on" ? OutputCapture::DEFAULT_LIMIT : 0;
+      if ((args[1] == "limit" || (args[1] == "on" && args.size() > 2)) &&
+          (args.size() < 3 || !parseBytes(args[2], bytes))) {
+        cout << "Usage: output on [size] | output off | output limit <size>"
+             << endl;
+        return;
+      }
+      output_capture.setLimit(bytes);
+      // Capturing puts every external command's output through a pipe, so
+      // it is only hooked up while wanted
+      output_tee.removeSink(&output_capture);
+      if (bytes > 0) {
+        output_tee.addSink(&output_capture);
+        cout << "Keeping up to " << formatBytes(bytes)
+             << " of command output" << endl;
+      } else {
+        cout << "Output capture is off" << endl;
+      }
+    } else if (args[1] == "clear") {
+      output_capture.clear();
+      cout << "Captured output cleared" << endl;
+    } else {
+      const CapturedCommand *entry =
+          args[1] == "last"
+              ? (captured.empty() ? NULL : &captured.back())
+              : output_capture.find(strtoul(args[1].c_str(), NULL, 10));
+      if (!entry) {
+        cout << "No captured output for '" << args[1] << "'" << endl;
+        cout << "Usage: output [<n>|last|search <text>|limit <size>|clear]"
+             << endl;
+        return;
+      }
+      if (entry->truncated)
+        cout << "(earlier output was dropped to stay within "
+             << formatBytes(output_capture.limitBytes()) << ")" << endl;
+      char last = '\n';
+      bool ok = output_capture.read(*entry, [&](const char *data, size_t size) {
+        cout.write(data, size);
+        last = data[size - 1];
+      });
+      if (last != '\n')
+        cout << endl;
+      if (!ok)
+        cout << "Error: Captured output of #" << entry->number
+             << " is damaged" << endl;
+    }
+  }
+
   void handleBookmark(const vector<string> &args) {
     if (args.size() < 2) {
       cout << "Usage:" << endl;
@@ -511,12 +8070,11 @@ private:
     } else if (args[1] == "go" && args.size() > 2) {
       if (bookmarks.find(args[2]) != bookmarks.end()) {
         string path = bookmarks[args[2]];
-#ifdef _WIN32
-        SetCurrentDirectoryA(path.c_str());
-#else
-        chdir(path.c_str());
-#endif
-        cout << "Jumped to: " << path << endl;
+        if (changeDirectory(path)) {
+          cout << "Jumped to: " << path << endl;
+        } else {
+          cout << "Cannot access directory: " << path << endl;
+        }
       } else {
         cout << "Bookmark '" << args[2] << "' not found" << endl;
       }
@@ -628,7 +8186,62 @@ private:
     }
   }
 
-  void showStats() {
+  string statsJson() {
+    stringstream ss;
+    ss << "{\"command_count\":" << command_count
+       << ",\"session_seconds\":" << (long)difftime(time(0), session_start)
+       << ",\"stages\":{";
+    for (int i = 0; i < STAGE_COUNT; i++) {
+      ss << (i ? "," : "") << "\"" << STAGE_NAMES[i]
+         << "\":" << stage_totals[i].toJson();
+    }
+    ss << "},\"commands\":{";
+    bool first = true;
+    for (const auto &pair : command_timings) {
+      ss << (first ? "" : ",") << "\"" << jsonEscape(pair.first)
+         << "\":{\"total\":" << pair.second.total.toJson()
+         << ",\"stages\":{";
+      for (int i = 0; i < STAGE_COUNT; i++) {
+        ss << (i ? "," : "") << "\"" << STAGE_NAMES[i]
+           << "\":" << pair.second.stages[i].toJson();
+      }
+      ss << "}}";
+      first = false;
+    }
+    ss << "}}";
+    return ss.str();
+  }
+
+  void printLatencyRow(const string &label, const LatencyHistogram &hist) {
+    cout << "    " << left << setw(14) << label << right << setw(7)
+         << hist.samples() << "  " << setw(9)
+         << formatDuration(hist.percentile(50)) << " " << setw(9)
+         << formatDuration(hist.percentile(99)) << " " << setw(9)
+         << formatDuration(hist.maximum()) << endl;
+  }
+
+  void showStats(const vector<string> &args) {
+    if (args.size() > 1 && args[1] == "reset") {
+      for (int i = 0; i < STAGE_COUNT; i++)
+        stage_totals[i].reset();
+      command_timings.clear();
+      cout << "Latency statistics reset" << endl;
+      return;
+    } else if (args.size() > 1 && args[1] == "json") {
+      if (args.size() < 3) {
+        cout << statsJson() << endl;
+        return;
+      }
+      ofstream file(args[2]);
+      if (!file.is_open()) {
+        cout << "Error: Cannot write to '" << args[2] << "'" << endl;
+        return;
+      }
+      file << statsJson() << endl;
+      cout << "Statistics exported to " << args[2] << endl;
+      return;
+    }
+
     time_t now = time(0);
     int session_time = difftime(now, session_start);
 
@@ -641,6 +8254,224 @@ private:
     cout << "  Bookmarks: " << bookmarks.size() << endl;
     cout << "  Variables: " << env_vars.size() << endl;
     cout << "  Todo items: " << todo_list.size() << endl;
+
+    if (!command_timings.empty()) {
+      cout << "\n  Latency by stage:        count        p50       p99       max"
+           << endl;
+      for (int i = 0; i < STAGE_COUNT; i++) {
+        printLatencyRow(STAGE_NAMES[i], stage_totals[i]);
+      }
+
+      cout << "\n  Latency by command:      count        p50       p99       max"
+           << endl;
+      for (const auto &pair : command_timings) {
+        printLatencyRow(pair.first, pair.second.total);
+        for (int i = 0; i < STAGE_COUNT; i++) {
+          if (i != STAGE_READ && pair.second.stages[i].maximum() > 0) {
+            printLatencyRow("  " + string(STAGE_NAMES[i]),
+                            pair.second.stages[i]);
+          }
+        }
+      }
+      cout << "\n  Use 'stats json [file]' to export, 'stats reset' to clear"
+           << endl;
+    }
+    cout << endl;
+  }
+
+  void handleTrace(const vector<string> &args) {
+    if (args.size() > 2 && args[1] == "on") {
+      if (tracer.start(args[2])) {
+        cout << "Tracing to " << args[2]
+             << " (open in chrome://tracing or ui.perfetto.dev)" << endl;
+      } else {
+        cout << "Error: Cannot write trace file '" << args[2] << "'" << endl;
+      }
+    } else if (args.size() > 1 && args[1] == "off") {
+      if (!tracer.active()) {
+        cout << "Tracing is not enabled" << endl;
+        return;
+      }
+      tracer.stop();
+      cout << "Trace written: " << tracer.path() << " ("
+           << tracer.eventsWritten() << " events";
+      if (tracer.eventsDropped() > 0)
+        cout << ", " << tracer.eventsDropped() << " dropped";
+      cout << ")" << endl;
+    } else if (args.size() > 1 && args[1] == "status") {
+      if (tracer.active()) {
+        cout << "Tracing to " << tracer.path() << ": "
+             << tracer.eventsWritten() << " events written, "
+             << tracer.eventsDropped() << " dropped" << endl;
+      } else {
+        cout << "Tracing is off" << endl;
+      }
+    } else {
+      cout << "Usage:" << endl;
+      cout << "  trace on <file>    - Start recording spans to a trace file"
+           << endl;
+      cout << "  trace off          - Stop and finish the trace file" << endl;
+      cout << "  trace status       - Show tracing state" << endl;
+    }
+  }
+
+  void handleRecord(const vector<string> &args) {
+    if (args.size() > 2 && args[1] == "on") {
+      if (startRecording(args[2])) {
+        cout << "Recording session to " << args[2] << endl;
+      } else {
+        cout << "Error: Cannot write session log '" << args[2] << "'" << endl;
+      }
+    } else if (args.size() > 1 && args[1] == "off") {
+      if (!recorder.active()) {
+        cout << "Not recording" << endl;
+        return;
+      }
+      stopRecording();
+      cout << "Session saved to " << recorder.path() << endl;
+    } else if (args.size() > 1 && args[1] == "status") {
+      if (recorder.active()) {
+        cout << "Recording to " << recorder.path() << endl;
+      } else {
+        cout << "Not recording" << endl;
+      }
+    } else {
+      cout << "Usage:" << endl;
+      cout << "  record on <file>   - Record this session to a log" << endl;
+      cout << "  record off         - Stop recording" << endl;
+      cout << "  record status      - Show recording state" << endl;
+      cout << "Replay a log with: neoshell --replay <file> [--timed]" << endl;
+    }
+  }
+
+  void stopRecording() {
+    if (!recorder.active())
+      return;
+    recorder.stop();
+    if (!replaying)
+      output_tee.removeSink(&output_counter);
+  }
+
+  // Next line of input: from the replay log if one is loaded, else stdin.
+  // In timed mode the recorded gaps between commands are reproduced.
+  bool readInput(string &input) {
+    if (!replaying)
+      return (bool)getline(cin, input);
+    if (replay_next >= replay_commands.size())
+      return false;
+
+    ReplayCommand &next = replay_commands[replay_next++];
+    if (replay_timed) {
+      this_thread::sleep_until(replay_start +
+                               chrono::microseconds(next.at_us));
+    }
+    input = next.input;
+    cout << input << endl;
+    return true;
+  }
+
+  uint64_t commandNanos() const {
+    uint64_t total = 0;
+    for (int i = STAGE_EXPAND; i < STAGE_COUNT; i++)
+      total += stage_ns[i];
+    return total;
+  }
+
+  void finishCommand() {
+    last_command_ns = commandNanos();
+    if (recorder.active()) {
+      recorder.result(output_counter.bytes, commandNanos(), last_status);
+      recorder.cwd(getCurrentPath());
+    }
+    if (replaying && replay_next > 0) {
+      ReplayCommand &current = replay_commands[replay_next - 1];
+      current.replayed_result = true;
+      current.replayed_bytes = output_counter.bytes;
+      current.replayed_us = commandNanos() / 1000;
+      current.replayed_status = (uint64_t)(last_status < 0 ? 0 : last_status);
+      current.replayed_cwd = getCurrentPath();
+    }
+  }
+
+  void printReplayReport() {
+    uint64_t recorded_us = 0, replayed_us = 0;
+    uint64_t recorded_bytes = 0, replayed_bytes = 0;
+    size_t compared = 0;
+    vector<string> mismatches;
+    vector<pair<double, size_t>> slowdowns;
+
+    for (size_t i = 0; i < replay_next; i++) {
+      const ReplayCommand &c = replay_commands[i];
+      if (!c.recorded_result || !c.replayed_result)
+        continue;
+      compared++;
+      recorded_us += c.recorded_us;
+      replayed_us += c.replayed_us;
+      recorded_bytes += c.recorded_bytes;
+      replayed_bytes += c.replayed_bytes;
+
+      stringstream ss;
+      if (c.recorded_bytes != c.replayed_bytes) {
+        ss << "    #" << (i + 1) << " " << c.input << ": output "
+           << c.recorded_bytes << " -> " << c.replayed_bytes << " bytes";
+        mismatches.push_back(ss.str());
+      }
+      if (c.recorded_status != c.replayed_status) {
+        ss.str("");
+        ss << "    #" << (i + 1) << " " << c.input << ": status "
+           << c.recorded_status << " -> " << c.replayed_status;
+        mismatches.push_back(ss.str());
+      }
+      if (!c.recorded_cwd.empty() && c.recorded_cwd != c.replayed_cwd) {
+        ss.str("");
+        ss << "    #" << (i + 1) << " " << c.input << ": cwd "
+           << c.recorded_cwd << " -> " << c.replayed_cwd;
+        mismatches.push_back(ss.str());
+      }
+      if (c.recorded_us >= 1000 || c.replayed_us >= 1000) {
+        slowdowns.push_back(make_pair(
+            (double)c.replayed_us / max(c.recorded_us, (uint64_t)1), i));
+      }
+    }
+
+    uint64_t wall_us =
+        elapsedNanos(replay_start, chrono::steady_clock::now()) / 1000;
+    cout << "\n=== Replay Report ===" << endl;
+    cout << "  Commands replayed: " << replay_next << " of "
+         << replay_commands.size() << " (" << compared << " compared)"
+         << endl;
+    cout << "  Command time: " << formatDuration(recorded_us * 1000)
+         << " recorded, " << formatDuration(replayed_us * 1000) << " replayed"
+         << endl;
+    if (wall_us > 0) {
+      cout << "  Throughput: " << fixed << setprecision(1)
+           << replay_next * 1e6 / wall_us << " commands/sec" << endl;
+      cout.unsetf(ios::floatfield);
+      cout << setprecision(6);
+    }
+    cout << "  Output: " << recorded_bytes << " bytes recorded, "
+         << replayed_bytes << " bytes replayed" << endl;
+
+    if (mismatches.empty()) {
+      cout << "  No output, status or directory differences" << endl;
+    } else {
+      cout << "  Differences:" << endl;
+      for (const string &line : mismatches)
+        cout << line << endl;
+    }
+
+    sort(slowdowns.rbegin(), slowdowns.rend());
+    if (!slowdowns.empty() && slowdowns[0].first > 1.0) {
+      cout << "  Slower than recorded:" << endl;
+      for (size_t i = 0; i < min(size_t(5), slowdowns.size()); i++) {
+        if (slowdowns[i].first <= 1.0)
+          break;
+        const ReplayCommand &c = replay_commands[slowdowns[i].second];
+        cout << "    #" << (slowdowns[i].second + 1) << " " << c.input << ": "
+             << formatDuration(c.recorded_us * 1000) << " -> "
+             << formatDuration(c.replayed_us * 1000) << endl;
+      }
+    }
     cout << endl;
   }
 
@@ -784,8 +8615,44 @@ private:
 
     info.push_back(BOLD + GREEN + username + "@" + string(hostname) + RESET);
     info.push_back(string(30, '-'));
+#ifdef __linux__
+    struct utsname uts;
+    uname(&uts);
+    long uptime = (long)system_metrics.uptime();
+    const MemoryInfo &mem = system_metrics.memory();
+    char loadavg[64] = "";
+    readProcFile("/proc/loadavg", loadavg, sizeof(loadavg));
+    const char *load_end = loadavg;
+    for (int i = 0; i < 3; i++)
+      skipField(load_end, loadavg + strlen(loadavg));
+
+    info.push_back(YELLOW + "OS: " + RESET + osName());
+    info.push_back(YELLOW + "Kernel: " + RESET + string(uts.release));
+    info.push_back(YELLOW + "Host: " + RESET + string(hostname));
+    info.push_back(YELLOW + "Uptime: " + RESET +
+                   (uptime >= 86400 ? to_string(uptime / 86400) + "d " : "") +
+                   to_string(uptime % 86400 / 3600) + "h " +
+                   to_string(uptime % 3600 / 60) + "m");
+    info.push_back(YELLOW + "CPU: " + RESET + system_metrics.cpuModel() +
+                   " (" + to_string(sysconf(_SC_NPROCESSORS_ONLN)) +
+                   " cores)");
+    info.push_back(YELLOW + "Memory: " + RESET +
+                   formatBytes(mem.total - mem.available) + " / " +
+                   formatBytes(mem.total));
+    info.push_back(YELLOW + "Load: " + RESET +
+                   string(loadavg, load_end - loadavg));
+    struct statvfs root;
+    if (statvfs("/", &root) == 0) {
+      uint64_t size = (uint64_t)root.f_blocks * root.f_frsize;
+      uint64_t free_bytes = (uint64_t)root.f_bfree * root.f_frsize;
+      info.push_back(YELLOW + "Disk (/): " + RESET +
+                     formatBytes(size - free_bytes) +
+                     " / " + formatBytes(size));
+    }
+#else
     info.push_back(YELLOW + "OS: " + RESET + "Unix/Linux");
     info.push_back(YELLOW + "Host: " + RESET + string(hostname));
+#endif
     info.push_back(YELLOW + "Shell: " + RESET + CYAN + "NeoShell v3.0" + RESET);
 #endif
 
@@ -821,33 +8688,256 @@ private:
     cout << "\n\n";
   }
 
-  string getPrompt() {
-    string path = getCurrentPath();
-    string prompt;
-
+  void compilePromptTheme() {
+    string format;
     if (current_theme == "cyber") {
-      prompt = "[" + username + "@neo] " + path + "\n> ";
+      format = "[{user}@neo] {cwd}{vcs}{duration}\n> ";
     } else if (current_theme == "minimal") {
-      prompt = "$ ";
+      format = "$ ";
     } else {
-      prompt = username + "@neoshell " + path + "\n> ";
+      format = "{user}@neoshell {cwd}{vcs}{duration}\n> ";
     }
+    if (show_timestamps)
+      format = "[{time}] " + format;
+    prompt_segments = compilePrompt(format);
+  }
 
-    if (show_timestamps) {
-      prompt = "[" + getCurrentTime() + "] " + prompt;
+  string getPrompt() {
+    string prompt;
+    for (const PromptSegment &segment : prompt_segments) {
+      switch (segment.kind) {
+      case PROMPT_TEXT:
+        prompt += segment.text;
+        break;
+      case PROMPT_TIME:
+        prompt += getCurrentTime();
+        break;
+      case PROMPT_USER:
+        prompt += username;
+        break;
+      case PROMPT_CWD:
+        prompt += getCurrentPath();
+        break;
+      case PROMPT_VCS: {
+        VcsStatus status;
+        if (prompt_vcs && vcs_status.lookup(getCurrentPath(),
+                                            PROMPT_VCS_BUDGET_MS, status)) {
+          prompt += " (" + status.branch + (status.dirty ? "*)" : ")");
+        }
+        break;
+      }
+      case PROMPT_DURATION:
+        if (last_command_ns >= PROMPT_DURATION_THRESHOLD_NS)
+          prompt += " took " + formatDuration(last_command_ns);
+        break;
+      }
     }
-
     return prompt;
   }
 
+#ifdef __linux__
+  enum DaemonRole {
+    DAEMON_LISTENER,
+    DAEMON_SIGNALS,
+    DAEMON_CLIENT,
+    DAEMON_STATE
+  };
+
+  static void watchFd(int poller, int fd, DaemonRole role, uint64_t id) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = (id << 2) | role;
+    epoll_ctl(poller, EPOLL_CTL_ADD, fd, &event);
+  }
+
+  // Forks a session onto the client's fds. Returns true in the child.
+  bool forkSession(DaemonSession &session, const string &cwd, int fds[3],
+                   map<uint64_t, DaemonSession> &sessions,
+                   const sigset_t &saved_mask, void (*saved_pipe)(int)) {
+    int state_pipe[2];
+    if (!makePipe(state_pipe)) {
+      for (int i = 0; i < 3; i++)
+        close(fds[i]);
+      int32_t code = 1;
+      writeAll(session.conn, (const char *)&code, sizeof(code));
+      close(session.conn);
+      session.conn = -1;
+      return false;
+    }
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+      for (auto &entry : sessions) {
+        if (entry.second.conn >= 0 && &entry.second != &session)
+          close(entry.second.conn);
+        if (entry.second.state_fd >= 0)
+          close(entry.second.state_fd);
+      }
+      close(session.conn);
+      close(state_pipe[0]);
+      sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+      signal(SIGPIPE, saved_pipe);
+      // Our own session, so a forwarded Ctrl-C reaches the session's
+      // commands. It takes the client's terminal as its controlling
+      // terminal if that is free, and otherwise gets a pty of its own.
+      setsid();
+      for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+        if (fds[i] > 2)
+          close(fds[i]);
+      }
+      if (isatty(STDIN_FILENO) && ioctl(STDIN_FILENO, TIOCSCTTY, 0) != 0)
+        startSessionTerminal();
+      if (!cwd.empty() && chdir(cwd.c_str()) != 0) {
+      }
+      session_state_fd = state_pipe[1];
+      fcntl(session_state_fd, F_SETFD, FD_CLOEXEC);
+      startSession();
+      return true;
+    }
+
+    for (int i = 0; i < 3; i++)
+      close(fds[i]);
+    close(state_pipe[1]);
+    if (pid < 0) {
+      close(state_pipe[0]);
+      int32_t code = 1;
+      writeAll(session.conn, (const char *)&code, sizeof(code));
+      close(session.conn);
+      session.conn = -1;
+      return false;
+    }
+    fcntl(state_pipe[0], F_SETFL, O_NONBLOCK);
+    session.pid = pid;
+    session.state_fd = state_pipe[0];
+    return false;
+  }
+
+  void startSession() {
+    cwd_valid = false;
+    prompt_vcs = isatty(STDIN_FILENO) != 0;
+    session_history_base = history.size();
+    visited_dirs.startAging();
+  }
+
+  void reapSessions(int poller, map<uint64_t, DaemonSession> &sessions,
+                    map<pid_t, uint64_t> &session_ids) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      auto found = session_ids.find(pid);
+      if (found == session_ids.end())
+        continue;
+      auto it = sessions.find(found->second);
+      session_ids.erase(found);
+      if (it == sessions.end())
+        continue;
+      DaemonSession &session = it->second;
+      session.pid = -1;
+      // The session has written all its state by now; take it before the
+      // client hears back, so its next session already sees the changes
+      if (session.state_fd >= 0) {
+        char buffer[65536];
+        ssize_t n;
+        while ((n = read(session.state_fd, buffer, sizeof(buffer))) > 0)
+          session.state.append(buffer, n);
+        epoll_ctl(poller, EPOLL_CTL_DEL, session.state_fd, NULL);
+        close(session.state_fd);
+        session.state_fd = -1;
+        importState(session.state);
+      }
+      if (session.conn >= 0) {
+        int32_t code = WIFEXITED(status) ? WEXITSTATUS(status)
+                                         : 128 + WTERMSIG(status);
+        writeAll(session.conn, (const char *)&code, sizeof(code));
+        epoll_ctl(poller, EPOLL_CTL_DEL, session.conn, NULL);
+        close(session.conn);
+        session.conn = -1;
+      }
+      sessions.erase(it);
+    }
+  }
+
+  // Aliases, bookmarks, variables and todos are sent whole and replace the
+  // daemon's copy; history only sends what the session added
+  string exportState() {
+    string state;
+    for (const auto &entry : aliases)
+      state += "alias\t" + entry.first + "\t" + entry.second + "\n";
+    for (const auto &entry : bookmarks)
+      state += "bookmark\t" + entry.first + "\t" + entry.second + "\n";
+    for (const auto &entry : env_vars)
+      state += "env\t" + entry.first + "\t" + entry.second + "\n";
+    for (const string &item : todo_list)
+      state += "todo\t\t" + item + "\n";
+    for (size_t i = session_history_base; i < history.size(); i++)
+      state += "history\t\t" + history[i] + "\n";
+    return state;
+  }
+
+  void importState(const string &state) {
+    if (state.empty())
+      return;
+    aliases.clear();
+    bookmarks.clear();
+    env_vars.clear();
+    todo_list.clear();
+    stringstream ss(state);
+    string line;
+    while (getline(ss, line)) {
+      size_t tab = line.find('\t');
+      size_t value_tab = tab == string::npos ? tab : line.find('\t', tab + 1);
+      if (value_tab == string::npos)
+        continue;
+      string tag = line.substr(0, tab);
+      string key = line.substr(tab + 1, value_tab - tab - 1);
+      string value = line.substr(value_tab + 1);
+      if (tag == "alias")
+        aliases[key] = value;
+      else if (tag == "bookmark")
+        bookmarks[key] = value;
+      else if (tag == "env")
+        env_vars[key] = value;
+      else if (tag == "todo")
+        todo_list.push_back(value);
+      else if (tag == "history")
+        history.push_back(value);
+    }
+    visited_dirs.load(dataFilePath(".neoshell_dirs"));
+  }
+#endif
+
 public:
   NeoShell()
       : show_timestamps(false), smart_suggest(true), command_count(0),
-        current_theme("default") {
+        current_theme("default"), last_status(0), output_tee(cout.rdbuf()),
+        replay_next(0), replaying(false), replay_timed(false),
+        cwd_valid(false), last_command_ns(0) {
+#ifndef _WIN32
+    hash_cache_loaded = false;
+#endif
+#ifdef __linux__
+    usage_cache_loaded = false;
+    session_state_fd = -1;
+    session_history_base = 0;
+#endif
+    cout.rdbuf(&output_tee);
     getUsername();
     session_start = time(0);
     initializeCommandMap();
 
+    visited_dirs.load(dataFilePath(".neoshell_dirs"));
+    visited_dirs.startAging();
+
+    // Scripts and replays get the plain prompt without running git
+#ifdef _WIN32
+    prompt_vcs = _isatty(_fileno(stdin)) != 0;
+#else
+    prompt_vcs = isatty(STDIN_FILENO) != 0;
+#endif
+    compilePromptTheme();
+
     // Default useful aliases
     aliases["ll"] = "ls -la";
     aliases[".."] = "cd ..";
@@ -855,6 +8945,250 @@ public:
     aliases["back"] = "cd ..";
   }
 
+  ~NeoShell() {
+    visited_dirs.stopAging();
+    visited_dirs.save();
+    cout.flush();
+    cout.rdbuf(output_tee.original());
+  }
+
+#ifdef __linux__
+  // neoshell --daemon: keeps this shell's state and caches warm and forks a
+  // session from it for each client. Returns the daemon's exit code, or -1
+  // inside a forked session, which should go on to run() and endSession().
+  int serveDaemon(const string &path) {
+    int probe = connectDaemon(path);
+    if (probe >= 0) {
+      close(probe);
+      cout << "Error: A NeoShell daemon is already listening on " << path
+           << endl;
+      return 1;
+    }
+    struct sockaddr_un addr;
+    if (!socketAddress(path, addr)) {
+      cout << "Error: Socket path too long: " << path << endl;
+      return 1;
+    }
+    unlink(path.c_str());
+    int listener =
+        socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    mode_t saved_umask = umask(077);
+    bool listening = listener >= 0 &&
+                     bind(listener, (struct sockaddr *)&addr,
+                          sizeof(addr)) == 0 &&
+                     listen(listener, SOMAXCONN) == 0;
+    umask(saved_umask);
+    if (!listening) {
+      cout << "Error: Cannot listen on " << path << ": " << strerror(errno)
+           << endl;
+      if (listener >= 0)
+        close(listener);
+      return 1;
+    }
+
+    sigset_t handled, saved_mask;
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGCHLD);
+    sigaddset(&handled, SIGINT);
+    sigaddset(&handled, SIGTERM);
+    sigaddset(&handled, SIGHUP);
+    sigprocmask(SIG_BLOCK, &handled, &saved_mask);
+    int signals = signalfd(-1, &handled, SFD_NONBLOCK | SFD_CLOEXEC);
+    int poller = epoll_create1(EPOLL_CLOEXEC);
+    void (*saved_pipe)(int) = signal(SIGPIPE, SIG_IGN);
+    watchFd(poller, listener, DAEMON_LISTENER, 0);
+    watchFd(poller, signals, DAEMON_SIGNALS, 0);
+
+    // No threads may be running when we fork; sessions age the frecency
+    // database themselves. Warm what later sessions would otherwise load.
+    visited_dirs.stopAging();
+    loadUsageCache();
+    process_table.refresh(true);
+    last_process_refresh = chrono::steady_clock::now();
+    cout << "NeoShell daemon listening on " << path << endl;
+
+    map<uint64_t, DaemonSession> sessions;
+    map<pid_t, uint64_t> session_ids;
+    uint64_t next_id = 1;
+    bool stopping = false;
+    struct epoll_event events[64];
+    while (!stopping) {
+      int ready = epoll_wait(poller, events, 64, -1);
+      if (ready < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      for (int e = 0; e < ready; e++) {
+        uint64_t role = events[e].data.u64 & 3, id = events[e].data.u64 >> 2;
+        if (role == DAEMON_LISTENER) {
+          int conn;
+          while ((conn = accept4(listener, NULL, NULL,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            DaemonSession session;
+            session.conn = conn;
+            session.state_fd = -1;
+            session.pid = 0;
+            sessions[next_id] = session;
+            watchFd(poller, conn, DAEMON_CLIENT, next_id++);
+          }
+          continue;
+        }
+        if (role == DAEMON_SIGNALS) {
+          struct signalfd_siginfo info;
+          while (read(signals, &info, sizeof(info)) == sizeof(info)) {
+            if (info.ssi_signo == SIGCHLD)
+              reapSessions(poller, sessions, session_ids);
+            else
+              stopping = true;
+          }
+          continue;
+        }
+
+        auto it = sessions.find(id);
+        if (it == sessions.end())
+          continue;
+        DaemonSession &session = it->second;
+        if (role == DAEMON_STATE) {
+          char buffer[65536];
+          ssize_t n;
+          while ((n = read(session.state_fd, buffer, sizeof(buffer))) > 0)
+            session.state.append(buffer, n);
+          if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            close(session.state_fd);
+            session.state_fd = -1;
+            importState(session.state);
+          }
+        } else if (session.pid == 0) {
+          string cwd;
+          int fds[3];
+          if (!receiveHello(session.conn, cwd, fds)) {
+            // Woken early; the hello is still on its way
+            if (errno == EAGAIN)
+              continue;
+            close(session.conn);
+            session.conn = -1;
+          } else if (forkSession(session, cwd, fds, sessions, saved_mask,
+                                 saved_pipe)) {
+            close(poller);
+            close(signals);
+            close(listener);
+            return -1;
+          } else if (session.pid > 0) {
+            session_ids[session.pid] = id;
+            watchFd(poller, session.state_fd, DAEMON_STATE, id);
+          }
+        } else {
+          char buffer[64];
+          ssize_t n = read(session.conn, buffer, sizeof(buffer));
+          for (ssize_t b = 0; b < n; b++) {
+            if (buffer[b] == DAEMON_INTERRUPT)
+              kill(-session.pid, SIGINT);
+            else if (buffer[b] == DAEMON_RESIZE)
+              kill(-session.pid, SIGWINCH);
+          }
+          if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            // The client went away; its terminal is no longer ours to use
+            kill(-session.pid, SIGHUP);
+            close(session.conn);
+            session.conn = -1;
+          }
+        }
+        if (session.conn < 0 && session.state_fd < 0 && session.pid <= 0)
+          sessions.erase(it);
+      }
+    }
+
+    for (auto &entry : sessions) {
+      if (entry.second.pid > 0)
+        kill(-entry.second.pid, SIGHUP);
+    }
+    close(poller);
+    close(signals);
+    close(listener);
+    unlink(path.c_str());
+    signal(SIGPIPE, saved_pipe);
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+    cout << "NeoShell daemon stopped" << endl;
+    return 0;
+  }
+
+  // Sends this session's state back to the daemon so the next session
+  // starts from it
+  void endSession() {
+    if (session_state_fd < 0)
+      return;
+    string state = exportState();
+    writeAll(session_state_fd, state.data(), state.size());
+    close(session_state_fd);
+    session_state_fd = -1;
+  }
+#endif
+
+  bool startRecording(const string &path) {
+    if (!recorder.start(path))
+      return false;
+    if (!replaying)
+      output_tee.addSink(&output_counter);
+    recorder.cwd(getCurrentPath());
+    return true;
+  }
+
+  // Loads a session log to be fed through run() instead of stdin
+  bool startReplay(const string &path, bool timed) {
+    vector<SessionEntry> entries;
+    if (!loadSessionLog(path, entries))
+      return false;
+
+    string initial_cwd, cwd;
+    replay_commands.clear();
+    for (const SessionEntry &entry : entries) {
+      if (entry.tag == SESSION_INPUT) {
+        ReplayCommand c;
+        c.input = entry.text;
+        c.at_us = entry.at_us;
+        c.recorded_result = c.replayed_result = false;
+        c.recorded_bytes = c.recorded_us = c.recorded_status = 0;
+        c.replayed_bytes = c.replayed_us = c.replayed_status = 0;
+        c.recorded_cwd = cwd;
+        replay_commands.push_back(c);
+      } else if (entry.tag == SESSION_CWD) {
+        cwd = entry.text;
+        if (replay_commands.empty())
+          initial_cwd = cwd;
+        else
+          replay_commands.back().recorded_cwd = cwd;
+      } else if (entry.tag == SESSION_RESULT && !replay_commands.empty()) {
+        ReplayCommand &c = replay_commands.back();
+        c.recorded_result = true;
+        c.recorded_bytes = entry.output_bytes;
+        c.recorded_us = entry.duration_us;
+        c.recorded_status = entry.status;
+      }
+    }
+
+#ifdef _WIN32
+    bool moved = initial_cwd.empty() ||
+                 SetCurrentDirectoryA(initial_cwd.c_str());
+#else
+    bool moved = initial_cwd.empty() || chdir(initial_cwd.c_str()) == 0;
+#endif
+    cwd_valid = false;
+    if (!moved) {
+      cout << "Warning: recorded directory " << initial_cwd
+           << " is missing, replaying from " << getCurrentPath() << endl;
+    }
+
+    replay_next = 0;
+    replay_timed = timed;
+    replaying = true;
+    prompt_vcs = false;
+    if (!recorder.active())
+      output_tee.addSink(&output_counter);
+    replay_start = chrono::steady_clock::now();
+    return true;
+  }
+
   void run() {
     cout << "\n=== Welcome to NeoShell v3.0 ===" << endl;
     cout << "Advanced Human-Friendly Terminal\n" << endl;
@@ -863,16 +9197,24 @@ public:
 
     string input;
     while (true) {
+      // Whatever the last command printed is complete once we prompt again
+      output_capture.end();
       cout << getPrompt();
 
-      if (!getline(cin, input))
+      beginStages();
+      if (!readInput(input))
         break;
+      markStage(STAGE_READ);
+      output_counter.bytes = 0;
+      last_status = 0;
 
       input.erase(0, input.find_first_not_of(" \t"));
       input.erase(input.find_last_not_of(" \t") + 1);
 
       if (input.empty())
         continue;
+      if (recorder.active())
+        recorder.input(input);
 
       // Handle history execution
       if (input[0] == '!') {
@@ -896,9 +9238,11 @@ public:
 
       history.push_back(input);
       command_count++;
+      output_capture.begin(history.size(), input);
 
       // Expand variables
       input = expandVariables(input);
+      markStage(STAGE_EXPAND);
 
       // Check aliases
       vector<string> words = split(input, ' ');
@@ -909,11 +9253,13 @@ public:
         }
         input = aliases[words[0]] + rest;
       }
+      markStage(STAGE_ALIAS);
 
       // Parse command
       vector<string> args = split(input, ' ');
       if (args.empty())
         continue;
+      markStage(STAGE_PARSE);
 
       // Translate human-friendly commands
       string original_cmd = args[0];
@@ -923,6 +9269,9 @@ public:
       }
 
       string cmd = args[0];
+      markStage(STAGE_DISPATCH);
+      command_start = stage_mark;
+      bool external = false;
 
       // Built-in commands
       if (cmd == "exit" || cmd == "quit" || original_cmd == "bye") {
@@ -934,18 +9283,14 @@ public:
       } else if (cmd == "history" || original_cmd == "past" ||
                  original_cmd == "previous") {
         showHistory(args);
+      } else if (original_cmd == "output") {
+        builtinOutput(args);
       } else if (cmd == "cd" || original_cmd == "goto" ||
                  original_cmd == "go" || original_cmd == "navigate") {
-        if (args.size() > 1) {
-#ifdef _WIN32
-          if (!SetCurrentDirectoryA(args[1].c_str())) {
-            cout << "Cannot access directory: " << args[1] << endl;
-          }
-#else
-          if (chdir(args[1].c_str()) != 0) {
-            cout << "Cannot access directory: " << args[1] << endl;
-          }
-#endif
+        if (args.size() > 1 && args[1] == "-l") {
+          listVisitedDirs(vector<string>(args.begin() + 2, args.end()));
+        } else if (args.size() > 1) {
+          jumpTo(vector<string>(args.begin() + 1, args.end()));
         } else {
           cout << getCurrentPath() << endl;
         }
@@ -988,7 +9333,39 @@ public:
       } else if (original_cmd == "calc") {
         calculator(args);
       } else if (original_cmd == "stats") {
-        showStats();
+        showStats(args);
+      } else if (original_cmd == "record") {
+        handleRecord(args);
+      } else if (original_cmd == "trace") {
+        handleTrace(args);
+#ifndef _WIN32
+      } else if (original_cmd == "parallel" || original_cmd == "each") {
+        builtinParallel(args, original_cmd == "each");
+      } else if (original_cmd == "watch") {
+        builtinWatch(args);
+      } else if (original_cmd == "mirror") {
+        builtinMirror(args);
+      } else if (original_cmd == "query") {
+        builtinQuery(args);
+      } else if (original_cmd == "checksum") {
+        builtinChecksum(args);
+      } else if (original_cmd == "dupes" || original_cmd == "duplicates") {
+        builtinDupes(args);
+#endif
+#ifdef __linux__
+      } else if ((original_cmd == "sysinfo" || original_cmd == "neofetch") &&
+                 args.size() > 1 && args[1] == "--sample") {
+        sampleSystem(args.size() > 2 ? atof(args[2].c_str()) : 1.0);
+      } else if (original_cmd == "usage") {
+        builtinUsage(args);
+      } else if (original_cmd == "onchange") {
+        builtinOnChange(args);
+      } else if (original_cmd == "memory" || original_cmd == "ram") {
+        builtinMemory();
+      } else if (original_cmd == "diskspace" || original_cmd == "space" ||
+                 original_cmd == "storage") {
+        builtinDiskSpace(args);
+#endif
       } else if (original_cmd == "sysinfo" || original_cmd == "neofetch") {
         showSystemInfo();
       } else if (original_cmd == "note") {
@@ -997,15 +9374,25 @@ public:
         handleTodo(args);
       } else if (original_cmd == "theme" && args.size() > 1) {
         current_theme = args[1];
+        compilePromptTheme();
         cout << "Theme changed to: " << current_theme << endl;
       } else if (original_cmd == "timestamp" && args.size() > 1) {
         show_timestamps = (args[1] == "on");
+        compilePromptTheme();
         cout << "Timestamps " << (show_timestamps ? "enabled" : "disabled")
              << endl;
       } else if (original_cmd == "suggest" && args.size() > 1) {
         smart_suggest = (args[1] == "on");
         cout << "Smart suggestions " << (smart_suggest ? "enabled" : "disabled")
              << endl;
+#ifdef __linux__
+      } else if (original_cmd == "running" || original_cmd == "processes" ||
+                 original_cmd == "tasks") {
+        builtinProcesses(args);
+      } else if ((original_cmd == "stop" || original_cmd == "terminate") &&
+                 hasProcessPattern(args)) {
+        builtinStop(args);
+#endif
       } else if (cmd == "ls" || original_cmd == "list" ||
                  original_cmd == "show" || original_cmd == "files") {
         // Restore original command args for builtin function
@@ -1047,17 +9434,81 @@ public:
         for (size_t i = 1; i < args.size(); i++) {
           full_cmd += " " + args[i];
         }
-        int result = system(full_cmd.c_str());
+        external = true;
+        int result = runExternal(full_cmd);
         if (result != 0 && smart_suggest) {
           showSmartSuggestion(original_cmd);
         }
       }
+      markStage(STAGE_EXEC);
+      tracer.span(external ? "external" : "builtin", original_cmd.c_str(),
+                  command_start, stage_mark);
+      recordTimings(original_cmd);
+      finishCommand();
     }
+
+    if (replaying)
+      printReplayReport();
   }
 };
 
-int main() {
+#ifndef NEOSHELL_NO_MAIN
+int main(int argc, char **argv) {
+  string record_path, replay_path, socket_path;
+  bool timed = false, as_daemon = false, client = false;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--record" && i + 1 < argc) {
+      record_path = argv[++i];
+    } else if (arg == "--replay" && i + 1 < argc) {
+      replay_path = argv[++i];
+    } else if (arg == "--timed") {
+      timed = true;
+#ifdef __linux__
+    } else if (arg == "--daemon") {
+      as_daemon = true;
+    } else if (arg == "--client") {
+      client = true;
+    } else if (arg == "--socket" && i + 1 < argc) {
+      socket_path = argv[++i];
+#endif
+    } else {
+      cout << "Usage: neoshell [--record <log>] [--replay <log> [--timed]]"
+           << endl;
+#ifdef __linux__
+      cout << "       neoshell --daemon|--client [--socket <path>]" << endl;
+#endif
+      return arg == "--help" ? 0 : 1;
+    }
+  }
+
+#ifdef __linux__
+  if (socket_path.empty())
+    socket_path = defaultDaemonSocket();
+  if (client)
+    return runDaemonClient(socket_path);
+#endif
+
   NeoShell shell;
+#ifdef __linux__
+  if (as_daemon) {
+    int code = shell.serveDaemon(socket_path);
+    if (code >= 0)
+      return code;
+  }
+#endif
+  if (!replay_path.empty() && !shell.startReplay(replay_path, timed)) {
+    cout << "Error: Cannot read session log '" << replay_path << "'" << endl;
+    return 1;
+  }
+  if (!record_path.empty() && !shell.startRecording(record_path)) {
+    cout << "Error: Cannot write session log '" << record_path << "'" << endl;
+    return 1;
+  }
   shell.run();
+#ifdef __linux__
+  shell.endSession();
+#endif
   return 0;
 }
+#endif